@@ -1,3 +1,9 @@
 #!/bin/sh
 
-gcc -O2 -Wall main.c -o v4l2_sdl_view $(pkg-config --cflags --libs sdl3) -pthread
+# The direct ALSA backend (--alsa-capture) is built in when alsa is present.
+ALSA=""
+if pkg-config --exists alsa; then
+  ALSA="-DHAVE_ALSA $(pkg-config --cflags --libs alsa)"
+fi
+
+gcc -O2 -Wall main.c -o v4l2_sdl_view $(pkg-config --cflags --libs sdl3) $ALSA -pthread -lm
@@ -1,26 +1,274 @@
 #define _GNU_SOURCE
 #include <SDL3/SDL.h>
 #include <SDL3/SDL_audio.h>
+#ifdef HAVE_ALSA
+#include <alsa/asoundlib.h>
+#endif
 #include <errno.h>
 #include <fcntl.h>
+#include <linux/futex.h>
+#include <linux/io_uring.h>
 #include <linux/videodev2.h>
+#include <math.h>
 #include <pthread.h>
 #include <signal.h>
+#include <stdatomic.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/ioctl.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <time.h>
 #include <unistd.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
 
 #define SPECS_STEREO 2
+#define AUDIO_CHUNK_BYTES 4096
+#define AUDIO_IDLE_POLL_MS 100
+#define AUDIO_STATS_INTERVAL_MS 5000
+#define AUDIO_TARGET_MS_DEFAULT 40
+#define AUDIO_DRIFT_MAX_PPM 2000
+#define VIDEO_BUFFERS 8
+#define AV_SYNC_INTERVAL_MS 500
+#define AV_SYNC_TOLERANCE_US 2000
+#define AV_DELAY_MAX_MS_DEFAULT 500
+#define AV_DELAY_STEP_US 10000
+#define VIDEO_FPS_FALLBACK 60
+#define AUDIO_MAX_CHANNELS 8
+#define METER_RMS_WINDOW_MS 300
+#define METER_PEAK_DECAY_DB_S 20.0
+#define OVERLAY_METER 0x1
+#define AUDIO_HIST_BINS 10
+#define AUDIO_LOSS_BASELINE_S 60.0
+#define ALSA_PERIOD_DEFAULT 64
+#define DOWNMIX_SIDE_GAIN 0.70710678f // -3dB for centre and surrounds
+#define OVERLAY_SPECTRUM 0x2
+#define SPECTRUM_FFT_LOG2 11
+#define SPECTRUM_FFT_SIZE (1 << SPECTRUM_FFT_LOG2)
+#define SPECTRUM_RING_SAMPLES 16384 // power of two
+#define SPECTRUM_BANDS 48
+#define SPECTRUM_MIN_HZ 30.0f
+#define SPECTRUM_FALL_DB_S 40.0f
+#define SPECTRUM_IDLE_MS 500 // longest sleep without a doorbell ring
+#define PROBE_TRIALS_DEFAULT 10
+#define PROBE_CHIRP_MS 20
+#define PROBE_MAX_MS 1000 // longest round trip searched for
+#define PROBE_GAP_MS 300
+#define PROBE_SETTLE_MS 1000
+#define PROBE_MIN_CORR 0.4f
+#define AUDIO_TAP_MAGIC 0x50415456u // "VTAP"
+#define AUDIO_TAP_VERSION 1
+#define AUDIO_TAP_SECONDS 4
+#define AUDIO_STANDBY_MS_DEFAULT 5000
+#define AUDIO_STANDBY_POLL_MS 500
+#define AUDIO_SILENCE_LEVEL 8 // S16 LSBs, about -72dBFS
+#define AUDIO_MAX_SOURCES 4 // recording devices mixed in besides the main one
+#define AUDIO_SOURCE_TARGET_MS 20
+#define RECORD_QUEUE_DEPTH 8 // frames in flight to the disk
+#define RECORD_ALIGN 4096    // O_DIRECT offset, length and memory alignment
+#define RECORD_FRAME_HEADER 64
+#define RECORD_REPORT_MS 5000
+#define SEGMENT_PATH_MAX 4096
+#define SEGMENT_DONE_SLOTS 4 // finished segments waiting for their header
+#define MKV_VIDEO_SLOTS 8
+#define MKV_AUDIO_SLOTS 256   // AUDIO_CHUNK_BYTES each
+#define MKV_CLUSTER_MS 1000   // a new cluster at the first frame after this
+#define MKV_INTERLEAVE_MS 250 // how long one track waits for the other
+#define MKV_AUDIO_WAIT_MS 2000
+#define MKV_WRITE_BUF (1 << 20)
+#define MKV_IDLE_MS 500 // longest sleep without a doorbell ring
+#define Y4M_PIPE_BYTES (1 << 20) // asked for with F_SETPIPE_SZ
+#define PACK_MAX_THREADS 16
+#define PACK_JOBS_PER_THREAD 2 // frames waiting or being packed per worker
+#define PACK_BLOCK 16          // residuals sharing one bit width
+#define REPLAY_MB_DEFAULT 1024
+#define REPLAY_CHUNK_MS 5 // shortest audio chunk the audio ring is sized for
+#define TIMESHIFT_MB_DEFAULT 4096
+#define TIMESHIFT_READAHEAD 8 // frames asked for ahead of the playback point
+#define PLAY_SLOTS 8            // packed frames decoded ahead
+#define PLAY_MAX_DECODERS 4
+#define PLAY_READAHEAD 16 // frames of the file asked for ahead
+#define PLAY_SEEK_S 5
+#define PLAY_IDLE_MS 2 // poll while the wanted frame is still being decoded
+#define PLAY_TITLE_MS 250
+#define SHOT_SLOTS 4 // screenshots waiting to be written
+#define VERIFY_MAX_THREADS 16
+#define VERIFY_BATCH 8 // frames a verify thread takes at a time
+#define CONVERT_MAX_THREADS 16
+#define CONVERT_BATCH_BYTES (16 << 20) // output a thread writes at once
 
 typedef struct {
   void *start;
   size_t length;
 } buffer_t;
 
+// A/V latency estimates and the delays used to line the two paths up. Video
+// latency is published by the video thread; the audio thread runs the
+// alignment and owns the automatic delays. User delays come from the command
+// line and hotkeys and are added on top.
+typedef struct {
+  int enabled;
+  int audio_fixed;             // audio path cannot be delayed (ALSA backend)
+  int max_delay_us;            // capacity of both delay lines
+  atomic_int video_latency_us; // V4L2 capture timestamp -> present
+  atomic_int audio_latency_us; // recording buffer + queue + playback buffer
+  atomic_int offset_us;        // residual offset beyond the user delays
+  atomic_int video_delay_us;   // automatic video delay
+  atomic_int audio_delay_us;   // automatic audio delay
+  atomic_int video_user_us;
+  atomic_int audio_user_us;
+} av_sync_t;
+
+// Per-channel levels published by the recording callback for the overlay and
+// the periodic stats. Levels are linear, Q16 (65536 = full scale).
+typedef struct {
+  atomic_int channels;
+  atomic_int peak_q16[AUDIO_MAX_CHANNELS]; // decaying peak hold
+  atomic_int rms_q16[AUDIO_MAX_CHANNELS];  // over METER_RMS_WINDOW_MS
+  atomic_llong kernel_ns;                  // time spent in audio_levels()
+  atomic_int kernel_chunks;
+} audio_meter_t;
+
+// Doorbell for a consumer thread that would otherwise poll. Producers ring it
+// after publishing work and only make the wake syscall while the consumer is
+// asleep; the consumer reads seq, looks for work, and if there is none sleeps
+// on that seq, so a ring in between is never lost.
+typedef struct {
+  atomic_uint seq;
+  atomic_int sleepers;
+} doorbell_t;
+
+static void doorbell_ring(doorbell_t *d) {
+  atomic_fetch_add(&d->seq, 1);
+  if (atomic_load(&d->sleepers))
+    syscall(SYS_futex, &d->seq, FUTEX_WAKE, INT32_MAX, NULL, NULL, 0);
+}
+
+static void doorbell_wait(doorbell_t *d, unsigned seq, int timeout_ms) {
+  struct timespec ts = {timeout_ms / 1000, (long)(timeout_ms % 1000) * 1000000};
+  atomic_fetch_add(&d->sleepers, 1);
+  if (atomic_load(&d->seq) == seq)
+    syscall(SYS_futex, &d->seq, FUTEX_WAIT, seq, &ts, NULL, 0);
+  atomic_fetch_sub(&d->sleepers, 1);
+}
+
+// Spectrum analyzer. The recording callback pushes a mono mix into a
+// single-producer/single-consumer ring and never waits: when the worker falls
+// behind, samples are dropped. The worker publishes log-spaced bands for the
+// overlay as linear Q16 amplitudes (65536 = full-scale sine). Nothing is
+// pushed while the overlay is hidden or playback is on standby, and the
+// worker sleeps on the doorbell until half a window has arrived.
+typedef struct {
+  float ring[SPECTRUM_RING_SAMPLES];
+  atomic_uint wr; // free-running sample counters; only the producer moves wr
+  atomic_uint rd; // and only the worker moves rd
+  atomic_int freq;
+  atomic_llong dropped;
+  atomic_int band_q16[SPECTRUM_BANDS];
+  atomic_int bands; // 0 until the first transform is published
+  atomic_int enabled; // the overlay is shown
+  doorbell_t bell;
+} spectrum_t;
+
+// Matroska recording: both pipelines hand timestamped packets to the muxer
+// thread through single-producer/single-consumer rings and never wait on
+// it; a full ring drops the packet and counts it. Each side describes its
+// format once (the *_ready flags) before its first packet, and rings the
+// doorbell after every publish so the idle muxer can sleep.
+typedef struct {
+  Uint64 capture_ns;
+  size_t bytes;
+} mkv_packet_t;
+
+typedef struct {
+  // video: filled by the video thread
+  int width, height;
+  size_t frame_bytes;
+  uint8_t *video_data; // MKV_VIDEO_SLOTS * frame_bytes
+  mkv_packet_t video_pkt[MKV_VIDEO_SLOTS];
+  atomic_uint video_wr, video_rd;
+  atomic_int video_ready;
+  atomic_llong video_dropped;
+
+  // audio: filled by the audio callback
+  SDL_AudioFormat format;
+  int channels, freq;
+  Uint8 audio_data[MKV_AUDIO_SLOTS][AUDIO_CHUNK_BYTES];
+  mkv_packet_t audio_pkt[MKV_AUDIO_SLOTS];
+  atomic_uint audio_wr, audio_rd;
+  atomic_int audio_ready;
+  atomic_llong audio_dropped;
+
+  doorbell_t bell;
+} mkv_queue_t;
+
+// Instant replay: the video thread and the audio callback keep the last few
+// seconds in preallocated rings, without locks and without waiting. A save
+// runs on its own thread and writes a Matroska clip; while it does, both
+// producers leave the packets it has yet to write alone and skip (and
+// count) anything that would overwrite them, so capture never stalls and
+// the clip stays intact.
+typedef struct {
+  int seconds;
+  size_t cap_bytes;
+  const char *dir;
+
+  // video: filled by the video thread
+  int width, height;
+  size_t frame_bytes;
+  unsigned nframes;
+  uint8_t *video_data; // nframes * frame_bytes
+  mkv_packet_t *video_pkt;
+  atomic_uint video_wr;
+
+  // audio: filled by the audio callback
+  SDL_AudioFormat format;
+  int channels, freq;
+  unsigned nchunks;
+  Uint8 (*audio_data)[AUDIO_CHUNK_BYTES];
+  mkv_packet_t *audio_pkt;
+  atomic_uint audio_wr;
+  atomic_int audio_ready;
+
+  // saving: the first packet of each ring not yet written
+  atomic_int saving;
+  atomic_uint video_keep, audio_keep;
+  atomic_llong skipped;
+  unsigned video_end, audio_end;
+  pthread_t thread;
+  int have_thread;
+  char path[512];
+} replay_t;
+
+// Glitch telemetry. Counters are cumulative; the histogram is drained by
+// every report.
+typedef struct {
+  atomic_int starved;          // playback pulls that found the queue short
+  atomic_llong starved_bytes;  // silence the device had to make up
+  atomic_int loss_events;      // recording input gaps and overflows
+  atomic_llong lost_frames;    // input frames lost in those events
+  atomic_llong received;       // frames delivered by the recording device
+  atomic_llong video_cpu_ns;   // CPU time used by the video thread
+  atomic_int hist[AUDIO_HIST_BINS]; // out_stream depth at each pull
+
+  // the previous report's totals, only touched by the reporting thread
+  int last_starved, last_loss;
+  long long last_cpu_ns;
+} audio_stats_t;
+
+// Upper bounds (ms) of the queue depth histogram bins; the last is open.
+static const int audio_hist_edges_ms[AUDIO_HIST_BINS - 1] = {
+    5, 10, 20, 30, 40, 60, 80, 120, 200};
+
 typedef struct {
   int fd;
   const char *dev;
@@ -41,15 +289,210 @@ typedef struct {
   struct timeval *tv;
   int *r;
   struct v4l2_buffer *buf;
+  av_sync_t *sync;
+  audio_meter_t *meter;
+  audio_stats_t *stats;
+  spectrum_t *spectrum;
+  const char *record_path; // raw YUYV recording, or NULL
+  int record_segment_s;    // split into segments this long, 0 = one file
+  uint64_t record_quota;   // bytes kept of a segmented recording, 0 = all
+  const char *lossless_path; // compressed recording, or NULL
+  int lossless_threads;
+  const char *timeshift_path; // disk ring behind the pause key, or NULL
+  size_t timeshift_bytes;
+  mkv_queue_t *mkv;        // Matroska recording, or NULL
+  replay_t *replay;        // instant replay, or NULL
+  int stdout_fd;           // Y4M stream, or -1
+  const char *shot_dir;    // where screenshots go
 } proc_video_args_t;
 
 typedef struct {
   const char *dev; // recording device selector (substring or index string)
-  int sample_rate;
-  int out;      // playback device index, -1 = default
-  int *running; // shared running flag
+  int sample_rate; // 0 = recording device's native rate
+  int out;         // playback device index, -1 = default
+  int target_ms;   // desired playback queue depth
+  int *running;    // shared running flag
+  av_sync_t *sync;
+  audio_meter_t *meter;
+  audio_stats_t *stats;
+  spectrum_t *spectrum;
+  const char *stats_path;   // CSV export of the periodic report, or NULL
+  const char *alsa_capture; // direct ALSA backend when set
+  const char *alsa_playback;
+  int alsa_period;       // frames
+  const char *mix_gain;  // per input channel gain in dB, "g0,g1,..."
+  const char *mix_mute;  // muted input channels, "c,c,..."
+  const char *mix_map;   // output channel sources, "c,c,..."
+  int probe_trials;      // > 0: measure round-trip latency instead
+  const char *tap_path;  // symlink to the shared-memory tap, or NULL
+  int standby_ms;        // silence before playback pauses, 0 = never
+  const char *sources[AUDIO_MAX_SOURCES]; // extra inputs, "selector[@dB]"
+  int nsources;
+  mkv_queue_t *mkv; // Matroska recording, or NULL
+  replay_t *replay; // instant replay, or NULL
 } proc_audio_args_t;
 
+// Shared-memory tap: the recorded PCM, as captured, in a memfd that other
+// local processes map. The header sits in the first page and the ring
+// follows it. There is one writer and any number of readers, and nothing is
+// locked: a reader keeps its own byte position, copies or processes
+// data[pos & (ring_bytes - 1)] up to write_pos, and is overrun when write_pos
+// gets more than ring_bytes ahead of it. seq is bumped after every write and
+// doubles as a futex word; readers that want to sleep increment waiters and
+// FUTEX_WAIT on seq, which needs a writable mapping.
+typedef struct {
+  uint32_t magic; // AUDIO_TAP_MAGIC
+  uint32_t version;
+  uint32_t header_bytes; // offset of the ring
+  uint32_t ring_bytes;   // power of two
+  uint32_t format;       // SDL_AudioFormat
+  uint32_t channels;
+  uint32_t rate;
+  uint32_t frame_bytes;
+  _Atomic uint64_t write_pos; // bytes written since start
+  _Atomic uint32_t seq;
+  _Atomic uint32_t waiters;
+} audio_tap_header_t;
+
+typedef struct {
+  int fd;
+  size_t map_bytes;
+  audio_tap_header_t *hdr;
+  uint8_t *ring;
+  char *link; // symlink created for readers
+} audio_tap_t;
+
+// Round-trip latency probe. The passthrough keeps running, but what it sends
+// to playback is replaced by silence and, once per trial, a chirp; the
+// recording is then searched for the chirp by cross-correlation. Positions
+// count captured frames: a chirp sent in place of frame n and found at frame
+// m took m - n frames, which is the whole capture -> playback -> capture path
+// as passthrough audio sees it. The stream side (capture, render) runs on
+// the audio callback; probe_poll() runs the search on the audio thread.
+typedef struct {
+  int trials;
+  int rate;
+  int max_lag; // frames
+  float *chirp;
+  int chirp_len;
+  float chirp_energy;
+  float *history; // mono capture, indexed by frame & history_mask
+  int history_mask;
+  float *window; // contiguous copy of one trial's search range
+  atomic_llong in_pos;    // frames captured so far
+  atomic_llong next_at;   // earliest frame for the next chirp
+  atomic_llong inject_at; // frame the last chirp replaced
+  atomic_int requested;   // trials asked for by probe_poll()
+  atomic_int fired;       // trials started by probe_render()
+  atomic_int glitched;    // the stream restarted during this trial
+  int chirp_pos;          // render side, -1 when idle
+  int done;
+  int found;
+  double *results; // ms, one per detected trial
+} latency_probe_t;
+
+// Channel stage as one gain matrix: gain, mute, remap and downmix all fold
+// into cols[in][out]. Output never has more channels than input, so it can
+// run in place.
+typedef struct {
+  int in_channels;
+  int out_channels;
+  int active; // 0 = identity, the chunk passes untouched
+  float cols[AUDIO_MAX_CHANNELS][AUDIO_MAX_CHANNELS];
+} audio_mix_t;
+
+// Preallocated ring of captured frames used to delay video. Frames are kept
+// as the driver delivered them (YUYV, 2 bytes/pixel) and only converted when
+// they are shown.
+typedef struct {
+  uint8_t *data; // slots * slot_size
+  size_t slot_size;
+  Uint64 *capture_ns;
+  int slots;
+  int head;
+  int count;
+} video_delay_t;
+
+// PI controller that holds the playback queue at target_ms by nudging the
+// out_stream frequency ratio, absorbing capture/playback clock drift.
+typedef struct {
+  double target_ms;
+  double depth_ms; // smoothed queue depth
+  double integral; // accumulated error, ms*s
+  double ratio;
+} audio_drift_t;
+
+// An extra recording device mixed into the main one. Its stream converts to
+// the playback format; the main callback pulls as many frames as the main
+// device delivered, so each source runs on the main device's clock. The
+// audio thread keeps the stream's backlog at AUDIO_SOURCE_TARGET_MS with its
+// own drift controller on the stream's frequency ratio.
+typedef struct {
+  const char *sel;
+  float gain; // linear
+  SDL_AudioDeviceID dev;
+  SDL_AudioStream *stream;
+  audio_drift_t drift;
+  int target_bytes;
+  atomic_int primed;    // backlog reached the target, mixing in
+  atomic_int underruns; // pulls that found the backlog short
+  atomic_int resyncs;   // backlog trimmed back to the target
+} audio_source_t;
+
+// Passthrough state shared with the recording stream's put callback, which
+// runs on SDL's recording device thread.
+typedef struct {
+  SDL_AudioStream *out_stream;
+  SDL_AudioDeviceID out_dev;
+  int prime_bytes; // playback stays paused until this much is queued
+  volatile int primed;
+  Uint8 buf[AUDIO_CHUNK_BYTES];
+  volatile int failed;
+
+  // Audio delay line, preallocated for the maximum delay and only touched by
+  // the callback. want_delay_bytes is the request from the audio thread.
+  Uint8 *ring;
+  int ring_size;
+  int ring_rd;
+  int ring_level;
+  int frame_bytes;
+  int delay_bytes;
+  Uint8 silence;
+  atomic_int want_delay_bytes;
+
+  // Channel stage between the recording and playback formats. frame_bytes
+  // above is the playback side; in_frame_bytes is what the device records.
+  audio_mix_t mix;
+  int in_frame_bytes;
+  float mixbuf[AUDIO_CHUNK_BYTES / sizeof(Sint16)];
+
+  // Level meter state, callback-owned; results go out through meter.
+  audio_meter_t *meter;
+  SDL_AudioFormat format;
+  int channels;
+  int freq;
+  float hold[AUDIO_MAX_CHANNELS];
+  float power[AUDIO_MAX_CHANNELS];
+
+  audio_stats_t *stats;
+  spectrum_t *spectrum;
+  latency_probe_t *probe; // probe mode only
+  audio_tap_t *tap;       // NULL when not shared
+
+  // Standby: after standby_bytes of continuous silence the playback device
+  // is paused and nothing is queued until the signal comes back.
+  int standby_bytes; // 0 = disabled
+  int silent_bytes;
+  atomic_int standby;
+
+  audio_source_t *sources;
+  int nsources;
+  Uint8 srcbuf[AUDIO_CHUNK_BYTES];
+
+  mkv_queue_t *mkv;
+  replay_t *replay;
+} audio_passthrough_t;
+
 static volatile sig_atomic_t g_stop = 0;
 
 static void signalHandler(int sig) {
@@ -65,6 +508,23 @@ static int xioctl(int fd, unsigned long req, void *arg) {
   return r;
 }
 
+static Uint64 mono_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (Uint64)ts.tv_sec * 1000000000ull + (Uint64)ts.tv_nsec;
+}
+
+// Capture time of a dequeued buffer on the CLOCK_MONOTONIC timeline. Drivers
+// that do not stamp monotonic time fall back to the dequeue time.
+static Uint64 v4l2_capture_ns(const struct v4l2_buffer *b) {
+  if ((b->flags & V4L2_BUF_FLAG_TIMESTAMP_MASK) ==
+          V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC &&
+      (b->timestamp.tv_sec || b->timestamp.tv_usec))
+    return (Uint64)b->timestamp.tv_sec * 1000000000ull +
+           (Uint64)b->timestamp.tv_usec * 1000;
+  return mono_ns();
+}
+
 static inline uint8_t clamp_u8(int x) {
   if (x < 0)
     return 0;
@@ -105,6 +565,931 @@ static void yuyv_to_rgb24(const uint8_t *yuyv, uint8_t *rgb, int w, int h) {
   }
 }
 
+// Per-channel peak |x| and sum of squares over interleaved S16 or F32
+// samples, normalised to full scale 1.0. peak and sumsq hold one entry per
+// channel.
+static void audio_levels_scalar(const void *data, int frames, int is_float,
+                                int channels, float *peak, float *sumsq) {
+  const Sint16 *s = (const Sint16 *)data;
+  const float *f = (const float *)data;
+
+  for (int c = 0; c < channels; c++)
+    peak[c] = sumsq[c] = 0.0f;
+
+  for (int i = 0, n = frames * channels; i < n; i++) {
+    float x = is_float ? f[i] : s[i] * (1.0f / 32768.0f);
+    float a = fabsf(x);
+    int c = i % channels;
+    if (a > peak[c])
+      peak[c] = a;
+    sumsq[c] += x * x;
+  }
+}
+
+#if defined(__SSE2__)
+// Works in blocks of lcm(channels, 8) samples so that vector lane j always
+// carries channel j % channels; up to 8 channels that is at most 56 lanes.
+// Inlined so the common block of 8 gets its accumulators in registers.
+static inline __attribute__((always_inline)) void
+audio_levels_sse2(const void *data, int frames, int is_float, int channels,
+                  int block, float *peak, float *sumsq) {
+  const Sint16 *s = (const Sint16 *)data;
+  const float *f = (const float *)data;
+  int nvec = block / 4;
+  int n = frames * channels;
+  int vec = n - n % block;
+
+  const __m128 absmask = _mm_castsi128_ps(_mm_set1_epi32(0x7fffffff));
+  const __m128 scale = _mm_set1_ps(1.0f / 32768.0f);
+  __m128 pk[AUDIO_MAX_CHANNELS * 2], sq[AUDIO_MAX_CHANNELS * 2];
+  for (int v = 0; v < nvec; v++)
+    pk[v] = sq[v] = _mm_setzero_ps();
+
+  for (int i = 0; i < vec; i += block) {
+    for (int v = 0; v < nvec; v += 2) {
+      __m128 a, b;
+      if (is_float) {
+        a = _mm_loadu_ps(f + i + v * 4);
+        b = _mm_loadu_ps(f + i + v * 4 + 4);
+      } else {
+        __m128i x = _mm_loadu_si128((const __m128i *)(s + i + v * 4));
+        a = _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpacklo_epi16(x, x), 16));
+        b = _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpackhi_epi16(x, x), 16));
+        a = _mm_mul_ps(a, scale);
+        b = _mm_mul_ps(b, scale);
+      }
+      pk[v] = _mm_max_ps(pk[v], _mm_and_ps(a, absmask));
+      pk[v + 1] = _mm_max_ps(pk[v + 1], _mm_and_ps(b, absmask));
+      sq[v] = _mm_add_ps(sq[v], _mm_mul_ps(a, a));
+      sq[v + 1] = _mm_add_ps(sq[v + 1], _mm_mul_ps(b, b));
+    }
+  }
+
+  for (int c = 0; c < channels; c++)
+    peak[c] = sumsq[c] = 0.0f;
+  for (int v = 0; v < nvec; v++) {
+    float lp[4], ls[4];
+    _mm_storeu_ps(lp, pk[v]);
+    _mm_storeu_ps(ls, sq[v]);
+    for (int j = 0; j < 4; j++) {
+      int c = (v * 4 + j) % channels;
+      if (lp[j] > peak[c])
+        peak[c] = lp[j];
+      sumsq[c] += ls[j];
+    }
+  }
+
+  // vec is a multiple of channels, so the tail starts on channel 0.
+  for (int i = vec; i < n; i++) {
+    float x = is_float ? f[i] : s[i] * (1.0f / 32768.0f);
+    int c = i % channels;
+    if (fabsf(x) > peak[c])
+      peak[c] = fabsf(x);
+    sumsq[c] += x * x;
+  }
+}
+#endif
+
+static void audio_levels(const void *data, int frames, int is_float,
+                         int channels, float *peak, float *sumsq) {
+#if defined(__SSE2__)
+  if (8 % channels == 0) {
+    audio_levels_sse2(data, frames, is_float, channels, 8, peak, sumsq);
+    return;
+  }
+  if (channels <= AUDIO_MAX_CHANNELS) {
+    int block = channels;
+    while (block % 8)
+      block += channels;
+    audio_levels_sse2(data, frames, is_float, channels, block, peak, sumsq);
+    return;
+  }
+#endif
+  audio_levels_scalar(data, frames, is_float, channels, peak, sumsq);
+}
+
+// Interleaved S16 <-> F32 for the channel stage; f32_to_s16 rounds and
+// saturates.
+static void s16_to_f32(const Sint16 *in, float *out, int n) {
+  int i = 0;
+#if defined(__SSE2__)
+  const __m128 scale = _mm_set1_ps(1.0f / 32768.0f);
+  for (; i + 8 <= n; i += 8) {
+    __m128i x = _mm_loadu_si128((const __m128i *)(in + i));
+    __m128 a = _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpacklo_epi16(x, x), 16));
+    __m128 b = _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpackhi_epi16(x, x), 16));
+    _mm_storeu_ps(out + i, _mm_mul_ps(a, scale));
+    _mm_storeu_ps(out + i + 4, _mm_mul_ps(b, scale));
+  }
+#endif
+  for (; i < n; i++)
+    out[i] = in[i] * (1.0f / 32768.0f);
+}
+
+static void f32_to_s16(const float *in, Sint16 *out, int n) {
+  int i = 0;
+#if defined(__SSE2__)
+  const __m128 scale = _mm_set1_ps(32768.0f);
+  for (; i + 8 <= n; i += 8) {
+    __m128i a = _mm_cvtps_epi32(_mm_mul_ps(_mm_loadu_ps(in + i), scale));
+    __m128i b = _mm_cvtps_epi32(_mm_mul_ps(_mm_loadu_ps(in + i + 4), scale));
+    _mm_storeu_si128((__m128i *)(out + i), _mm_packs_epi32(a, b));
+  }
+#endif
+  for (; i < n; i++) {
+    float x = in[i] * 32768.0f;
+    out[i] = (Sint16)(x > 32767.0f    ? 32767
+                      : x < -32768.0f ? -32768
+                                      : lrintf(x));
+  }
+}
+
+static void audio_mix_scalar(const audio_mix_t *m, const float *in, float *out,
+                             int frames) {
+  int ic = m->in_channels, oc = m->out_channels;
+  for (int f = 0; f < frames; f++) {
+    float x[AUDIO_MAX_CHANNELS], y[AUDIO_MAX_CHANNELS];
+    memcpy(x, in + f * ic, sizeof(float) * ic);
+    for (int o = 0; o < oc; o++) {
+      y[o] = 0.0f;
+      for (int c = 0; c < ic; c++)
+        y[o] += x[c] * m->cols[c][o];
+    }
+    memcpy(out + f * oc, y, sizeof(float) * oc);
+  }
+}
+
+#if defined(__SSE2__)
+// One frame per step: every input sample is broadcast and multiplied into
+// its matrix column, so all output channels of the frame are summed at once.
+// The whole input frame is read before the output frame is stored, which
+// keeps in == out safe.
+static inline __attribute__((always_inline)) void
+audio_mix_sse2(const audio_mix_t *m, const float *in, float *out, int frames,
+               int ic, int oc) {
+  __m128 c0[AUDIO_MAX_CHANNELS], c1[AUDIO_MAX_CHANNELS];
+  for (int c = 0; c < ic; c++) {
+    c0[c] = _mm_loadu_ps(&m->cols[c][0]);
+    c1[c] = _mm_loadu_ps(&m->cols[c][4]);
+  }
+
+  for (int f = 0; f < frames; f++) {
+    const float *x = in + f * ic;
+    __m128 a0 = _mm_setzero_ps(), a1 = _mm_setzero_ps();
+    for (int c = 0; c < ic; c++) {
+      __m128 v = _mm_set1_ps(x[c]);
+      a0 = _mm_add_ps(a0, _mm_mul_ps(v, c0[c]));
+      if (oc > 4)
+        a1 = _mm_add_ps(a1, _mm_mul_ps(v, c1[c]));
+    }
+
+    float *y = out + f * oc;
+    if (oc == 2) {
+      _mm_storel_pi((__m64 *)y, a0);
+    } else if (oc == 4) {
+      _mm_storeu_ps(y, a0);
+    } else if (oc == 8) {
+      _mm_storeu_ps(y, a0);
+      _mm_storeu_ps(y + 4, a1);
+    } else {
+      float t[8];
+      _mm_storeu_ps(t, a0);
+      _mm_storeu_ps(t + 4, a1);
+      memcpy(y, t, sizeof(float) * oc);
+    }
+  }
+}
+#endif
+
+static void audio_mix_frames(const audio_mix_t *m, const float *in, float *out,
+                             int frames) {
+#if defined(__SSE2__)
+  // Constant layouts for the common cases so the channel loops unroll.
+  int ic = m->in_channels, oc = m->out_channels;
+  if (ic == 8 && oc == 2)
+    audio_mix_sse2(m, in, out, frames, 8, 2);
+  else if (ic == 6 && oc == 2)
+    audio_mix_sse2(m, in, out, frames, 6, 2);
+  else if (ic == 2 && oc == 2)
+    audio_mix_sse2(m, in, out, frames, 2, 2);
+  else if (ic == 8 && oc == 8)
+    audio_mix_sse2(m, in, out, frames, 8, 8);
+  else
+    audio_mix_sse2(m, in, out, frames, ic, oc);
+#else
+  audio_mix_scalar(m, in, out, frames);
+#endif
+}
+
+// Run the channel stage over one chunk in place; returns the new byte count.
+// S16 goes through scratch (AUDIO_CHUNK_BYTES / 2 floats) as F32.
+static int audio_mix_chunk(const audio_mix_t *m, Uint8 *buf, int bytes,
+                           SDL_AudioFormat format, float *scratch) {
+  if (!m->active)
+    return bytes;
+
+  int sample_bytes = SDL_AUDIO_BYTESIZE(format);
+  int frames = bytes / (sample_bytes * m->in_channels);
+  if (format == SDL_AUDIO_F32) {
+    audio_mix_frames(m, (const float *)buf, (float *)buf, frames);
+  } else {
+    s16_to_f32((const Sint16 *)buf, scratch, frames * m->in_channels);
+    audio_mix_frames(m, scratch, scratch, frames);
+    f32_to_s16(scratch, (Sint16 *)buf, frames * m->out_channels);
+  }
+  return frames * m->out_channels * sample_bytes;
+}
+
+// Comma-separated list into out[]; returns the number of entries.
+static int parse_list(const char *str, double *out, int max) {
+  int n = 0;
+  while (str && *str && n < max) {
+    char *end;
+    out[n++] = strtod(str, &end);
+    if (end == str)
+      return -1;
+    str = *end == ',' ? end + 1 : end;
+  }
+  return n;
+}
+
+// Build the channel stage for in_channels recorded channels and a playback
+// device with dev_channels. An explicit map picks and orders the output
+// channels; otherwise 5.1 and 7.1 fold down to a stereo device, and anything
+// else is left to SDL.
+static int audio_mix_setup(audio_mix_t *m, int in_channels, int dev_channels,
+                           const proc_audio_args_t *args) {
+  double gain[AUDIO_MAX_CHANNELS], mute[AUDIO_MAX_CHANNELS],
+      map[AUDIO_MAX_CHANNELS];
+  int ngain = parse_list(args->mix_gain, gain, AUDIO_MAX_CHANNELS);
+  int nmute = parse_list(args->mix_mute, mute, AUDIO_MAX_CHANNELS);
+  int nmap = parse_list(args->mix_map, map, AUDIO_MAX_CHANNELS);
+  if (ngain < 0 || nmute < 0 || nmap < 0) {
+    fprintf(stderr, "Bad channel list in --audio-gain/-mute/-map\n");
+    return -1;
+  }
+
+  memset(m, 0, sizeof(*m));
+  m->in_channels = in_channels;
+  if (in_channels > AUDIO_MAX_CHANNELS) {
+    m->out_channels = in_channels;
+    if (ngain || nmute || nmap)
+      fprintf(stderr, "Channel stage supports up to %d channels, ignored\n",
+              AUDIO_MAX_CHANNELS);
+    return 0;
+  }
+
+  int identity = 0;
+  if (nmap > in_channels) {
+    // The stage runs in place, so it cannot widen a frame.
+    fprintf(stderr, "--audio-map: %d output channels from %d recorded\n",
+            nmap, in_channels);
+    return -1;
+  }
+  if (nmap > 0) {
+    m->out_channels = nmap;
+    for (int o = 0; o < nmap; o++) {
+      int c = (int)map[o];
+      if (c < 0 || c >= in_channels) {
+        fprintf(stderr, "--audio-map: no input channel %d\n", c);
+        return -1;
+      }
+      m->cols[c][o] = 1.0f;
+    }
+  } else if (dev_channels == 2 && (in_channels == 6 || in_channels == 8)) {
+    // FL FR FC LFE BL BR [SL SR]; LFE is dropped and the rows are
+    // normalised so a full-scale input cannot clip.
+    const float g = DOWNMIX_SIDE_GAIN;
+    float norm = 1.0f / (1.0f + g + g * (in_channels == 8 ? 2 : 1));
+    m->out_channels = 2;
+    m->cols[0][0] = m->cols[1][1] = norm;
+    m->cols[2][0] = m->cols[2][1] = g * norm;
+    m->cols[4][0] = m->cols[5][1] = g * norm;
+    if (in_channels == 8)
+      m->cols[6][0] = m->cols[7][1] = g * norm;
+  } else {
+    m->out_channels = in_channels;
+    for (int c = 0; c < in_channels; c++)
+      m->cols[c][c] = 1.0f;
+    identity = 1;
+  }
+
+  for (int c = 0; c < in_channels; c++) {
+    float scale = c < ngain ? powf(10.0f, (float)gain[c] / 20.0f) : 1.0f;
+    for (int i = 0; i < nmute; i++)
+      if ((int)mute[i] == c)
+        scale = 0.0f;
+    if (scale != 1.0f)
+      identity = 0;
+    for (int o = 0; o < m->out_channels; o++)
+      m->cols[c][o] *= scale;
+  }
+
+  m->active = !identity;
+  if (m->active)
+    printf("audio: channel stage %d -> %d channels\n", m->in_channels,
+           m->out_channels);
+  return 0;
+}
+
+// True when every sample is within AUDIO_SILENCE_LEVEL of zero. Stops at the
+// first loud block, so music costs next to nothing.
+static int audio_is_silent(const Uint8 *data, int bytes, int is_float) {
+  const float flevel = AUDIO_SILENCE_LEVEL / 32768.0f;
+  int i = 0;
+  if (is_float) {
+    const float *x = (const float *)data;
+    int n = bytes / (int)sizeof(float);
+#if defined(__SSE2__)
+    const __m128 abs_mask = _mm_castsi128_ps(_mm_set1_epi32(0x7fffffff));
+    const __m128 level = _mm_set1_ps(flevel);
+    for (; i + 8 <= n; i += 8) {
+      __m128 a = _mm_and_ps(_mm_loadu_ps(x + i), abs_mask);
+      __m128 b = _mm_and_ps(_mm_loadu_ps(x + i + 4), abs_mask);
+      if (_mm_movemask_ps(_mm_or_ps(_mm_cmpgt_ps(a, level),
+                                    _mm_cmpgt_ps(b, level))))
+        return 0;
+    }
+#endif
+    for (; i < n; i++)
+      if (fabsf(x[i]) > flevel)
+        return 0;
+  } else {
+    const Sint16 *x = (const Sint16 *)data;
+    int n = bytes / (int)sizeof(Sint16);
+#if defined(__SSE2__)
+    const __m128i hi = _mm_set1_epi16(AUDIO_SILENCE_LEVEL);
+    const __m128i lo = _mm_set1_epi16(-AUDIO_SILENCE_LEVEL);
+    for (; i + 16 <= n; i += 16) {
+      __m128i a = _mm_loadu_si128((const __m128i *)(x + i));
+      __m128i b = _mm_loadu_si128((const __m128i *)(x + i + 8));
+      __m128i out = _mm_or_si128(
+          _mm_or_si128(_mm_cmpgt_epi16(a, hi), _mm_cmplt_epi16(a, lo)),
+          _mm_or_si128(_mm_cmpgt_epi16(b, hi), _mm_cmplt_epi16(b, lo)));
+      if (_mm_movemask_epi8(out))
+        return 0;
+    }
+#endif
+    for (; i < n; i++)
+      if (x[i] > AUDIO_SILENCE_LEVEL || x[i] < -AUDIO_SILENCE_LEVEL)
+        return 0;
+  }
+  return 1;
+}
+
+// Fold one chunk into the meter: peak hold decays at METER_PEAK_DECAY_DB_S,
+// RMS is an exponential average over METER_RMS_WINDOW_MS.
+static void audio_meter_chunk(audio_passthrough_t *pt, const Uint8 *data,
+                              int bytes) {
+  int channels = pt->channels;
+  if (channels > AUDIO_MAX_CHANNELS)
+    channels = AUDIO_MAX_CHANNELS;
+  int frames = bytes / pt->in_frame_bytes;
+  if (frames <= 0)
+    return;
+
+  float peak[AUDIO_MAX_CHANNELS], sumsq[AUDIO_MAX_CHANNELS];
+  Uint64 t0 = mono_ns();
+  if (channels == pt->channels) {
+    audio_levels(data, frames, SDL_AUDIO_ISFLOAT(pt->format), channels, peak,
+                 sumsq);
+  } else {
+    // More channels than the meter shows: measure the first ones, stepping
+    // over whole frames.
+    const Sint16 *s = (const Sint16 *)data;
+    const float *f = (const float *)data;
+    int is_float = SDL_AUDIO_ISFLOAT(pt->format);
+    for (int c = 0; c < channels; c++)
+      peak[c] = sumsq[c] = 0.0f;
+    for (int i = 0; i < frames; i++)
+      for (int c = 0; c < channels; c++) {
+        int k = i * pt->channels + c;
+        float x = is_float ? f[k] : s[k] * (1.0f / 32768.0f);
+        if (fabsf(x) > peak[c])
+          peak[c] = fabsf(x);
+        sumsq[c] += x * x;
+      }
+  }
+  atomic_fetch_add(&pt->meter->kernel_ns, (long long)(mono_ns() - t0));
+  atomic_fetch_add(&pt->meter->kernel_chunks, 1);
+
+  float dt = (float)frames / (float)pt->freq;
+  float decay = powf(10.0f, -METER_PEAK_DECAY_DB_S * dt / 20.0f);
+  float alpha = dt * 1000.0f / METER_RMS_WINDOW_MS;
+  if (alpha > 1.0f)
+    alpha = 1.0f;
+
+  for (int c = 0; c < channels; c++) {
+    pt->hold[c] *= decay;
+    if (peak[c] > pt->hold[c])
+      pt->hold[c] = peak[c];
+    pt->power[c] += alpha * (sumsq[c] / frames - pt->power[c]);
+    atomic_store(&pt->meter->peak_q16[c], (int)(pt->hold[c] * 65536.0f));
+    atomic_store(&pt->meter->rms_q16[c],
+                 (int)(sqrtf(pt->power[c]) * 65536.0f));
+  }
+  atomic_store(&pt->meter->channels, channels);
+}
+
+// Producer side of the spectrum ring: mix the chunk down to mono and append
+// what fits. Never blocks; the rest is counted as dropped.
+static void spectrum_push(audio_passthrough_t *pt, const Uint8 *data,
+                          int bytes) {
+  spectrum_t *sp = pt->spectrum;
+  if (!atomic_load_explicit(&sp->enabled, memory_order_relaxed) ||
+      atomic_load_explicit(&pt->standby, memory_order_relaxed))
+    return;
+  int frames = bytes / pt->in_frame_bytes;
+  unsigned wr = atomic_load_explicit(&sp->wr, memory_order_relaxed);
+  unsigned rd = atomic_load_explicit(&sp->rd, memory_order_acquire);
+  int room = SPECTRUM_RING_SAMPLES - (int)(wr - rd);
+  int n = frames < room ? frames : room;
+  if (n < frames)
+    atomic_fetch_add(&sp->dropped, frames - n);
+
+  int ch = pt->channels;
+  float scale = 1.0f / (float)ch;
+  if (!SDL_AUDIO_ISFLOAT(pt->format))
+    scale /= 32768.0f;
+  for (int f = 0; f < n; f++) {
+    float sum = 0.0f;
+    if (SDL_AUDIO_ISFLOAT(pt->format)) {
+      const float *x = (const float *)data + (size_t)f * ch;
+      for (int c = 0; c < ch; c++)
+        sum += x[c];
+    } else {
+      const Sint16 *x = (const Sint16 *)data + (size_t)f * ch;
+      for (int c = 0; c < ch; c++)
+        sum += x[c];
+    }
+    sp->ring[(wr + (unsigned)f) & (SPECTRUM_RING_SAMPLES - 1)] = sum * scale;
+  }
+  atomic_store_explicit(&sp->freq, pt->freq, memory_order_relaxed);
+  atomic_store_explicit(&sp->wr, wr + (unsigned)n, memory_order_release);
+  if ((int)(wr + (unsigned)n - rd) >= SPECTRUM_FFT_SIZE / 2)
+    doorbell_ring(&sp->bell);
+}
+
+static int probe_init(latency_probe_t *p, int trials, int rate) {
+  memset(p, 0, sizeof(*p));
+  p->trials = trials;
+  p->rate = rate;
+  p->max_lag = (int)((Sint64)rate * PROBE_MAX_MS / 1000);
+  p->chirp_len = (int)((Sint64)rate * PROBE_CHIRP_MS / 1000);
+  int size = 1;
+  while (size < 2 * (p->max_lag + p->chirp_len))
+    size <<= 1;
+  p->history_mask = size - 1;
+  p->chirp = malloc(sizeof(float) * (size_t)p->chirp_len);
+  p->history = calloc((size_t)size, sizeof(float));
+  p->window = malloc(sizeof(float) * (size_t)(p->max_lag + p->chirp_len));
+  p->results = calloc((size_t)trials, sizeof(double));
+  if (!p->chirp || !p->history || !p->window || !p->results)
+    return -1;
+
+  // Hann-windowed linear sweep, 500Hz up to 8kHz (or 0.4 fs).
+  double f0 = 500.0, f1 = fmin(8000.0, 0.4 * rate), phase = 0.0;
+  for (int i = 0; i < p->chirp_len; i++) {
+    double u = (double)i / p->chirp_len;
+    phase += 2.0 * M_PI * (f0 + (f1 - f0) * u) / rate;
+    p->chirp[i] = (float)(0.5 * (0.5 - 0.5 * cos(2.0 * M_PI * u)) * sin(phase));
+    p->chirp_energy += p->chirp[i] * p->chirp[i];
+  }
+
+  p->chirp_pos = -1;
+  atomic_store(&p->next_at, (long long)rate * PROBE_SETTLE_MS / 1000);
+  atomic_store(&p->requested, 1);
+  return 0;
+}
+
+static void probe_free(latency_probe_t *p) {
+  free(p->chirp);
+  free(p->history);
+  free(p->window);
+  free(p->results);
+}
+
+// Record a captured block (mono mix) into the history.
+static void probe_capture(latency_probe_t *p, const void *data, int frames,
+                          int channels, int is_float) {
+  long long pos = atomic_load_explicit(&p->in_pos, memory_order_relaxed);
+  for (int f = 0; f < frames; f++) {
+    float sum = 0.0f;
+    for (int c = 0; c < channels; c++)
+      sum += is_float ? ((const float *)data)[f * channels + c]
+                      : ((const Sint16 *)data)[f * channels + c] / 32768.0f;
+    p->history[(pos + f) & p->history_mask] = sum / channels;
+  }
+  atomic_store_explicit(&p->in_pos, pos + frames, memory_order_release);
+}
+
+// Fill a block headed for playback. first is the captured frame this block
+// stands in for.
+static void probe_render(latency_probe_t *p, void *data, int frames,
+                         int channels, int is_float, long long first) {
+  for (int f = 0; f < frames; f++) {
+    if (p->chirp_pos < 0 &&
+        atomic_load(&p->fired) < atomic_load(&p->requested) &&
+        first + f >= atomic_load(&p->next_at)) {
+      atomic_store(&p->inject_at, first + f);
+      atomic_fetch_add(&p->fired, 1);
+      p->chirp_pos = 0;
+    }
+    float v = 0.0f;
+    if (p->chirp_pos >= 0) {
+      v = p->chirp[p->chirp_pos++];
+      if (p->chirp_pos == p->chirp_len)
+        p->chirp_pos = -1;
+    }
+    for (int c = 0; c < channels; c++) {
+      if (is_float)
+        ((float *)data)[f * channels + c] = v;
+      else
+        ((Sint16 *)data)[f * channels + c] = (Sint16)(v * 32767.0f);
+    }
+  }
+}
+
+// Normalised cross-correlation of the chirp against the recording from
+// frame start on. Returns the lag in frames (parabolic sub-frame estimate)
+// and the correlation at the peak in *corr.
+static double probe_search(latency_probe_t *p, long long start, float *corr) {
+  int n = p->max_lag + p->chirp_len;
+  for (int i = 0; i < n; i++)
+    p->window[i] = p->history[(start + i) & p->history_mask];
+
+  double energy = 0.0;
+  for (int i = 0; i < p->chirp_len; i++)
+    energy += p->window[i] * p->window[i];
+
+  int best = 0;
+  float best_dot = 0.0f, best_norm = 0.0f, prev_dot = 0.0f, best_prev = 0.0f,
+        best_next = 0.0f;
+  for (int lag = 0; lag < p->max_lag; lag++) {
+    const float *w = p->window + lag;
+    float dot = 0.0f;
+    for (int i = 0; i < p->chirp_len; i++)
+      dot += w[i] * p->chirp[i];
+    float norm = energy > 0.0 ? fabsf(dot) / sqrtf((float)energy *
+                                                   p->chirp_energy)
+                              : 0.0f;
+    if (lag == best + 1)
+      best_next = dot;
+    if (norm > best_norm) {
+      best = lag;
+      best_norm = norm;
+      best_dot = dot;
+      best_prev = prev_dot;
+      best_next = 0.0f;
+    }
+    prev_dot = dot;
+    energy += (double)w[p->chirp_len] * w[p->chirp_len] - (double)w[0] * w[0];
+    if (energy < 0.0)
+      energy = 0.0;
+  }
+
+  *corr = best_norm;
+  double lag = best;
+  float den = best_prev - 2.0f * best_dot + best_next;
+  if (best > 0 && den != 0.0f)
+    lag += 0.5 * (best_prev - best_next) / den;
+  return lag;
+}
+
+// Audio thread side: evaluate a finished trial and schedule the next one.
+// Returns 1 once every trial is done.
+static int probe_poll(latency_probe_t *p) {
+  int fired = atomic_load(&p->fired);
+  if (fired == atomic_load(&p->requested) && fired > p->done) {
+    long long at = atomic_load(&p->inject_at);
+    long long pos = atomic_load_explicit(&p->in_pos, memory_order_acquire);
+    if (pos < at + p->max_lag + p->chirp_len)
+      return 0;
+
+    if (atomic_exchange(&p->glitched, 0)) {
+      printf("probe %d/%d: stream restarted, repeating\n", p->done + 1,
+             p->trials);
+    } else {
+      float corr;
+      double ms = probe_search(p, at, &corr) * 1000.0 / p->rate;
+      p->done++;
+      if (corr >= PROBE_MIN_CORR) {
+        p->results[p->found++] = ms;
+        printf("probe %d/%d: %.2fms (correlation %.2f)\n", p->done,
+               p->trials, ms, corr);
+      } else {
+        printf("probe %d/%d: not found (best correlation %.2f)\n", p->done,
+               p->trials, corr);
+      }
+    }
+    if (p->done < p->trials) {
+      atomic_store(&p->next_at, pos + (long long)p->rate * PROBE_GAP_MS / 1000);
+      atomic_fetch_add(&p->requested, 1);
+    }
+  }
+  return p->done >= p->trials;
+}
+
+static int cmp_double(const void *a, const void *b) {
+  double x = *(const double *)a, y = *(const double *)b;
+  return (x > y) - (x < y);
+}
+
+// Summary of all trials; nonzero when nothing was detected.
+static int probe_report(latency_probe_t *p) {
+  if (p->found == 0) {
+    printf("probe: no chirp detected in %d trials; is the loopback "
+           "connected?\n",
+           p->done);
+    return 1;
+  }
+  qsort(p->results, (size_t)p->found, sizeof(double), cmp_double);
+  double sum = 0.0, sumsq = 0.0;
+  for (int i = 0; i < p->found; i++) {
+    sum += p->results[i];
+    sumsq += p->results[i] * p->results[i];
+  }
+  double mean = sum / p->found;
+  double sd = sqrt(fmax(0.0, sumsq / p->found - mean * mean));
+  printf("probe: %d/%d detected, round trip min %.2fms median %.2fms mean "
+         "%.2fms max %.2fms sd %.2fms\n",
+         p->found, p->done, p->results[0], p->results[p->found / 2], mean,
+         p->results[p->found - 1], sd);
+  return 0;
+}
+
+// Create the tap for the given capture format and link it at path. Readers
+// open the link (it points at /proc/<pid>/fd/<n>) and mmap the file.
+static audio_tap_t *audio_tap_open(const char *path, SDL_AudioFormat format,
+                                   int channels, int rate) {
+  audio_tap_t *tap = calloc(1, sizeof(*tap));
+  if (!tap) {
+    perror("calloc(audio tap)");
+    return NULL;
+  }
+  tap->fd = -1;
+
+  int frame_bytes = SDL_AUDIO_BYTESIZE(format) * channels;
+  uint32_t ring = 4096;
+  while (ring < (uint32_t)(AUDIO_TAP_SECONDS * rate * frame_bytes))
+    ring <<= 1;
+  long page = sysconf(_SC_PAGESIZE);
+  size_t header = ((sizeof(audio_tap_header_t) + page - 1) / page) * page;
+  tap->map_bytes = header + ring;
+
+  char proc[64];
+  tap->fd = memfd_create("v4l2_sdl_view-audio", MFD_CLOEXEC);
+  if (tap->fd < 0) {
+    perror("memfd_create");
+    goto fail;
+  }
+  if (ftruncate(tap->fd, (off_t)tap->map_bytes) < 0) {
+    perror("ftruncate(audio tap)");
+    goto fail;
+  }
+  void *map = mmap(NULL, tap->map_bytes, PROT_READ | PROT_WRITE, MAP_SHARED,
+                   tap->fd, 0);
+  if (map == MAP_FAILED) {
+    perror("mmap(audio tap)");
+    goto fail;
+  }
+  tap->hdr = map;
+  tap->ring = (uint8_t *)map + header;
+
+  tap->hdr->version = AUDIO_TAP_VERSION;
+  tap->hdr->header_bytes = (uint32_t)header;
+  tap->hdr->ring_bytes = ring;
+  tap->hdr->format = format;
+  tap->hdr->channels = (uint32_t)channels;
+  tap->hdr->rate = (uint32_t)rate;
+  tap->hdr->frame_bytes = (uint32_t)frame_bytes;
+  atomic_thread_fence(memory_order_release);
+  tap->hdr->magic = AUDIO_TAP_MAGIC; // last: readers check it first
+
+  snprintf(proc, sizeof(proc), "/proc/%d/fd/%d", (int)getpid(), tap->fd);
+  // Only a stale link from an earlier run is replaced, never a real file.
+  struct stat st;
+  if (lstat(path, &st) == 0) {
+    if (!S_ISLNK(st.st_mode)) {
+      fprintf(stderr, "audio tap: %s exists and is not a symlink\n", path);
+      goto fail;
+    }
+    unlink(path);
+  }
+  if (symlink(proc, path) < 0) {
+    fprintf(stderr, "symlink(%s): %s\n", path, strerror(errno));
+    goto fail;
+  }
+  tap->link = strdup(path);
+  printf("audio tap: %s -> %s, %s %dch %dHz, %u byte ring\n", path, proc,
+         SDL_GetAudioFormatName(format), channels, rate, ring);
+  return tap;
+
+fail:
+  if (tap->hdr)
+    munmap(tap->hdr, tap->map_bytes);
+  if (tap->fd >= 0)
+    close(tap->fd);
+  free(tap);
+  return NULL;
+}
+
+static void audio_tap_close(audio_tap_t *tap) {
+  if (!tap)
+    return;
+  if (tap->link) {
+    unlink(tap->link);
+    free(tap->link);
+  }
+  munmap(tap->hdr, tap->map_bytes);
+  close(tap->fd);
+  free(tap);
+}
+
+// Append one captured chunk. Never waits on readers; it only enters the
+// kernel when one is asleep on the futex.
+static void audio_tap_write(audio_tap_t *tap, const Uint8 *data, int bytes) {
+  uint32_t mask = tap->hdr->ring_bytes - 1;
+  uint64_t pos = atomic_load_explicit(&tap->hdr->write_pos,
+                                      memory_order_relaxed);
+  uint32_t off = (uint32_t)pos & mask;
+  uint32_t first = mask + 1 - off;
+  if (first > (uint32_t)bytes)
+    first = (uint32_t)bytes;
+  memcpy(tap->ring + off, data, first);
+  memcpy(tap->ring, data + first, (size_t)bytes - first);
+  atomic_store_explicit(&tap->hdr->write_pos, pos + (uint64_t)bytes,
+                        memory_order_release);
+  atomic_fetch_add_explicit(&tap->hdr->seq, 1, memory_order_release);
+  if (atomic_load_explicit(&tap->hdr->waiters, memory_order_acquire))
+    syscall(SYS_futex, &tap->hdr->seq, FUTEX_WAKE, INT32_MAX, NULL, NULL, 0);
+}
+
+// Producer sides of the Matroska queues.
+static int mkv_video_setup(mkv_queue_t *q, int width, int height,
+                           size_t frame_bytes) {
+  q->video_data = malloc(MKV_VIDEO_SLOTS * frame_bytes);
+  if (!q->video_data)
+    return -1;
+  q->width = width;
+  q->height = height;
+  q->frame_bytes = frame_bytes;
+  atomic_store_explicit(&q->video_ready, 1, memory_order_release);
+  doorbell_ring(&q->bell);
+  return 0;
+}
+
+static void mkv_push_video(mkv_queue_t *q, const void *yuyv, size_t len,
+                           Uint64 capture_ns) {
+  unsigned wr = atomic_load_explicit(&q->video_wr, memory_order_relaxed);
+  if (wr - atomic_load_explicit(&q->video_rd, memory_order_acquire) >=
+      MKV_VIDEO_SLOTS) {
+    atomic_fetch_add(&q->video_dropped, 1);
+    return;
+  }
+  unsigned slot = wr % MKV_VIDEO_SLOTS;
+  if (len > q->frame_bytes)
+    len = q->frame_bytes;
+  memcpy(q->video_data + slot * q->frame_bytes, yuyv, len);
+  q->video_pkt[slot].capture_ns = capture_ns;
+  q->video_pkt[slot].bytes = len;
+  atomic_store_explicit(&q->video_wr, wr + 1, memory_order_release);
+  doorbell_ring(&q->bell);
+}
+
+static void mkv_audio_setup(mkv_queue_t *q, SDL_AudioFormat format,
+                            int channels, int freq) {
+  q->format = format;
+  q->channels = channels;
+  q->freq = freq;
+  atomic_store_explicit(&q->audio_ready, 1, memory_order_release);
+  doorbell_ring(&q->bell);
+}
+
+static void mkv_push_audio(mkv_queue_t *q, const Uint8 *data, int bytes,
+                           Uint64 capture_ns) {
+  unsigned wr = atomic_load_explicit(&q->audio_wr, memory_order_relaxed);
+  if (wr - atomic_load_explicit(&q->audio_rd, memory_order_acquire) >=
+      MKV_AUDIO_SLOTS) {
+    atomic_fetch_add(&q->audio_dropped, 1);
+    return;
+  }
+  unsigned slot = wr % MKV_AUDIO_SLOTS;
+  memcpy(q->audio_data[slot], data, (size_t)bytes);
+  q->audio_pkt[slot].capture_ns = capture_ns;
+  q->audio_pkt[slot].bytes = (size_t)bytes;
+  atomic_store_explicit(&q->audio_wr, wr + 1, memory_order_release);
+  doorbell_ring(&q->bell);
+}
+
+// Producer sides of the replay rings. The audio ring is allocated up front
+// for chunks as short as REPLAY_CHUNK_MS, and counts against the memory cap;
+// the video ring once the frame size is known, within what the audio ring
+// left of it.
+static int replay_init(replay_t *r, int seconds, size_t cap_bytes,
+                       const char *dir) {
+  r->seconds = seconds;
+  r->cap_bytes = cap_bytes;
+  r->dir = dir;
+  size_t chunks = (size_t)seconds * 1000 / REPLAY_CHUNK_MS + 64;
+  if (chunks > UINT32_MAX || chunks * AUDIO_CHUNK_BYTES >= cap_bytes) {
+    fprintf(stderr,
+            "replay: %ds of audio alone needs %zu MiB, more than the %zu "
+            "MiB cap (--replay-mb)\n",
+            seconds, (chunks * AUDIO_CHUNK_BYTES) >> 20, cap_bytes >> 20);
+    return -1;
+  }
+  r->nchunks = (unsigned)chunks;
+  r->audio_data = malloc((size_t)r->nchunks * AUDIO_CHUNK_BYTES);
+  r->audio_pkt = calloc(r->nchunks, sizeof(*r->audio_pkt));
+  if (!r->audio_data || !r->audio_pkt) {
+    perror("malloc(replay)");
+    return -1;
+  }
+  return 0;
+}
+
+static int replay_video_setup(replay_t *r, int width, int height,
+                              size_t frame_bytes, int fps) {
+  size_t audio_bytes = (size_t)r->nchunks * AUDIO_CHUNK_BYTES;
+  size_t room = r->cap_bytes > audio_bytes ? r->cap_bytes - audio_bytes : 0;
+  unsigned want = (unsigned)(r->seconds * fps) + 1;
+  unsigned fit = (unsigned)(room / frame_bytes);
+  r->nframes = want < fit ? want : fit;
+  if (r->nframes < 2) {
+    fprintf(stderr, "replay: a %zu byte frame does not fit in %zu MiB\n",
+            frame_bytes, r->cap_bytes >> 20);
+    return -1;
+  }
+  r->video_data = malloc((size_t)r->nframes * frame_bytes);
+  r->video_pkt = calloc(r->nframes, sizeof(*r->video_pkt));
+  if (!r->video_data || !r->video_pkt) {
+    perror("malloc(replay)");
+    return -1;
+  }
+  r->width = width;
+  r->height = height;
+  r->frame_bytes = frame_bytes;
+  printf("replay: last %.1fs, %u frames x %zu bytes + %u audio chunks, "
+         "%.1f of %zu MiB\n",
+         (double)(r->nframes - 1) / fps, r->nframes, frame_bytes, r->nchunks,
+         (double)(r->nframes * frame_bytes + audio_bytes) / (1 << 20),
+         r->cap_bytes >> 20);
+  return 0;
+}
+
+static void replay_audio_setup(replay_t *r, SDL_AudioFormat format,
+                               int channels, int freq) {
+  r->format = format;
+  r->channels = channels;
+  r->freq = freq;
+  atomic_store_explicit(&r->audio_ready, 1, memory_order_release);
+}
+
+// Whether storing packet wr of a ring of n would overwrite one that a save
+// still has to write.
+static int replay_blocked(replay_t *r, unsigned wr, unsigned n,
+                          atomic_uint *keep) {
+  if (!atomic_load_explicit(&r->saving, memory_order_acquire) || wr < n)
+    return 0;
+  return (int)(wr - n - atomic_load_explicit(keep, memory_order_acquire)) >=
+         0;
+}
+
+static void replay_push_video(replay_t *r, const void *yuyv, size_t len,
+                              Uint64 capture_ns) {
+  unsigned wr = atomic_load_explicit(&r->video_wr, memory_order_relaxed);
+  if (replay_blocked(r, wr, r->nframes, &r->video_keep)) {
+    atomic_fetch_add(&r->skipped, 1);
+    return;
+  }
+  unsigned slot = wr % r->nframes;
+  if (len > r->frame_bytes)
+    len = r->frame_bytes;
+  memcpy(r->video_data + slot * r->frame_bytes, yuyv, len);
+  r->video_pkt[slot].capture_ns = capture_ns;
+  r->video_pkt[slot].bytes = len;
+  atomic_store_explicit(&r->video_wr, wr + 1, memory_order_release);
+}
+
+static void replay_push_audio(replay_t *r, const Uint8 *data, int bytes,
+                              Uint64 capture_ns) {
+  unsigned wr = atomic_load_explicit(&r->audio_wr, memory_order_relaxed);
+  if (replay_blocked(r, wr, r->nchunks, &r->audio_keep)) {
+    atomic_fetch_add(&r->skipped, 1);
+    return;
+  }
+  unsigned slot = wr % r->nchunks;
+  memcpy(r->audio_data[slot], data, (size_t)bytes);
+  r->audio_pkt[slot].capture_ns = capture_ns;
+  r->audio_pkt[slot].bytes = (size_t)bytes;
+  atomic_store_explicit(&r->audio_wr, wr + 1, memory_order_release);
+}
+
+static float q16_to_dbfs(int q16) {
+  return q16 > 0 ? 20.0f * log10f((float)q16 / 65536.0f) : -96.0f;
+}
+
 static SDL_AudioDeviceID pick_recording_device(const char *selector) {
   int count = 0;
   SDL_AudioDeviceID *devices = SDL_GetAudioRecordingDevices(&count);
@@ -195,40 +1580,923 @@ static SDL_FRect integer_fit_rect(int src_w, int src_h, int dst_w, int dst_h) {
   return r;
 }
 
-int proc_audio(const proc_audio_args_t *args) {
-  int rc = 1;
-
-  SDL_AudioStream *rec_stream = NULL;
-  SDL_AudioStream *out_stream = NULL;
-  SDL_AudioDeviceID rec_dev = 0;
-  SDL_AudioDeviceID out_dev = 0;
-
-  SDL_AudioDeviceID rec_id = pick_recording_device(args->dev);
-  SDL_AudioDeviceID out_id = pick_playback_device(args->out);
-
-  SDL_AudioSpec want;
-  SDL_zero(want);
-  want.freq = args->sample_rate;
-  want.format = SDL_AUDIO_S16;
-  want.channels = 2;
+// Append n bytes to the delay line; src == NULL appends silence. The oldest
+// bytes are dropped if the ring would overflow.
+static void audio_ring_write(audio_passthrough_t *pt, const Uint8 *src,
+                             int n) {
+  int over = pt->ring_level + n - pt->ring_size;
+  if (over > 0) {
+    pt->ring_rd = (pt->ring_rd + over) % pt->ring_size;
+    pt->ring_level -= over;
+    atomic_fetch_add(&pt->stats->loss_events, 1);
+    atomic_fetch_add(&pt->stats->lost_frames, over / pt->frame_bytes);
+  }
+  int wr = (pt->ring_rd + pt->ring_level) % pt->ring_size;
+  while (n > 0) {
+    int span = pt->ring_size - wr < n ? pt->ring_size - wr : n;
+    if (src) {
+      memcpy(pt->ring + wr, src, (size_t)span);
+      src += span;
+    } else {
+      memset(pt->ring + wr, pt->silence, (size_t)span);
+    }
+    wr = (wr + span) % pt->ring_size;
+    pt->ring_level += span;
+    n -= span;
+  }
+}
 
-  rec_dev = SDL_OpenAudioDevice(rec_id, &want);
-  if (!rec_dev) {
-    fprintf(stderr, "Open recording failed: %s\n", SDL_GetError());
-    goto cleanup;
+// Move n bytes from the head of the delay line into the playback stream.
+static int audio_ring_drain(audio_passthrough_t *pt, int n) {
+  while (n > 0) {
+    int room = pt->ring_size - pt->ring_rd;
+    int span = room < n ? room : n;
+    if (!SDL_PutAudioStreamData(pt->out_stream, pt->ring + pt->ring_rd, span))
+      return -1;
+    pt->ring_rd = (pt->ring_rd + span) % pt->ring_size;
+    pt->ring_level -= span;
+    n -= span;
   }
+  return 0;
+}
 
-  out_dev = SDL_OpenAudioDevice(out_id, &want);
-  if (!out_dev) {
-    fprintf(stderr, "Open playback failed: %s\n", SDL_GetError());
+// Apply a new delay immediately: growing it pads the line with silence,
+// shrinking it drops the oldest samples.
+static void audio_ring_retarget(audio_passthrough_t *pt, int want) {
+  if (want > pt->delay_bytes) {
+    audio_ring_write(pt, NULL, want - pt->delay_bytes);
+  } else {
+    int drop = pt->delay_bytes - want;
+    if (drop > pt->ring_level)
+      drop = pt->ring_level;
+    pt->ring_rd = (pt->ring_rd + drop) % pt->ring_size;
+    pt->ring_level -= drop;
+  }
+  pt->delay_bytes = want;
+}
+
+// dst += src * gain over interleaved samples, saturating for S16.
+static void audio_mix_add(Uint8 *dst, const Uint8 *src, int bytes,
+                          int is_float, float gain) {
+  int i = 0;
+  if (is_float) {
+    float *d = (float *)dst;
+    const float *x = (const float *)src;
+    int n = bytes / (int)sizeof(float);
+#if defined(__SSE2__)
+    const __m128 g = _mm_set1_ps(gain);
+    for (; i + 4 <= n; i += 4)
+      _mm_storeu_ps(d + i, _mm_add_ps(_mm_loadu_ps(d + i),
+                                      _mm_mul_ps(_mm_loadu_ps(x + i), g)));
+#endif
+    for (; i < n; i++)
+      d[i] += x[i] * gain;
+  } else {
+    Sint16 *d = (Sint16 *)dst;
+    const Sint16 *x = (const Sint16 *)src;
+    int n = bytes / (int)sizeof(Sint16);
+    float gq = gain * 4096.0f; // Q12, up to +18dB
+    int g12 = (int)(gq > 32767.0f ? 32767.0f : gq + 0.5f);
+#if defined(__SSE2__)
+    const __m128i g = _mm_set1_epi16((short)g12);
+    const __m128i round = _mm_set1_epi32(1 << 11);
+    for (; i + 8 <= n; i += 8) {
+      __m128i v = _mm_loadu_si128((const __m128i *)(x + i));
+      __m128i lo = _mm_mullo_epi16(v, g), hi = _mm_mulhi_epi16(v, g);
+      __m128i p0 = _mm_srai_epi32(
+          _mm_add_epi32(_mm_unpacklo_epi16(lo, hi), round), 12);
+      __m128i p1 = _mm_srai_epi32(
+          _mm_add_epi32(_mm_unpackhi_epi16(lo, hi), round), 12);
+      __m128i acc = _mm_loadu_si128((const __m128i *)(d + i));
+      __m128i a0 = _mm_srai_epi32(_mm_unpacklo_epi16(acc, acc), 16);
+      __m128i a1 = _mm_srai_epi32(_mm_unpackhi_epi16(acc, acc), 16);
+      _mm_storeu_si128((__m128i *)(d + i),
+                       _mm_packs_epi32(_mm_add_epi32(a0, p0),
+                                       _mm_add_epi32(a1, p1)));
+    }
+#endif
+    for (; i < n; i++) {
+      int v = d[i] + ((x[i] * g12 + (1 << 11)) >> 12);
+      d[i] = (Sint16)(v > 32767 ? 32767 : v < -32768 ? -32768 : v);
+    }
+  }
+}
+
+// Mix every primed source into one outgoing chunk. A source that runs short
+// drops out and primes again; one whose backlog has grown past four times
+// the target (a stall, a device hiccup) is trimmed back to it at once.
+static void audio_sources_mix(audio_passthrough_t *pt, int bytes) {
+  int is_float = SDL_AUDIO_ISFLOAT(pt->format);
+  for (int i = 0; i < pt->nsources; i++) {
+    audio_source_t *src = &pt->sources[i];
+    int avail = SDL_GetAudioStreamAvailable(src->stream);
+    int excess = 0;
+    if (!atomic_load(&src->primed)) {
+      if (avail < src->target_bytes + bytes)
+        continue;
+      excess = avail - src->target_bytes - bytes;
+      atomic_store(&src->primed, 1);
+    } else if (avail > 4 * src->target_bytes + bytes) {
+      excess = avail - src->target_bytes - bytes;
+      atomic_fetch_add(&src->resyncs, 1);
+    }
+    excess -= excess % pt->frame_bytes;
+    while (excess > 0) {
+      int n = excess < (int)sizeof(pt->srcbuf) ? excess
+                                               : (int)sizeof(pt->srcbuf);
+      if (SDL_GetAudioStreamData(src->stream, pt->srcbuf, n) <= 0)
+        break;
+      excess -= n;
+    }
+
+    int got = SDL_GetAudioStreamData(src->stream, pt->srcbuf, bytes);
+    if (got < bytes) {
+      atomic_fetch_add(&src->underruns, 1);
+      atomic_store(&src->primed, 0);
+    }
+    if (got > 0)
+      audio_mix_add(pt->buf, pt->srcbuf, got - got % pt->frame_bytes,
+                    is_float, src->gain);
+  }
+}
+
+// Standby bookkeeping for one outgoing chunk. Returns 1 when the chunk is to
+// be dropped because playback is (or has just gone) on standby. Coming back,
+// the queue is refilled with prime_bytes of silence first so playback resumes
+// at the usual depth without waiting to prime.
+static int audio_standby_chunk(audio_passthrough_t *pt, int bytes) {
+  if (audio_is_silent(pt->buf, bytes, SDL_AUDIO_ISFLOAT(pt->format))) {
+    if (pt->silent_bytes < INT32_MAX - bytes)
+      pt->silent_bytes += bytes;
+  } else {
+    pt->silent_bytes = 0;
+  }
+
+  if (atomic_load(&pt->standby)) {
+    if (pt->silent_bytes > 0)
+      return 1;
+    Uint8 zero[AUDIO_CHUNK_BYTES];
+    memset(zero, pt->silence, sizeof(zero));
+    for (int left = pt->prime_bytes; left > 0; left -= (int)sizeof(zero)) {
+      int n = left < (int)sizeof(zero) ? left : (int)sizeof(zero);
+      SDL_PutAudioStreamData(pt->out_stream, zero, n);
+    }
+    SDL_ResumeAudioDevice(pt->out_dev);
+    atomic_store(&pt->standby, 0);
+    return 0;
+  }
+
+  // The delay ring must hold nothing but silence before it can be dropped.
+  if (pt->primed && pt->silent_bytes >= pt->standby_bytes + pt->delay_bytes) {
+    SDL_PauseAudioDevice(pt->out_dev);
+    SDL_ClearAudioStream(pt->out_stream);
+    atomic_store(&pt->standby, 1);
+    return 1;
+  }
+  return 0;
+}
+
+// Called by SDL right after the recording device put new samples into
+// rec_stream: move everything available into the playback stream, through
+// the delay line when a delay is set.
+static void SDLCALL audio_passthrough_cb(void *userdata,
+                                         SDL_AudioStream *stream,
+                                         int additional_amount,
+                                         int total_amount) {
+  audio_passthrough_t *pt = (audio_passthrough_t *)userdata;
+  (void)additional_amount;
+  (void)total_amount;
+
+  if (pt->failed)
+    return;
+
+  int want = atomic_load(&pt->want_delay_bytes);
+  if (want != pt->delay_bytes)
+    audio_ring_retarget(pt, want);
+
+  for (;;) {
+    int got = SDL_GetAudioStreamData(stream, pt->buf, (int)sizeof(pt->buf));
+    if (got < 0) {
+      fprintf(stderr, "GetAudioStreamData: %s\n", SDL_GetError());
+      pt->failed = 1;
+      return;
+    }
+    if (got == 0)
+      return;
+
+    audio_meter_chunk(pt, pt->buf, got);
+    spectrum_push(pt, pt->buf, got);
+    if (pt->tap)
+      audio_tap_write(pt->tap, pt->buf, got);
+    atomic_fetch_add(&pt->stats->received, got / pt->in_frame_bytes);
+    if (pt->probe) {
+      int frames = got / pt->in_frame_bytes;
+      int is_float = SDL_AUDIO_ISFLOAT(pt->format);
+      probe_capture(pt->probe, pt->buf, frames, pt->channels, is_float);
+      probe_render(pt->probe, pt->buf, frames, pt->channels, is_float,
+                   atomic_load(&pt->probe->in_pos) - frames);
+    }
+    got = audio_mix_chunk(&pt->mix, pt->buf, got, pt->format, pt->mixbuf);
+    if (pt->nsources)
+      audio_sources_mix(pt, got);
+    if (pt->mkv) {
+      // The chunk's first frame was captured about its length ago.
+      Uint64 span = (Uint64)(got / pt->frame_bytes) * 1000000000ull /
+                    (Uint64)pt->freq;
+      mkv_push_audio(pt->mkv, pt->buf, got, mono_ns() - span);
+    }
+    if (pt->replay)
+      replay_push_audio(pt->replay, pt->buf, got,
+                        mono_ns() - (Uint64)(got / pt->frame_bytes) *
+                                        1000000000ull / (Uint64)pt->freq);
+    if (pt->standby_bytes && audio_standby_chunk(pt, got))
+      continue;
+
+    int ok;
+    if (pt->delay_bytes == 0 && pt->ring_level == 0) {
+      ok = SDL_PutAudioStreamData(pt->out_stream, pt->buf, got);
+    } else {
+      audio_ring_write(pt, pt->buf, got);
+      ok = audio_ring_drain(pt, pt->ring_level - pt->delay_bytes) == 0;
+    }
+    if (!ok) {
+      fprintf(stderr, "PutAudioStreamData: %s\n", SDL_GetError());
+      pt->failed = 1;
+      return;
+    }
+
+    if (!pt->primed &&
+        SDL_GetAudioStreamQueued(pt->out_stream) >= pt->prime_bytes) {
+      pt->primed = 1;
+      SDL_ResumeAudioDevice(pt->out_dev);
+    }
+  }
+}
+
+// Get callback on out_stream, run by SDL on the playback device thread each
+// time the device pulls. Only observes: depth goes into the histogram and a
+// shortfall counts as starvation (the device pads it with silence).
+static void SDLCALL audio_playback_cb(void *userdata, SDL_AudioStream *stream,
+                                      int additional_amount,
+                                      int total_amount) {
+  audio_passthrough_t *pt = (audio_passthrough_t *)userdata;
+  (void)total_amount;
+
+  if (!pt->primed)
+    return;
+
+  int queued = SDL_GetAudioStreamQueued(stream);
+  int ms = (int)((Sint64)queued * 1000 / ((Sint64)pt->frame_bytes * pt->freq));
+  int bin = 0;
+  while (bin < AUDIO_HIST_BINS - 1 && ms >= audio_hist_edges_ms[bin])
+    bin++;
+  atomic_fetch_add(&pt->stats->hist[bin], 1);
+
+  if (additional_amount > 0) {
+    atomic_fetch_add(&pt->stats->starved, 1);
+    atomic_fetch_add(&pt->stats->starved_bytes, additional_amount);
+  }
+}
+
+// Input loss detector. The recording device should deliver freq frames per
+// second; the shortfall against the wall clock moves slowly with clock drift
+// and jitters by a device period, but jumps when the driver drops input.
+typedef struct {
+  Uint64 start_ns;
+  double baseline; // drift-tracking shortfall, frames
+  double threshold;
+} audio_loss_t;
+
+static void audio_loss_init(audio_loss_t *l, Uint64 now_ns, long long received,
+                            int freq, int device_frames) {
+  l->start_ns = now_ns;
+  l->baseline = -(double)received;
+  // Two device periods, but never less than 20ms.
+  double periods = 2.0 * device_frames, floor_frames = freq / 50.0;
+  l->threshold = periods > floor_frames ? periods : floor_frames;
+}
+
+static void audio_loss_update(audio_loss_t *l, audio_stats_t *st,
+                              Uint64 now_ns, int freq, double dt_s) {
+  double expected = (double)(now_ns - l->start_ns) * freq / SDL_NS_PER_SECOND;
+  double deficit = expected - (double)atomic_load(&st->received);
+  double jump = deficit - l->baseline;
+
+  if (jump > l->threshold) {
+    atomic_fetch_add(&st->loss_events, 1);
+    atomic_fetch_add(&st->lost_frames, (long long)jump);
+    l->baseline = deficit;
+  } else {
+    l->baseline += jump * dt_s / AUDIO_LOSS_BASELINE_S;
+  }
+}
+
+static void audio_meter_report(audio_meter_t *m) {
+  int chunks = atomic_exchange(&m->kernel_chunks, 0);
+  long long kns = atomic_exchange(&m->kernel_ns, 0);
+  int nch = atomic_load(&m->channels);
+  printf("meter:");
+  for (int c = 0; c < nch; c++)
+    printf(" ch%d %.1f/%.1f", c, q16_to_dbfs(atomic_load(&m->peak_q16[c])),
+           q16_to_dbfs(atomic_load(&m->rms_q16[c])));
+  printf(" dBFS peak/rms, %lldns/chunk\n", chunks ? kns / chunks : 0);
+}
+
+static FILE *audio_stats_open(const char *path) {
+  FILE *csv = fopen(path, "a");
+  if (!csv) {
+    fprintf(stderr, "open(%s) failed: %s\n", path, strerror(errno));
+    return NULL;
+  }
+  // Appending to an earlier run's file: it has its header already.
+  fseek(csv, 0, SEEK_END);
+  if (ftell(csv) > 0)
+    return csv;
+  fprintf(csv, "time_s,starved,starved_ms,loss_events,lost_ms,queue_ms,"
+               "ratio,video_cpu_pct");
+  for (int i = 0; i < AUDIO_HIST_BINS; i++)
+    fprintf(csv, ",hist%d", i);
+  fprintf(csv, "\n");
+  return csv;
+}
+
+// Print the glitch counters and the queue histogram for the last interval,
+// and append the same as a CSV row when exporting.
+static void audio_stats_report(audio_stats_t *st, FILE *csv, double t_s,
+                               double interval_s, int frame_bytes, int freq,
+                               double queued_ms, double ratio) {
+  int starved = atomic_load(&st->starved);
+  double starved_ms =
+      atomic_load(&st->starved_bytes) * 1000.0 / ((double)frame_bytes * freq);
+  int loss = atomic_load(&st->loss_events);
+  double lost_ms = atomic_load(&st->lost_frames) * 1000.0 / freq;
+  long long cpu_ns = atomic_load(&st->video_cpu_ns);
+  double cpu_pct = (cpu_ns - st->last_cpu_ns) / (interval_s * 1e7);
+
+  int hist[AUDIO_HIST_BINS], total = 0;
+  for (int i = 0; i < AUDIO_HIST_BINS; i++) {
+    hist[i] = atomic_exchange(&st->hist[i], 0);
+    total += hist[i];
+  }
+
+  printf("glitch: starved %d (+%d, %.1fms total) input lost %d (+%d, %.1fms "
+         "total) video cpu %.0f%%\n",
+         starved, starved - st->last_starved, starved_ms, loss,
+         loss - st->last_loss, lost_ms, cpu_pct);
+  printf("queue:");
+  for (int i = 0; i < AUDIO_HIST_BINS; i++) {
+    if (i < AUDIO_HIST_BINS - 1)
+      printf(" <%d:", audio_hist_edges_ms[i]);
+    else
+      printf(" >=%d:", audio_hist_edges_ms[i - 1]);
+    printf("%.0f%%", total ? hist[i] * 100.0 / total : 0.0);
+  }
+  printf("\n");
+
+  if (csv) {
+    fprintf(csv, "%.1f,%d,%.1f,%d,%.1f,%.1f,%.6f,%.1f", t_s, starved,
+            starved_ms, loss, lost_ms, queued_ms, ratio, cpu_pct);
+    for (int i = 0; i < AUDIO_HIST_BINS; i++)
+      fprintf(csv, ",%d", hist[i]);
+    fprintf(csv, "\n");
+    fflush(csv);
+  }
+
+  st->last_starved = starved;
+  st->last_loss = loss;
+  st->last_cpu_ns = cpu_ns;
+}
+
+static void audio_drift_init(audio_drift_t *d, int target_ms) {
+  d->target_ms = target_ms;
+  d->depth_ms = target_ms;
+  d->integral = 0.0;
+  d->ratio = 1.0;
+}
+
+// Feed one queue depth sample taken dt_s after the previous one; returns the
+// ratio to apply. A ratio above 1 consumes input faster and drains the queue.
+static double audio_drift_update(audio_drift_t *d, double queued_ms,
+                                 double dt_s) {
+  const double kp = 1e-4; // per ms of error
+  const double ki = 2e-5; // per ms*s of error
+  const double max = AUDIO_DRIFT_MAX_PPM * 1e-6;
+
+  d->depth_ms += 0.1 * (queued_ms - d->depth_ms);
+  double err = d->depth_ms - d->target_ms;
+
+  d->integral += err * dt_s;
+  if (d->integral * ki > max)
+    d->integral = max / ki;
+  if (d->integral * ki < -max)
+    d->integral = -max / ki;
+
+  double adj = kp * err + ki * d->integral;
+  if (adj > max)
+    adj = max;
+  if (adj < -max)
+    adj = -max;
+
+  d->ratio = 1.0 + adj;
+  return d->ratio;
+}
+
+// One alignment step, run by the audio thread. The slower path is matched by
+// first removing delay from the other path and only then adding delay to the
+// faster one. The user delays are an intended offset and are left alone.
+static void av_sync_step(av_sync_t *s) {
+  int vlat = atomic_load(&s->video_latency_us);
+  int alat = atomic_load(&s->audio_latency_us);
+  if (vlat <= 0 || alat <= 0)
+    return;
+
+  int offset = (vlat - atomic_load(&s->video_user_us)) -
+               (alat - atomic_load(&s->audio_user_us));
+  atomic_store(&s->offset_us, offset);
+  if (!s->enabled || abs(offset) <= AV_SYNC_TOLERANCE_US)
+    return;
+
+  // Half steps: both estimates are smoothed and lag the change.
+  int step = offset / 2;
+  int vdelay = atomic_load(&s->video_delay_us);
+  int adelay = atomic_load(&s->audio_delay_us);
+
+  if (step > 0) {
+    int undo = step < vdelay ? step : vdelay;
+    vdelay -= undo;
+    adelay += step - undo;
+  } else {
+    int undo = -step < adelay ? -step : adelay;
+    adelay -= undo;
+    vdelay += -step - undo;
+  }
+  if (s->audio_fixed)
+    adelay = 0;
+  if (vdelay > s->max_delay_us)
+    vdelay = s->max_delay_us;
+  if (adelay > s->max_delay_us)
+    adelay = s->max_delay_us;
+
+  atomic_store(&s->video_delay_us, vdelay);
+  atomic_store(&s->audio_delay_us, adelay);
+}
+
+// Automatic plus user delay, limited to what the delay lines hold.
+static int av_total_delay_us(const av_sync_t *s, atomic_int *auto_us,
+                             atomic_int *user_us) {
+  int d = atomic_load(auto_us) + atomic_load(user_us);
+  return d > s->max_delay_us ? s->max_delay_us : d;
+}
+
+// Hotkeys: [ and ] shift video, - and = shift audio.
+static void av_sync_key(av_sync_t *s, SDL_Keycode key) {
+  atomic_int *user = NULL;
+  int step = 0;
+  switch (key) {
+  case SDLK_LEFTBRACKET:
+    user = &s->video_user_us;
+    step = -AV_DELAY_STEP_US;
+    break;
+  case SDLK_RIGHTBRACKET:
+    user = &s->video_user_us;
+    step = AV_DELAY_STEP_US;
+    break;
+  case SDLK_MINUS:
+    user = &s->audio_user_us;
+    step = -AV_DELAY_STEP_US;
+    break;
+  case SDLK_EQUALS:
+    user = &s->audio_user_us;
+    step = AV_DELAY_STEP_US;
+    break;
+  default:
+    return;
+  }
+
+  int v = atomic_load(user) + step;
+  if (v < 0)
+    v = 0;
+  if (v > s->max_delay_us)
+    v = s->max_delay_us;
+  atomic_store(user, v);
+  printf("delay: video %dms audio %dms\n",
+         atomic_load(&s->video_user_us) / 1000,
+         atomic_load(&s->audio_user_us) / 1000);
+}
+
+static int audio_spec_equal(const SDL_AudioSpec *a, const SDL_AudioSpec *b) {
+  return a->format == b->format && a->channels == b->channels &&
+         a->freq == b->freq;
+}
+
+// Pick the app-side format. When both devices report the same native spec it
+// is used end to end, so neither stream has to convert; otherwise the
+// recording side stays native and only playback converts.
+static SDL_AudioSpec negotiate_audio_spec(SDL_AudioDeviceID rec_id,
+                                          SDL_AudioDeviceID out_id,
+                                          int forced_rate, int *out_channels) {
+  SDL_AudioSpec rec, out, spec;
+  SDL_zero(rec);
+  SDL_zero(out);
+  int have_rec = SDL_GetAudioDeviceFormat(rec_id, &rec, NULL);
+  int have_out = SDL_GetAudioDeviceFormat(out_id, &out, NULL);
+
+  if (have_rec) {
+    spec = rec;
+  } else if (have_out) {
+    spec = out;
+  } else {
+    spec.format = SDL_AUDIO_S16;
+    spec.channels = SPECS_STEREO;
+    spec.freq = 48000;
+  }
+  if (forced_rate > 0)
+    spec.freq = forced_rate;
+  // The in-place processing stages work on S16 and F32 samples only.
+  if (spec.format != SDL_AUDIO_S16 && spec.format != SDL_AUDIO_F32)
+    spec.format = SDL_AUDIO_F32;
+
+  int native = have_rec && have_out && audio_spec_equal(&rec, &out) &&
+               audio_spec_equal(&rec, &spec);
+  printf("audio: %s %dch %dHz%s\n", SDL_GetAudioFormatName(spec.format),
+         spec.channels, spec.freq,
+         native ? " native on both ends, no conversion" : "");
+  if (!native && have_out)
+    printf("audio: playback device runs %s %dch %dHz, converting\n",
+           SDL_GetAudioFormatName(out.format), out.channels, out.freq);
+  *out_channels = have_out ? out.channels : spec.channels;
+  return spec;
+}
+
+#ifdef HAVE_ALSA
+// mmap interleaved S16 with small periods. Neither PCM starts on its own:
+// alsa_start() prefills playback and starts them together.
+static int alsa_setup(snd_pcm_t *pcm, unsigned int *rate, int channels,
+                      snd_pcm_uframes_t *period, int periods) {
+  snd_pcm_hw_params_t *hw = NULL;
+  snd_pcm_sw_params_t *sw = NULL;
+  snd_pcm_uframes_t buffer = *period * periods;
+  int err;
+
+  if ((err = snd_pcm_hw_params_malloc(&hw)) < 0)
+    return err;
+  if ((err = snd_pcm_hw_params_any(pcm, hw)) < 0 ||
+      (err = snd_pcm_hw_params_set_access(pcm, hw,
+                                          SND_PCM_ACCESS_MMAP_INTERLEAVED)) <
+          0 ||
+      (err = snd_pcm_hw_params_set_format(pcm, hw, SND_PCM_FORMAT_S16_LE)) <
+          0 ||
+      (err = snd_pcm_hw_params_set_channels(pcm, hw, channels)) < 0 ||
+      (err = snd_pcm_hw_params_set_rate_near(pcm, hw, rate, NULL)) < 0 ||
+      (err = snd_pcm_hw_params_set_period_size_near(pcm, hw, period, NULL)) <
+          0 ||
+      (err = snd_pcm_hw_params_set_buffer_size_near(pcm, hw, &buffer)) < 0 ||
+      (err = snd_pcm_hw_params(pcm, hw)) < 0)
+    goto out;
+
+  if ((err = snd_pcm_sw_params_malloc(&sw)) < 0)
+    goto out;
+  if ((err = snd_pcm_sw_params_current(pcm, sw)) < 0 ||
+      (err = snd_pcm_sw_params_set_start_threshold(pcm, sw, buffer * 2)) <
+          0 ||
+      (err = snd_pcm_sw_params_set_avail_min(pcm, sw, *period)) < 0 ||
+      (err = snd_pcm_sw_params(pcm, sw)) < 0)
+    goto out;
+
+out:
+  if (sw)
+    snd_pcm_sw_params_free(sw);
+  snd_pcm_hw_params_free(hw);
+  return err;
+}
+
+static Uint8 *alsa_area_ptr(const snd_pcm_channel_area_t *a,
+                            snd_pcm_uframes_t offset) {
+  return (Uint8 *)a[0].addr + (a[0].first + offset * a[0].step) / 8;
+}
+
+// Queue `prefill` frames of silence on playback, then start both PCMs; a
+// linked pair starts on the same tick.
+static int alsa_start(snd_pcm_t *cap, snd_pcm_t *play, int linked,
+                      snd_pcm_uframes_t prefill, int frame_bytes) {
+  int err;
+  if ((err = (int)snd_pcm_avail_update(play)) < 0)
+    return err;
+  while (prefill > 0) {
+    const snd_pcm_channel_area_t *pa;
+    snd_pcm_uframes_t off, n = prefill;
+    if ((err = snd_pcm_mmap_begin(play, &pa, &off, &n)) < 0)
+      return err;
+    memset(alsa_area_ptr(pa, off), 0, n * frame_bytes);
+    if ((err = (int)snd_pcm_mmap_commit(play, off, n)) < 0)
+      return err;
+    prefill -= n;
+  }
+  if ((err = snd_pcm_start(cap)) < 0)
+    return err;
+  if (!linked && (err = snd_pcm_start(play)) < 0)
+    return err;
+  return 0;
+}
+
+static int alsa_restart(snd_pcm_t *cap, snd_pcm_t *play, int linked,
+                        snd_pcm_uframes_t prefill, int frame_bytes) {
+  snd_pcm_drop(cap);
+  snd_pcm_drop(play);
+  snd_pcm_prepare(cap);
+  snd_pcm_prepare(play);
+  return alsa_start(cap, play, linked, prefill, frame_bytes);
+}
+
+// Minimum-latency passthrough straight between two ALSA PCMs: samples are
+// copied from the capture mmap area into the playback one with no SDL
+// buffering in between. Stereo S16 only; use a plughw: device to convert.
+// The delay line is not available here, so A/V alignment can only hold back
+// video.
+static int alsa_passthrough(const proc_audio_args_t *args) {
+  const int channels = SPECS_STEREO;
+  const int frame_bytes = channels * (int)sizeof(Sint16);
+  snd_pcm_t *cap = NULL, *play = NULL;
+  unsigned int rate = args->sample_rate > 0 ? (unsigned)args->sample_rate
+                                            : 48000u;
+  unsigned int play_rate = rate;
+  snd_pcm_uframes_t period = (snd_pcm_uframes_t)args->alsa_period;
+  snd_pcm_uframes_t play_period = period;
+  const char *play_name =
+      args->alsa_playback ? args->alsa_playback : "default";
+  int err, rc = 1, linked = 0;
+  FILE *csv = NULL;
+  audio_tap_t *tap = NULL;
+
+  if ((err = snd_pcm_open(&cap, args->alsa_capture, SND_PCM_STREAM_CAPTURE,
+                          0)) < 0) {
+    fprintf(stderr, "snd_pcm_open(%s): %s\n", args->alsa_capture,
+            snd_strerror(err));
+    goto cleanup;
+  }
+  if ((err = snd_pcm_open(&play, play_name, SND_PCM_STREAM_PLAYBACK, 0)) <
+      0) {
+    fprintf(stderr, "snd_pcm_open(%s): %s\n", play_name, snd_strerror(err));
+    goto cleanup;
+  }
+  if ((err = alsa_setup(cap, &rate, channels, &period, 4)) < 0 ||
+      (err = alsa_setup(play, &play_rate, channels, &play_period, 3)) < 0) {
+    fprintf(stderr, "ALSA setup failed: %s\n", snd_strerror(err));
+    goto cleanup;
+  }
+  if (rate != play_rate) {
+    fprintf(stderr, "ALSA rates differ: capture %uHz, playback %uHz\n", rate,
+            play_rate);
+    goto cleanup;
+  }
+
+  linked = snd_pcm_link(cap, play) == 0;
+  printf("alsa: %s -> %s, S16_LE %dch %uHz, period %lu/%lu frames (%.2fms)%s\n",
+         args->alsa_capture, play_name, channels, rate, period, play_period,
+         period * 1000.0 / rate, linked ? ", linked" : "");
+
+  struct sched_param sp = {.sched_priority = 10};
+  if (pthread_setschedparam(pthread_self(), SCHED_FIFO, &sp) != 0)
+    printf("alsa: no realtime priority, expect xruns under load\n");
+
+  if (args->stats_path && !(csv = audio_stats_open(args->stats_path)))
+    goto cleanup;
+
+  // Only the meter fields are used on this path.
+  audio_passthrough_t pt;
+  memset(&pt, 0, sizeof(pt));
+  pt.meter = args->meter;
+  pt.stats = args->stats;
+  pt.spectrum = args->spectrum;
+  pt.format = SDL_AUDIO_S16;
+  pt.channels = channels;
+  pt.freq = (int)rate;
+  pt.frame_bytes = frame_bytes;
+  pt.in_frame_bytes = frame_bytes;
+  args->sync->audio_fixed = 1;
+
+  if (args->tap_path &&
+      !(tap = audio_tap_open(args->tap_path, SDL_AUDIO_S16, channels,
+                             (int)rate)))
+    goto cleanup;
+  pt.tap = tap;
+  if (args->mkv)
+    mkv_audio_setup(args->mkv, SDL_AUDIO_S16, channels, (int)rate);
+  if (args->replay)
+    replay_audio_setup(args->replay, SDL_AUDIO_S16, channels, (int)rate);
+
+  snd_pcm_uframes_t prefill = 2 * play_period;
+  if ((err = alsa_start(cap, play, linked, prefill, frame_bytes)) < 0) {
+    fprintf(stderr, "ALSA start failed: %s\n", snd_strerror(err));
     goto cleanup;
   }
 
-  // App-side format: what we read/write in the loop.
+  latency_probe_t probe;
+  if (args->probe_trials > 0) {
+    if (probe_init(&probe, args->probe_trials, (int)rate) < 0) {
+      fprintf(stderr, "probe: out of memory\n");
+      probe_free(&probe);
+      goto cleanup;
+    }
+    pt.probe = &probe;
+  }
+
+  Uint64 start_ns = mono_ns();
+  Uint64 last_log_ns = start_ns, last_sync_ns = start_ns;
+
+  while (*args->running && !g_stop) {
+    snd_pcm_wait(cap, AUDIO_IDLE_POLL_MS);
+
+    snd_pcm_sframes_t cav = snd_pcm_avail_update(cap);
+    snd_pcm_sframes_t pav = snd_pcm_avail_update(play);
+    if (cav < 0 || pav < 0) {
+      // xrun: capture overran or playback ran dry. Restart both in step.
+      if (cav < 0) {
+        atomic_fetch_add(&args->stats->loss_events, 1);
+        atomic_fetch_add(&args->stats->lost_frames, (long long)period);
+      } else {
+        atomic_fetch_add(&args->stats->starved, 1);
+        atomic_fetch_add(&args->stats->starved_bytes,
+                         (long long)play_period * frame_bytes);
+      }
+      if (pt.probe)
+        atomic_store(&pt.probe->glitched, 1);
+      if ((err = alsa_restart(cap, play, linked, prefill, frame_bytes)) < 0) {
+        fprintf(stderr, "ALSA restart failed: %s\n", snd_strerror(err));
+        break;
+      }
+      continue;
+    }
+
+    while (cav > 0) {
+      const snd_pcm_channel_area_t *ca, *pa;
+      snd_pcm_uframes_t coff, cn = (snd_pcm_uframes_t)cav;
+      if ((err = snd_pcm_mmap_begin(cap, &ca, &coff, &cn)) < 0)
+        break;
+      const Uint8 *src = alsa_area_ptr(ca, coff);
+      audio_meter_chunk(&pt, src, (int)(cn * frame_bytes));
+      spectrum_push(&pt, src, (int)(cn * frame_bytes));
+      if (pt.tap)
+        audio_tap_write(pt.tap, src, (int)(cn * frame_bytes));
+      if (args->mkv || args->replay) {
+        Uint64 span = (Uint64)cn * 1000000000ull / rate;
+        for (snd_pcm_uframes_t o = 0; o < cn;) {
+          int n = AUDIO_CHUNK_BYTES / frame_bytes;
+          if ((snd_pcm_uframes_t)n > cn - o)
+            n = (int)(cn - o);
+          Uint64 ts = mono_ns() - span + o * 1000000000ull / rate;
+          if (args->mkv)
+            mkv_push_audio(args->mkv, src + o * frame_bytes, n * frame_bytes,
+                           ts);
+          if (args->replay)
+            replay_push_audio(args->replay, src + o * frame_bytes,
+                              n * frame_bytes, ts);
+          o += (snd_pcm_uframes_t)n;
+        }
+      }
+      atomic_fetch_add(&args->stats->received, (long long)cn);
+      long long first = 0;
+      if (pt.probe) {
+        first = atomic_load(&pt.probe->in_pos);
+        probe_capture(pt.probe, src, (int)cn, channels, 0);
+      }
+
+      // Playback can only fill up when the two cards' clocks drift; the
+      // excess input is dropped and counted.
+      snd_pcm_uframes_t done = 0;
+      while (done < cn && pav > 0) {
+        snd_pcm_uframes_t poff, pn = cn - done;
+        if ((snd_pcm_sframes_t)pn > pav)
+          pn = (snd_pcm_uframes_t)pav;
+        if ((err = snd_pcm_mmap_begin(play, &pa, &poff, &pn)) < 0)
+          break;
+        if (pt.probe)
+          probe_render(pt.probe, alsa_area_ptr(pa, poff), (int)pn, channels, 0,
+                       first + (long long)done);
+        else
+          memcpy(alsa_area_ptr(pa, poff), src + done * frame_bytes,
+                 pn * frame_bytes);
+        // A failed commit is left to the next avail_update, like a failed
+        // begin; what was not committed counts as lost.
+        if (snd_pcm_mmap_commit(play, poff, pn) != (snd_pcm_sframes_t)pn)
+          break;
+        done += pn;
+        pav -= (snd_pcm_sframes_t)pn;
+      }
+      if (done < cn) {
+        atomic_fetch_add(&args->stats->loss_events, 1);
+        atomic_fetch_add(&args->stats->lost_frames, (long long)(cn - done));
+      }
+
+      if (snd_pcm_mmap_commit(cap, coff, cn) != (snd_pcm_sframes_t)cn)
+        break; // xrun: the next avail_update restarts both
+      cav -= (snd_pcm_sframes_t)cn;
+    }
+
+    if (pt.probe && probe_poll(pt.probe))
+      break;
+
+    Uint64 now_ns = mono_ns();
+    if (now_ns - last_sync_ns >= (Uint64)AV_SYNC_INTERVAL_MS * SDL_NS_PER_MS) {
+      last_sync_ns = now_ns;
+      snd_pcm_sframes_t delay = 0;
+      snd_pcm_delay(play, &delay);
+      atomic_store(&args->sync->audio_latency_us,
+                   (int)((delay + (snd_pcm_sframes_t)period) * 1000000 /
+                         (snd_pcm_sframes_t)rate));
+      av_sync_step(args->sync);
+    }
+
+    if (now_ns - last_log_ns >=
+        (Uint64)AUDIO_STATS_INTERVAL_MS * SDL_NS_PER_MS) {
+      last_log_ns = now_ns;
+      double latency_ms = atomic_load(&args->sync->audio_latency_us) / 1000.0;
+      printf("alsa: capture->playback %.2fms, av offset %+.1fms\n",
+             latency_ms, atomic_load(&args->sync->offset_us) / 1000.0);
+      audio_meter_report(args->meter);
+      audio_stats_report(args->stats, csv,
+                         (double)(now_ns - start_ns) / SDL_NS_PER_SECOND,
+                         AUDIO_STATS_INTERVAL_MS / 1000.0, frame_bytes,
+                         (int)rate, latency_ms, 1.0);
+    }
+  }
+
+  rc = 0;
+  if (pt.probe) {
+    rc = probe_report(pt.probe);
+    probe_free(pt.probe);
+  }
+
+cleanup:
+  if (linked)
+    snd_pcm_unlink(cap);
+  if (cap)
+    snd_pcm_close(cap);
+  if (play)
+    snd_pcm_close(play);
+  if (csv)
+    fclose(csv);
+  audio_tap_close(tap);
+  return rc;
+}
+#endif
+
+int proc_audio(const proc_audio_args_t *args) {
+  int rc = 1;
+
+  if (args->alsa_capture) {
+#ifdef HAVE_ALSA
+    return alsa_passthrough(args);
+#else
+    fprintf(stderr, "--alsa-capture: built without ALSA support\n");
+    return 1;
+#endif
+  }
+
+  audio_passthrough_t pt;
+  SDL_zero(pt);
+
+  SDL_AudioStream *rec_stream = NULL;
+  SDL_AudioStream *out_stream = NULL;
+  SDL_AudioDeviceID rec_dev = 0;
+  SDL_AudioDeviceID out_dev = 0;
+  FILE *csv = NULL;
+  audio_tap_t *tap = NULL;
+  latency_probe_t probe;
+  memset(&probe, 0, sizeof(probe));
+  audio_source_t sources[AUDIO_MAX_SOURCES];
+  memset(sources, 0, sizeof(sources));
+  int nsources = 0;
+
+  SDL_AudioDeviceID rec_id = pick_recording_device(args->dev);
+  SDL_AudioDeviceID out_id = pick_playback_device(args->out);
+
+  int dev_channels = 0;
+  SDL_AudioSpec want = negotiate_audio_spec(rec_id, out_id, args->sample_rate,
+                                            &dev_channels);
+  if (audio_mix_setup(&pt.mix, want.channels, dev_channels, args) < 0)
+    goto cleanup;
+
+  // App-side formats: what we read from rec_stream and, after the channel
+  // stage, write into out_stream.
+  SDL_AudioSpec inspec = want;
   SDL_AudioSpec appspec = want;
+  appspec.channels = pt.mix.out_channels;
+
+  rec_dev = SDL_OpenAudioDevice(rec_id, &inspec);
+  if (!rec_dev) {
+    fprintf(stderr, "Open recording failed: %s\n", SDL_GetError());
+    goto cleanup;
+  }
+
+  out_dev = SDL_OpenAudioDevice(out_id, &appspec);
+  if (!out_dev) {
+    fprintf(stderr, "Open playback failed: %s\n", SDL_GetError());
+    goto cleanup;
+  }
 
   // recording: device -> stream -> app
-  rec_stream = SDL_CreateAudioStream(NULL, &appspec);
+  rec_stream = SDL_CreateAudioStream(NULL, &inspec);
   if (!rec_stream || !SDL_BindAudioStream(rec_dev, rec_stream)) {
     fprintf(stderr, "Bind rec_stream failed: %s\n", SDL_GetError());
     goto cleanup;
@@ -241,221 +2509,4233 @@ int proc_audio(const proc_audio_args_t *args) {
     goto cleanup;
   }
 
-  SDL_ResumeAudioDevice(rec_dev);
-  SDL_ResumeAudioDevice(out_dev);
+  // extra sources: device (native format) -> stream -> playback format
+  for (int i = 0; i < args->nsources; i++) {
+    audio_source_t *src = &sources[nsources];
+    char sel[256];
+    snprintf(sel, sizeof(sel), "%s", args->sources[i]);
+    // A trailing @DB is a gain only if all of it is a number; device names
+    // may contain '@' themselves.
+    char *at = strrchr(sel, '@');
+    src->gain = 1.0f;
+    if (at) {
+      char *end;
+      double db = strtod(at + 1, &end);
+      if (end != at + 1 && *end == '\0' && isfinite(db)) {
+        *at = '\0';
+        src->gain = powf(10.0f, (float)db / 20.0f);
+      }
+    }
+    src->sel = args->sources[i];
+    src->target_bytes =
+        (int)((Sint64)appspec.freq * AUDIO_SOURCE_TARGET_MS / 1000) *
+        SDL_AUDIO_FRAMESIZE(appspec);
+    audio_drift_init(&src->drift, AUDIO_SOURCE_TARGET_MS);
+    nsources++;
+
+    SDL_AudioDeviceID id = pick_recording_device(sel);
+    src->dev = SDL_OpenAudioDevice(id, NULL);
+    src->stream = src->dev ? SDL_CreateAudioStream(NULL, &appspec) : NULL;
+    if (!src->stream || !SDL_BindAudioStream(src->dev, src->stream)) {
+      fprintf(stderr, "Open source %s failed: %s\n", sel, SDL_GetError());
+      goto cleanup;
+    }
+    printf("audio: mixing in %s at %+.1fdB\n", sel,
+           20.0f * log10f(src->gain > 0.0f ? src->gain : 1e-5f));
+  }
+
+  // Samples are moved by audio_passthrough_cb as they arrive; this thread
+  // only steers queue depth and A/V alignment. Playback starts once the queue
+  // holds target_ms worth of samples.
+  int frame_bytes = SDL_AUDIO_FRAMESIZE(appspec);
+  pt.out_stream = out_stream;
+  pt.out_dev = out_dev;
+  pt.prime_bytes =
+      (int)((Sint64)appspec.freq * args->target_ms / 1000) * frame_bytes;
+  pt.frame_bytes = frame_bytes;
+  pt.in_frame_bytes = SDL_AUDIO_FRAMESIZE(inspec);
+  pt.meter = args->meter;
+  pt.format = appspec.format;
+  pt.channels = inspec.channels;
+  pt.freq = appspec.freq;
+  pt.stats = args->stats;
+  pt.spectrum = args->spectrum;
+  pt.silence = (Uint8)SDL_GetSilenceValueForFormat(appspec.format);
+  pt.ring_size =
+      (int)((Sint64)appspec.freq * args->sync->max_delay_us / 1000000) *
+          frame_bytes +
+      2 * AUDIO_CHUNK_BYTES / frame_bytes * frame_bytes;
+  pt.ring = malloc((size_t)pt.ring_size);
+  if (!pt.ring) {
+    perror("malloc(audio delay ring)");
+    goto cleanup;
+  }
+  memset(pt.ring, pt.silence, (size_t)pt.ring_size);
+  printf("audio delay ring: %d bytes (%.0fms)\n", pt.ring_size,
+         args->sync->max_delay_us / 1000.0);
+
+  pt.standby_bytes =
+      (int)((Sint64)appspec.freq * args->standby_ms / 1000) * frame_bytes;
+  pt.sources = sources;
+  pt.nsources = nsources;
+  pt.mkv = args->mkv;
+  if (pt.mkv)
+    mkv_audio_setup(pt.mkv, appspec.format, appspec.channels, appspec.freq);
+  pt.replay = args->replay;
+  if (pt.replay)
+    replay_audio_setup(pt.replay, appspec.format, appspec.channels,
+                       appspec.freq);
+
+  if (args->tap_path &&
+      !(tap = audio_tap_open(args->tap_path, inspec.format, inspec.channels,
+                             inspec.freq)))
+    goto cleanup;
+  pt.tap = tap;
+
+  if (args->probe_trials > 0) {
+    if (probe_init(&probe, args->probe_trials, inspec.freq) < 0) {
+      fprintf(stderr, "probe: out of memory\n");
+      goto cleanup;
+    }
+    pt.probe = &probe;
+  }
+
+  SDL_PauseAudioDevice(out_dev);
+  if (!SDL_SetAudioStreamPutCallback(rec_stream, audio_passthrough_cb, &pt) ||
+      !SDL_SetAudioStreamGetCallback(out_stream, audio_playback_cb, &pt)) {
+    fprintf(stderr, "SetAudioStream callbacks failed: %s\n", SDL_GetError());
+    goto cleanup;
+  }
+
+  if (args->stats_path && !(csv = audio_stats_open(args->stats_path)))
+    goto cleanup;
+
+  SDL_ResumeAudioDevice(rec_dev);
+
+  // Device-side buffering that sits outside out_stream's queue.
+  SDL_AudioSpec devspec;
+  int rec_frames = 0, out_frames = 0;
+  SDL_GetAudioDeviceFormat(rec_dev, &devspec, &rec_frames);
+  SDL_GetAudioDeviceFormat(out_dev, &devspec, &out_frames);
+  double device_ms = (rec_frames + out_frames) * 1000.0 / appspec.freq;
+
+  audio_drift_t drift;
+  audio_drift_init(&drift, args->target_ms);
+  Uint64 last_ns = SDL_GetTicksNS();
+  Uint64 last_log_ns = last_ns;
+  Uint64 last_sync_ns = last_ns;
+  Uint64 start_ns = last_ns;
+  audio_loss_t loss;
+  int loss_armed = 0;
+  int standby = 0;
+
+  while (*args->running && !g_stop && !pt.failed) {
+    SDL_Delay(standby ? AUDIO_STANDBY_POLL_MS : AUDIO_IDLE_POLL_MS);
+    if (pt.probe && probe_poll(pt.probe))
+      break;
+
+    Uint64 now_ns = SDL_GetTicksNS();
+    double dt_s = (double)(now_ns - last_ns) / SDL_NS_PER_SECOND;
+    last_ns = now_ns;
+
+    int delay_us = av_total_delay_us(args->sync, &args->sync->audio_delay_us,
+                                     &args->sync->audio_user_us);
+    atomic_store(&pt.want_delay_bytes,
+                 (int)((Sint64)appspec.freq * delay_us / 1000000) *
+                     frame_bytes);
+    if (!pt.primed)
+      continue;
+
+    if (!loss_armed) {
+      audio_loss_init(&loss, now_ns, atomic_load(&args->stats->received),
+                      appspec.freq, rec_frames);
+      loss_armed = 1;
+    }
+    audio_loss_update(&loss, args->stats, now_ns, appspec.freq, dt_s);
+
+    // On standby the queue is empty on purpose: keep the drift controller
+    // and the latency estimate where they were.
+    if (atomic_load(&pt.standby) != standby) {
+      standby = !standby;
+      if (standby)
+        printf("audio: %.1fs of silence, playback on standby\n",
+               args->standby_ms / 1000.0);
+      else
+        printf("audio: signal back, playback resumed\n");
+    }
+    if (standby)
+      continue;
+
+    int queued = SDL_GetAudioStreamQueued(out_stream);
+    if (queued < 0)
+      continue;
+    double queued_ms = queued * 1000.0 / ((double)frame_bytes * appspec.freq);
+    atomic_store(&args->sync->audio_latency_us,
+                 (int)((queued_ms + device_ms) * 1000.0) + delay_us);
+
+    if (now_ns - last_sync_ns >= (Uint64)AV_SYNC_INTERVAL_MS * SDL_NS_PER_MS) {
+      last_sync_ns = now_ns;
+      av_sync_step(args->sync);
+    }
+
+    double prev = drift.ratio;
+    double ratio = audio_drift_update(&drift, queued_ms, dt_s);
+    if (ratio != prev)
+      SDL_SetAudioStreamFrequencyRatio(out_stream, (float)ratio);
+
+    for (int i = 0; i < nsources; i++) {
+      audio_source_t *src = &sources[i];
+      if (!atomic_load(&src->primed))
+        continue;
+      double backlog_ms = SDL_GetAudioStreamAvailable(src->stream) * 1000.0 /
+                          ((double)frame_bytes * appspec.freq);
+      double src_prev = src->drift.ratio;
+      if (audio_drift_update(&src->drift, backlog_ms, dt_s) != src_prev)
+        SDL_SetAudioStreamFrequencyRatio(src->stream,
+                                         (float)src->drift.ratio);
+    }
+
+    if (now_ns - last_log_ns >=
+        (Uint64)AUDIO_STATS_INTERVAL_MS * SDL_NS_PER_MS) {
+      last_log_ns = now_ns;
+      printf("audio: queue=%.1fms (avg %.1fms, target %.1fms) ratio=%.6f\n",
+             queued_ms, drift.depth_ms, drift.target_ms, ratio);
+      printf("av: video %.1fms audio %.1fms offset %+.1fms, delay video "
+             "%.1fms audio %.1fms\n",
+             atomic_load(&args->sync->video_latency_us) / 1000.0,
+             atomic_load(&args->sync->audio_latency_us) / 1000.0,
+             atomic_load(&args->sync->offset_us) / 1000.0,
+             av_total_delay_us(args->sync, &args->sync->video_delay_us,
+                               &args->sync->video_user_us) /
+                 1000.0,
+             delay_us / 1000.0);
+
+      for (int i = 0; i < nsources; i++)
+        printf("audio: source %s backlog %.1fms ratio=%.6f underruns %d "
+               "resyncs %d\n",
+               sources[i].sel, sources[i].drift.depth_ms,
+               sources[i].drift.ratio, atomic_load(&sources[i].underruns),
+               atomic_load(&sources[i].resyncs));
+
+      audio_meter_report(args->meter);
+      audio_stats_report(args->stats, csv,
+                         (double)(now_ns - start_ns) / SDL_NS_PER_SECOND,
+                         AUDIO_STATS_INTERVAL_MS / 1000.0, frame_bytes,
+                         appspec.freq, queued_ms, ratio);
+    }
+  }
+
+  rc = pt.failed ? 1 : 0;
+
+cleanup:
+  // rec_stream goes first: its callback still references out_stream.
+  if (rec_stream)
+    SDL_DestroyAudioStream(rec_stream);
+  if (pt.probe && rc == 0)
+    rc = probe_report(pt.probe);
+  probe_free(&probe);
+  audio_tap_close(tap);
+  if (out_stream)
+    SDL_SetAudioStreamGetCallback(out_stream, NULL, NULL);
+  for (int i = 0; i < nsources; i++) {
+    if (sources[i].stream)
+      SDL_DestroyAudioStream(sources[i].stream);
+    if (sources[i].dev)
+      SDL_CloseAudioDevice(sources[i].dev);
+  }
+  free(pt.ring);
+  if (csv)
+    fclose(csv);
+  if (out_stream)
+    SDL_DestroyAudioStream(out_stream);
+  if (out_dev)
+    SDL_CloseAudioDevice(out_dev);
+  if (rec_dev)
+    SDL_CloseAudioDevice(rec_dev);
+  return rc;
+}
+
+// Allocates and prefaults every slot up front so that changing the delay
+// later never allocates.
+static int video_delay_init(video_delay_t *d, int slots, size_t slot_size) {
+  memset(d, 0, sizeof(*d));
+  d->data = malloc((size_t)slots * slot_size);
+  d->capture_ns = calloc((size_t)slots, sizeof(*d->capture_ns));
+  if (!d->data || !d->capture_ns) {
+    free(d->data);
+    free(d->capture_ns);
+    return -1;
+  }
+  memset(d->data, 0, (size_t)slots * slot_size);
+  d->slots = slots;
+  d->slot_size = slot_size;
+  return 0;
+}
+
+static void video_delay_free(video_delay_t *d) {
+  free(d->data);
+  free(d->capture_ns);
+  memset(d, 0, sizeof(*d));
+}
+
+static uint8_t *video_delay_head(const video_delay_t *d) {
+  return d->data + (size_t)d->head * d->slot_size;
+}
+
+// Copy a frame in at the tail; a full ring gives up its oldest frame.
+static void video_delay_push(video_delay_t *d, const void *frame, size_t len,
+                             Uint64 capture_ns) {
+  if (d->count == d->slots) {
+    d->head = (d->head + 1) % d->slots;
+    d->count--;
+  }
+  int tail = (d->head + d->count) % d->slots;
+  memcpy(d->data + (size_t)tail * d->slot_size, frame,
+         len < d->slot_size ? len : d->slot_size);
+  d->capture_ns[tail] = capture_ns;
+  d->count++;
+}
+
+static void video_delay_pop(video_delay_t *d) {
+  d->head = (d->head + 1) % d->slots;
+  d->count--;
+}
+
+static int requeue_buffer(int fd, uint32_t index) {
+  struct v4l2_buffer b;
+  memset(&b, 0, sizeof(b));
+  b.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+  b.memory = V4L2_MEMORY_MMAP;
+  b.index = index;
+  if (xioctl(fd, VIDIOC_QBUF, &b) < 0) {
+    fprintf(stderr, "VIDIOC_QBUF (requeue) failed: %s\n", strerror(errno));
+    return -1;
+  }
+  return 0;
+}
+
+// Level meter overlay in the bottom-left corner: one bar per channel showing
+// RMS, with a tick at the held peak. The scale runs from -60 to 0 dBFS.
+static void draw_meter(SDL_Renderer *ren, const audio_meter_t *m, int out_h) {
+  const float bar_w = 10.0f, gap = 3.0f, bar_h = 120.0f, pad = 8.0f;
+  int nch = atomic_load(&m->channels);
+  if (nch <= 0)
+    return;
+
+  SDL_SetRenderDrawBlendMode(ren, SDL_BLENDMODE_BLEND);
+  SDL_FRect bg = {pad, (float)out_h - bar_h - 2 * pad,
+                  nch * (bar_w + gap) - gap + 2 * pad, bar_h + 2 * pad};
+  SDL_SetRenderDrawColor(ren, 0, 0, 0, 160);
+  SDL_RenderFillRect(ren, &bg);
+
+  for (int c = 0; c < nch; c++) {
+    float rms = (q16_to_dbfs(atomic_load(&m->rms_q16[c])) + 60.0f) / 60.0f;
+    float pk = (q16_to_dbfs(atomic_load(&m->peak_q16[c])) + 60.0f) / 60.0f;
+    rms = rms < 0.0f ? 0.0f : rms > 1.0f ? 1.0f : rms;
+    pk = pk < 0.0f ? 0.0f : pk > 1.0f ? 1.0f : pk;
+
+    float x = bg.x + pad + c * (bar_w + gap);
+    float base = bg.y + pad + bar_h;
+    SDL_FRect bar = {x, base - rms * bar_h, bar_w, rms * bar_h};
+    SDL_SetRenderDrawColor(ren, 40, 200, 60, 255);
+    SDL_RenderFillRect(ren, &bar);
+
+    SDL_FRect tick = {x, base - pk * bar_h, bar_w, 2.0f};
+    if (pk > 0.95f)
+      SDL_SetRenderDrawColor(ren, 230, 40, 40, 255);
+    else
+      SDL_SetRenderDrawColor(ren, 230, 200, 40, 255);
+    SDL_RenderFillRect(ren, &tick);
+  }
+  SDL_SetRenderDrawColor(ren, 0, 0, 0, 255);
+}
+
+// Spectrum bands, -72..0 dBFS, in the bottom right corner.
+static void draw_spectrum(SDL_Renderer *ren, const spectrum_t *sp, int out_w,
+                          int out_h) {
+  const float bar_w = 5.0f, gap = 1.0f, bar_h = 120.0f, pad = 8.0f;
+  int bands = atomic_load(&sp->bands);
+  if (bands <= 0)
+    return;
+
+  SDL_SetRenderDrawBlendMode(ren, SDL_BLENDMODE_BLEND);
+  float w = bands * (bar_w + gap) - gap + 2 * pad;
+  SDL_FRect bg = {(float)out_w - w - pad, (float)out_h - bar_h - 2 * pad, w,
+                  bar_h + 2 * pad};
+  SDL_SetRenderDrawColor(ren, 0, 0, 0, 160);
+  SDL_RenderFillRect(ren, &bg);
+
+  SDL_SetRenderDrawColor(ren, 60, 160, 230, 255);
+  for (int b = 0; b < bands; b++) {
+    float v = (q16_to_dbfs(atomic_load(&sp->band_q16[b])) + 72.0f) / 72.0f;
+    v = v < 0.0f ? 0.0f : v > 1.0f ? 1.0f : v;
+    float base = bg.y + pad + bar_h;
+    SDL_FRect bar = {bg.x + pad + b * (bar_w + gap), base - v * bar_h, bar_w,
+                     v * bar_h};
+    SDL_RenderFillRect(ren, &bar);
+  }
+  SDL_SetRenderDrawColor(ren, 0, 0, 0, 255);
+}
+
+// CRC32C (Castagnoli). With SSE4.2 the crc32 instruction does 8 bytes at a
+// time, which is chosen at run time since the build only assumes SSE2; the
+// fallback is slicing-by-8 over tables built on first use.
+static uint32_t crc32c_table[8][256];
+static int crc32c_hw;
+static pthread_once_t crc32c_once = PTHREAD_ONCE_INIT;
+
+static void crc32c_init(void) {
+  for (uint32_t i = 0; i < 256; i++) {
+    uint32_t c = i;
+    for (int k = 0; k < 8; k++)
+      c = c & 1 ? (c >> 1) ^ 0x82f63b78u : c >> 1;
+    crc32c_table[0][i] = c;
+  }
+  for (int t = 1; t < 8; t++)
+    for (int i = 0; i < 256; i++)
+      crc32c_table[t][i] = (crc32c_table[t - 1][i] >> 8) ^
+                           crc32c_table[0][crc32c_table[t - 1][i] & 0xff];
+#if defined(__x86_64__)
+  crc32c_hw = __builtin_cpu_supports("sse4.2");
+#endif
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2"))) static uint32_t
+crc32c_sse42(uint32_t crc, const uint8_t *p, size_t n) {
+  for (; n && ((uintptr_t)p & 7); n--)
+    crc = _mm_crc32_u8(crc, *p++);
+  uint64_t c = crc;
+  for (; n >= 8; n -= 8, p += 8) {
+    uint64_t v;
+    memcpy(&v, p, 8);
+    c = _mm_crc32_u64(c, v);
+  }
+  crc = (uint32_t)c;
+  for (; n; n--)
+    crc = _mm_crc32_u8(crc, *p++);
+  return crc;
+}
+
+// The same while copying: each word is checksummed on its way through a
+// register, so the source is only read once.
+__attribute__((target("sse4.2"))) static uint32_t
+crc32c_copy_sse42(uint32_t crc, uint8_t *d, const uint8_t *s, size_t n) {
+  uint64_t c = crc;
+  for (; n >= 8; n -= 8, s += 8, d += 8) {
+    uint64_t v;
+    memcpy(&v, s, 8);
+    memcpy(d, &v, 8);
+    c = _mm_crc32_u64(c, v);
+  }
+  crc = (uint32_t)c;
+  for (; n; n--) {
+    *d++ = *s;
+    crc = _mm_crc32_u8(crc, *s++);
+  }
+  return crc;
+}
+#endif
+
+// Running CRC without the final inversion.
+static uint32_t crc32c_update(uint32_t crc, const uint8_t *p, size_t n) {
+#if defined(__x86_64__)
+  if (crc32c_hw)
+    return crc32c_sse42(crc, p, n);
+#endif
+  for (; n >= 8; n -= 8, p += 8) {
+    uint32_t lo, hi;
+    memcpy(&lo, p, 4);
+    memcpy(&hi, p + 4, 4);
+    lo ^= crc;
+    crc = crc32c_table[7][lo & 0xff] ^ crc32c_table[6][(lo >> 8) & 0xff] ^
+          crc32c_table[5][(lo >> 16) & 0xff] ^ crc32c_table[4][lo >> 24] ^
+          crc32c_table[3][hi & 0xff] ^ crc32c_table[2][(hi >> 8) & 0xff] ^
+          crc32c_table[1][(hi >> 16) & 0xff] ^ crc32c_table[0][hi >> 24];
+  }
+  for (; n; n--)
+    crc = (crc >> 8) ^ crc32c_table[0][(crc ^ *p++) & 0xff];
+  return crc;
+}
+
+static uint32_t crc32c(const void *data, size_t n) {
+  pthread_once(&crc32c_once, crc32c_init);
+  return ~crc32c_update(0xffffffffu, data, n);
+}
+
+// memcpy() that returns the CRC32C of what it copied. The table fallback
+// is bound by its own arithmetic, so there it is simply a copy, then a sum.
+static uint32_t crc32c_copy(void *dst, const void *src, size_t n) {
+  pthread_once(&crc32c_once, crc32c_init);
+#if defined(__x86_64__)
+  if (crc32c_hw)
+    return ~crc32c_copy_sse42(0xffffffffu, dst, src, n);
+#endif
+  memcpy(dst, src, n);
+  return ~crc32c_update(0xffffffffu, dst, n);
+}
+
+// Raw recording file: one RECORD_ALIGN block of header, then one slot per
+// frame. A slot is a RECORD_FRAME_HEADER record followed by the YUYV data as
+// the driver delivered it, zero padded to a multiple of RECORD_ALIGN so every
+// write can go through O_DIRECT. A timeshift ring ("YUYVRNG1") has the same
+// layout, but frame n lives in slot n % slots and the file is overwritten
+// in circles.
+//
+// Lossless recording file ("YUYVPAK1"): the same header block, then frames
+// of any size, each a record_frame_header_t followed by the packed data, and
+// at the end a record_index_t per frame in capture order. index_offset and
+// frames are filled in when the recording is closed; until then (or after a
+// crash) the frames can still be found by walking their headers.
+//
+// With RECORD_FLAG_CRC32C set, every frame header (and index entry) carries
+// the CRC32C of the frame's data as stored: the YUYV bytes of a raw slot
+// without its padding, or the packed bytes.
+#define RECORD_FLAG_CRC32C 1
+
+typedef struct {
+  char magic[8]; // "YUYVRAW1", "YUYVPAK1" or "YUYVRNG1"
+  uint32_t header_bytes;
+  uint32_t width;
+  uint32_t height;
+  uint32_t bytesperline; // raw only, packed frames have no row padding
+  uint32_t frame_bytes;  // largest frame, unpacked
+  uint32_t slot_bytes;   // raw only
+  uint32_t fps;
+  uint32_t frames;       // 0 if the recording was not closed
+  uint64_t index_offset; // packed only
+  uint32_t flags;        // RECORD_FLAG_*
+} record_file_header_t;
+
+typedef struct {
+  uint32_t magic; // "FRM0", or "FRMZ" when packed
+  uint32_t bytes; // YUYV (or packed) bytes in this slot
+  uint32_t sequence;
+  uint32_t crc;        // with RECORD_FLAG_CRC32C
+  uint64_t capture_ns; // CLOCK_MONOTONIC
+} record_frame_header_t;
+
+typedef struct {
+  uint64_t offset; // of the frame's record_frame_header_t
+  uint32_t bytes;  // packed bytes after the header
+  uint32_t crc;    // with RECORD_FLAG_CRC32C
+  uint64_t sequence;
+  uint64_t capture_ns;
+} record_index_t;
+
+// Minimal io_uring on the raw syscalls: one submission and one completion
+// ring, mapped as the kernel lays them out.
+typedef struct {
+  int fd;
+  unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+  unsigned *cq_head, *cq_tail, *cq_mask;
+  struct io_uring_sqe *sqes;
+  struct io_uring_cqe *cqes;
+  void *sq_map, *cq_map;
+  size_t sq_len, cq_len, sqes_len;
+} uring_t;
+
+static int uring_init(uring_t *u, unsigned entries) {
+  struct io_uring_params p;
+  memset(&p, 0, sizeof(p));
+  memset(u, 0, sizeof(*u));
+  u->fd = (int)syscall(__NR_io_uring_setup, entries, &p);
+  if (u->fd < 0)
+    return -1;
+
+  u->sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  u->cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  if (p.features & IORING_FEAT_SINGLE_MMAP)
+    u->sq_len = u->cq_len = u->sq_len > u->cq_len ? u->sq_len : u->cq_len;
+  u->sq_map = mmap(NULL, u->sq_len, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+  if (u->sq_map == MAP_FAILED)
+    return -1;
+  if (p.features & IORING_FEAT_SINGLE_MMAP) {
+    u->cq_map = u->sq_map;
+  } else {
+    u->cq_map = mmap(NULL, u->cq_len, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_CQ_RING);
+    if (u->cq_map == MAP_FAILED)
+      return -1;
+  }
+  u->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+  u->sqes = mmap(NULL, u->sqes_len, PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES);
+  if (u->sqes == MAP_FAILED)
+    return -1;
+
+  uint8_t *sq = u->sq_map, *cq = u->cq_map;
+  u->sq_head = (unsigned *)(sq + p.sq_off.head);
+  u->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+  u->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+  u->sq_array = (unsigned *)(sq + p.sq_off.array);
+  u->cq_head = (unsigned *)(cq + p.cq_off.head);
+  u->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+  u->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+  u->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+  return 0;
+}
+
+static void uring_free(uring_t *u) {
+  if (u->sqes && u->sqes != MAP_FAILED)
+    munmap(u->sqes, u->sqes_len);
+  if (u->cq_map && u->cq_map != MAP_FAILED && u->cq_map != u->sq_map)
+    munmap(u->cq_map, u->cq_len);
+  if (u->sq_map && u->sq_map != MAP_FAILED)
+    munmap(u->sq_map, u->sq_len);
+  if (u->fd > 0)
+    close(u->fd);
+  memset(u, 0, sizeof(*u));
+}
+
+// Queue one write and hand it to the kernel without waiting. Returns 0 once
+// the kernel has taken it; otherwise the entry is taken back off the ring
+// and -1 returned with errno set (EAGAIN or EBUSY when the kernel is only
+// short of resources for now).
+static int uring_write(uring_t *u, int fd, const void *buf, unsigned len,
+                       uint64_t off, uint64_t user_data) {
+  unsigned tail = *u->sq_tail;
+  unsigned idx = tail & *u->sq_mask;
+  struct io_uring_sqe *sqe = &u->sqes[idx];
+  memset(sqe, 0, sizeof(*sqe));
+  sqe->opcode = IORING_OP_WRITE;
+  sqe->fd = fd;
+  sqe->addr = (uint64_t)(uintptr_t)buf;
+  sqe->len = len;
+  sqe->off = off;
+  sqe->user_data = user_data;
+  u->sq_array[idx] = idx;
+  __atomic_store_n(u->sq_tail, tail + 1, __ATOMIC_RELEASE);
+  long got;
+  do
+    got = syscall(__NR_io_uring_enter, u->fd, 1, 0, 0, NULL, 0);
+  while (got < 0 && errno == EINTR);
+  if (got == 1)
+    return 0;
+  // Nothing was consumed: without SQPOLL the kernel only reads entries
+  // inside io_uring_enter(), so the tail can simply go back.
+  __atomic_store_n(u->sq_tail, tail, __ATOMIC_RELEASE);
+  if (got >= 0)
+    errno = EAGAIN;
+  return -1;
+}
+
+// Pop one completion, optionally blocking for it. Returns 0 when there is
+// none.
+static int uring_reap(uring_t *u, int wait, struct io_uring_cqe *out) {
+  for (;;) {
+    unsigned head = *u->cq_head;
+    if (head != __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE)) {
+      *out = u->cqes[head & *u->cq_mask];
+      __atomic_store_n(u->cq_head, head + 1, __ATOMIC_RELEASE);
+      return 1;
+    }
+    if (!wait)
+      return 0;
+    if (syscall(__NR_io_uring_enter, u->fd, 0, 1, IORING_ENTER_GETEVENTS,
+                NULL, 0) < 0 &&
+        errno != EINTR)
+      return -1;
+  }
+}
+
+// Segmented recording. The recorder writes into one preallocated segment
+// file while this thread gets the next one ready and finishes the ones the
+// recorder is done with, so no open(), fallocate() or header write ever
+// happens on the capture thread. Segment k of PATH is PATH-0000k before the
+// extension. With a quota, the oldest finished segment is renamed into the
+// next one (its blocks stay allocated) and any others over it are deleted.
+typedef struct {
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  int quit;
+  char base[SEGMENT_PATH_MAX]; // PATH up to the extension
+  char ext[SEGMENT_PATH_MAX];
+  record_file_header_t header;
+  uint32_t seg_frames;
+  uint64_t seg_bytes; // a full segment on disk
+  uint64_t quota;     // 0: unlimited
+  uint8_t *block;     // aligned header block
+  int want_next;
+  unsigned next_index;
+  int next_fd; // the ready segment, or -1
+  struct {
+    int fd;
+    uint32_t frames;
+  } done[SEGMENT_DONE_SLOTS];
+  int done_head, ndone;
+  // Owned by the thread.
+  unsigned oldest;   // oldest segment still on disk
+  unsigned finished; // segments before this one are closed
+  long long created, recycled, deleted;
+} segmenter_t;
+
+static void segment_path(const segmenter_t *s, unsigned index, char *out) {
+  snprintf(out, SEGMENT_PATH_MAX, "%s-%05u%s", s->base, index, s->ext);
+}
+
+// Create (or recycle) segment k, preallocate it and write its header.
+static int segment_prepare(segmenter_t *s, unsigned k) {
+  char path[SEGMENT_PATH_MAX], old[SEGMENT_PATH_MAX];
+  segment_path(s, k, path);
+  int fd = -1;
+  while (s->quota && (uint64_t)(k + 1 - s->oldest) * s->seg_bytes > s->quota &&
+         s->oldest < s->finished) {
+    segment_path(s, s->oldest++, old);
+    if (fd < 0 && rename(old, path) == 0) {
+      fd = open(path, O_WRONLY | O_DIRECT);
+      if (fd < 0 && errno == EINVAL)
+        fd = open(path, O_WRONLY);
+      if (fd >= 0) {
+        s->recycled++;
+        continue;
+      }
+    }
+    if (unlink(old) == 0)
+      s->deleted++;
+  }
+
+  int recycled = fd >= 0;
+  if (!recycled) {
+    fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_DIRECT, 0644);
+    if (fd < 0 && errno == EINVAL)
+      fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+      fprintf(stderr, "open(%s) failed: %s\n", path, strerror(errno));
+      return -1;
+    }
+    s->created++;
+  }
+  // Zeroing a recycled file only marks its blocks unwritten, so frames of
+  // the old segment never read back and nothing is allocated again.
+  int err = 0;
+  if (!recycled ||
+      fallocate(fd, FALLOC_FL_ZERO_RANGE, 0, (off_t)s->seg_bytes) < 0)
+    err = fallocate(fd, 0, 0, (off_t)s->seg_bytes) < 0 ? errno : 0;
+  if (err && err != EOPNOTSUPP)
+    fprintf(stderr, "record: fallocate(%s) failed: %s\n", path,
+            strerror(err));
+
+  memset(s->block, 0, RECORD_ALIGN);
+  memcpy(s->block, &s->header, sizeof(s->header));
+  if (pwrite(fd, s->block, RECORD_ALIGN, 0) != RECORD_ALIGN) {
+    fprintf(stderr, "record: header write to %s failed: %s\n", path,
+            strerror(errno));
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+// Final header, unused preallocation given back, closed.
+static void segment_finish(segmenter_t *s, int fd, uint32_t frames) {
+  record_file_header_t h = s->header;
+  h.frames = frames;
+  memset(s->block, 0, RECORD_ALIGN);
+  memcpy(s->block, &h, sizeof(h));
+  if (pwrite(fd, s->block, RECORD_ALIGN, 0) != RECORD_ALIGN)
+    fprintf(stderr, "record: header update failed: %s\n", strerror(errno));
+  if (ftruncate(fd, RECORD_ALIGN + (off_t)frames * h.slot_bytes) < 0)
+    fprintf(stderr, "record: ftruncate failed: %s\n", strerror(errno));
+  close(fd);
+}
+
+static void *segmenter_thread(void *arg) {
+  segmenter_t *s = arg;
+  pthread_mutex_lock(&s->lock);
+  for (;;) {
+    if (s->ndone) {
+      int fd = s->done[s->done_head].fd;
+      uint32_t frames = s->done[s->done_head].frames;
+      s->done_head = (s->done_head + 1) % SEGMENT_DONE_SLOTS;
+      s->ndone--;
+      pthread_mutex_unlock(&s->lock);
+      segment_finish(s, fd, frames);
+      pthread_mutex_lock(&s->lock);
+      s->finished++;
+    } else if (s->want_next) {
+      unsigned k = s->next_index;
+      pthread_mutex_unlock(&s->lock);
+      int fd = segment_prepare(s, k);
+      pthread_mutex_lock(&s->lock);
+      // On failure the recorder stays in the current segment; the next
+      // rotation asks again.
+      s->want_next = 0;
+      if (fd >= 0) {
+        s->next_fd = fd;
+        s->next_index = k + 1;
+      }
+    } else if (s->quit) {
+      break;
+    } else {
+      pthread_cond_wait(&s->cond, &s->lock);
+    }
+  }
+  pthread_mutex_unlock(&s->lock);
+  return NULL;
+}
+
+// Hand a segment over to be finished; 0 when the queue is full.
+static int segmenter_retire(segmenter_t *s, int fd, uint32_t frames) {
+  pthread_mutex_lock(&s->lock);
+  int ok = s->ndone < SEGMENT_DONE_SLOTS;
+  if (ok) {
+    int at = (s->done_head + s->ndone++) % SEGMENT_DONE_SLOTS;
+    s->done[at].fd = fd;
+    s->done[at].frames = frames;
+    pthread_cond_signal(&s->cond);
+  }
+  pthread_mutex_unlock(&s->lock);
+  return ok;
+}
+
+// The prepared segment, or -1 if it is not ready yet. Taking it asks for
+// the one after.
+static int segmenter_take(segmenter_t *s) {
+  pthread_mutex_lock(&s->lock);
+  int fd = s->next_fd;
+  s->next_fd = -1;
+  s->want_next = 1;
+  pthread_cond_signal(&s->cond);
+  pthread_mutex_unlock(&s->lock);
+  return fd;
+}
+
+// Finish whatever was retired, drop the unused next segment and stop.
+static void segmenter_close(segmenter_t *s) {
+  pthread_mutex_lock(&s->lock);
+  s->quit = 1;
+  s->want_next = 0;
+  pthread_cond_signal(&s->cond);
+  pthread_mutex_unlock(&s->lock);
+  pthread_join(s->thread, NULL);
+  if (s->next_fd >= 0) {
+    char path[SEGMENT_PATH_MAX];
+    segment_path(s, s->next_index - 1, path);
+    close(s->next_fd);
+    unlink(path);
+    s->created--;
+  }
+  printf("record: %u segments", s->finished);
+  if (s->quota)
+    printf(", %lld recycled and %lld deleted for the quota", s->recycled,
+           s->deleted);
+  printf("\n");
+  pthread_mutex_destroy(&s->lock);
+  pthread_cond_destroy(&s->cond);
+  free(s->block);
+  free(s);
+}
+
+// Raw YUYV recorder. Frames are copied into a pool of RECORD_QUEUE_DEPTH
+// aligned slots, so the V4L2 buffer goes back to the driver at once, and the
+// slot is written with O_DIRECT through io_uring. When every slot is still on
+// its way to the disk the frame is dropped and counted instead of stalling
+// capture. With ring_slots set the file is a preallocated circle, and
+// slot_frame[] says which frame (plus one) each file slot holds once its
+// write has completed, 0 while it is being rewritten. With seg set the
+// recording moves to a new segment file every seg_frames; writes still in
+// flight to the previous one are told apart by their generation, and the
+// file is retired once they have all completed.
+typedef struct {
+  int fd;
+  uring_t ring;
+  uint8_t *pool;
+  size_t slot_bytes;
+  size_t frame_bytes;
+  int busy[RECORD_QUEUE_DEPTH];
+  int inflight;
+  uint64_t offset; // file offset of the next slot
+  long long frames, dropped, bytes;
+  long long last_frames, last_dropped, last_bytes;
+  Uint64 start_ns, last_ns;
+  int failed;
+  record_file_header_t header;
+  uint32_t ring_slots; // 0: a plain recording
+  uint64_t *slot_frame;
+  segmenter_t *seg;   // segmented recording, or NULL
+  uint32_t seg_count; // frames in the current segment
+  int gen;            // generation (0/1) of the current segment
+  int busy_gen[RECORD_QUEUE_DEPTH];
+  int gen_inflight[2];
+  int old_fd; // previous segment, until its writes are done
+  uint32_t old_frames;
+  long long late; // frames written past a segment end (next not ready)
+} recorder_t;
+
+static size_t record_slot_bytes(const struct v4l2_format *fmt) {
+  size_t frame_bytes =
+      fmt->fmt.pix.sizeimage
+          ? fmt->fmt.pix.sizeimage
+          : (size_t)fmt->fmt.pix.bytesperline * fmt->fmt.pix.height;
+  return (RECORD_FRAME_HEADER + frame_bytes + RECORD_ALIGN - 1) /
+         RECORD_ALIGN * RECORD_ALIGN;
+}
+
+static int recorder_open(recorder_t *r, const char *path,
+                         const struct v4l2_format *fmt, int fps,
+                         uint32_t ring_slots) {
+  memset(r, 0, sizeof(*r));
+  r->fd = -1;
+  r->old_fd = -1;
+  r->frame_bytes =
+      fmt->fmt.pix.sizeimage
+          ? fmt->fmt.pix.sizeimage
+          : (size_t)fmt->fmt.pix.bytesperline * fmt->fmt.pix.height;
+  r->slot_bytes = record_slot_bytes(fmt);
+  r->ring_slots = ring_slots;
+
+  // A ring is read back through mmap, so it is opened read-write.
+  int mode = ring_slots ? O_RDWR : O_WRONLY;
+  r->fd = open(path, mode | O_CREAT | O_TRUNC | O_DIRECT, 0644);
+  if (r->fd < 0 && errno == EINVAL) {
+    // tmpfs and some FUSE filesystems refuse O_DIRECT.
+    printf("record: %s does not support O_DIRECT, using the page cache\n",
+           path);
+    r->fd = open(path, mode | O_CREAT | O_TRUNC, 0644);
+  }
+  if (r->fd < 0) {
+    fprintf(stderr, "open(%s) failed: %s\n", path, strerror(errno));
+    return -1;
+  }
+  if (ring_slots) {
+    off_t total = RECORD_ALIGN + (off_t)ring_slots * (off_t)r->slot_bytes;
+    int err = fallocate(r->fd, 0, 0, total) < 0 ? errno : 0;
+    if (err == EOPNOTSUPP)
+      err = ftruncate(r->fd, total) < 0 ? errno : 0;
+    if (err) {
+      fprintf(stderr, "fallocate(%s, %lld MB) failed: %s\n", path,
+              (long long)total >> 20, strerror(err));
+      return -1;
+    }
+    r->slot_frame = calloc(ring_slots, sizeof(*r->slot_frame));
+    if (!r->slot_frame) {
+      perror("calloc(ring slots)");
+      return -1;
+    }
+  }
+  if (uring_init(&r->ring, RECORD_QUEUE_DEPTH) < 0) {
+    fprintf(stderr, "io_uring_setup failed: %s\n", strerror(errno));
+    return -1;
+  }
+  if (posix_memalign((void **)&r->pool, RECORD_ALIGN,
+                     RECORD_QUEUE_DEPTH * r->slot_bytes) != 0) {
+    perror("posix_memalign(record pool)");
+    r->pool = NULL;
+    return -1;
+  }
+  memset(r->pool, 0, RECORD_QUEUE_DEPTH * r->slot_bytes);
+
+  // The header block goes out synchronously, before capture starts.
+  record_file_header_t *h = (record_file_header_t *)r->pool;
+  memcpy(h->magic, ring_slots ? "YUYVRNG1" : "YUYVRAW1", 8);
+  h->header_bytes = RECORD_ALIGN;
+  h->width = fmt->fmt.pix.width;
+  h->height = fmt->fmt.pix.height;
+  h->bytesperline = fmt->fmt.pix.bytesperline;
+  h->frame_bytes = (uint32_t)r->frame_bytes;
+  h->slot_bytes = (uint32_t)r->slot_bytes;
+  h->fps = (uint32_t)fps;
+  // A timeshift ring is only a buffer; recordings are checksummed.
+  h->flags = ring_slots ? 0 : RECORD_FLAG_CRC32C;
+  r->header = *h;
+  if (pwrite(r->fd, r->pool, RECORD_ALIGN, 0) != RECORD_ALIGN) {
+    fprintf(stderr, "record header write failed: %s\n", strerror(errno));
+    return -1;
+  }
+  memset(r->pool, 0, RECORD_ALIGN);
+  r->offset = RECORD_ALIGN;
+  r->start_ns = r->last_ns = mono_ns();
+  printf("record: %s, %zu byte slots, %d in flight\n", path, r->slot_bytes,
+         RECORD_QUEUE_DEPTH);
+  return 0;
+}
+
+// Collect finished writes; with wait set, until none are left in flight.
+static void recorder_reap(recorder_t *r, int wait) {
+  struct io_uring_cqe cqe;
+  while (r->inflight > 0) {
+    int got = uring_reap(&r->ring, wait, &cqe);
+    if (got <= 0) {
+      if (got < 0) {
+        fprintf(stderr, "record: io_uring_enter failed: %s\n",
+                strerror(errno));
+        r->failed = 1;
+        r->inflight = 0;
+      }
+      return;
+    }
+    // user_data: the pool slot, and the frame number above it.
+    int slot = (int)(cqe.user_data & 0xff);
+    r->busy[slot] = 0;
+    r->gen_inflight[r->busy_gen[slot]]--;
+    r->inflight--;
+    if (cqe.res != (int)r->slot_bytes) {
+      fprintf(stderr, "record: write failed: %s\n",
+              cqe.res < 0 ? strerror(-cqe.res) : "short write");
+      r->failed = 1;
+    } else {
+      r->bytes += cqe.res;
+      uint64_t frame = cqe.user_data >> 8;
+      if (r->ring_slots)
+        r->slot_frame[frame % r->ring_slots] = frame + 1;
+    }
+  }
+}
+
+// Move on to the next segment at a segment end. If the next file is not
+// ready, or the previous one has not been retired, the current segment
+// simply grows past its preallocation until the next frame.
+static void recorder_rotate(recorder_t *r) {
+  if (r->old_fd >= 0 && r->gen_inflight[r->gen ^ 1] == 0 &&
+      segmenter_retire(r->seg, r->old_fd, r->old_frames))
+    r->old_fd = -1;
+  if (r->seg_count < r->seg->seg_frames)
+    return;
+  int fd = r->old_fd < 0 ? segmenter_take(r->seg) : -1;
+  if (fd < 0) {
+    r->late++;
+    return;
+  }
+  r->old_fd = r->fd;
+  r->old_frames = r->seg_count;
+  r->fd = fd;
+  r->offset = RECORD_ALIGN;
+  r->seg_count = 0;
+  r->gen ^= 1;
+}
+
+static void recorder_frame(recorder_t *r, const void *yuyv, size_t len,
+                           uint32_t sequence, Uint64 capture_ns) {
+  if (r->failed)
+    return;
+  recorder_reap(r, 0);
+  if (r->seg)
+    recorder_rotate(r);
+
+  int slot = -1;
+  for (int i = 0; i < RECORD_QUEUE_DEPTH && slot < 0; i++)
+    if (!r->busy[i])
+      slot = i;
+  if (slot < 0) {
+    r->dropped++;
+    return;
+  }
+
+  if (len > r->frame_bytes)
+    len = r->frame_bytes;
+  uint8_t *dst = r->pool + (size_t)slot * r->slot_bytes;
+  record_frame_header_t *h = (record_frame_header_t *)dst;
+  h->magic = 0x304d5246u; // "FRM0"
+  h->bytes = (uint32_t)len;
+  h->sequence = sequence;
+  h->capture_ns = capture_ns;
+  // Recordings carry a CRC, folded into the copy; the timeshift ring none.
+  if (r->ring_slots) {
+    memcpy(dst + RECORD_FRAME_HEADER, yuyv, len);
+    h->crc = 0;
+  } else {
+    h->crc = crc32c_copy(dst + RECORD_FRAME_HEADER, yuyv, len);
+  }
+  memset(dst + RECORD_FRAME_HEADER + len, 0,
+         r->slot_bytes - RECORD_FRAME_HEADER - len);
+
+  uint64_t at = r->ring_slots ? (uint64_t)r->frames % r->ring_slots : 0;
+  if (r->ring_slots)
+    r->offset = RECORD_ALIGN + at * r->slot_bytes;
+  if (uring_write(&r->ring, r->fd, dst, (unsigned)r->slot_bytes, r->offset,
+                  (uint64_t)slot | (uint64_t)r->frames << 8) < 0) {
+    if (errno == EAGAIN || errno == EBUSY) {
+      // The kernel is short of requests or completion room for now.
+      r->dropped++;
+      return;
+    }
+    fprintf(stderr, "record: io_uring_enter failed: %s\n", strerror(errno));
+    r->failed = 1;
+    return;
+  }
+  if (r->ring_slots)
+    r->slot_frame[at] = 0; // being rewritten
+  r->busy[slot] = 1;
+  r->busy_gen[slot] = r->gen;
+  r->gen_inflight[r->gen]++;
+  r->inflight++;
+  r->offset += r->slot_bytes;
+  r->frames++;
+  r->seg_count++;
+}
+
+static void recorder_report(recorder_t *r, Uint64 now_ns) {
+  if (now_ns - r->last_ns < (Uint64)RECORD_REPORT_MS * 1000000ull)
+    return;
+  double dt = (double)(now_ns - r->last_ns) / 1e9;
+  printf("record: %lld frames, %.1f MB/s, %lld dropped (disk busy), %d/%d "
+         "in flight\n",
+         r->frames - r->last_frames, (r->bytes - r->last_bytes) / dt / 1e6,
+         r->dropped - r->last_dropped, r->inflight, RECORD_QUEUE_DEPTH);
+  r->last_ns = now_ns;
+  r->last_frames = r->frames;
+  r->last_bytes = r->bytes;
+  r->last_dropped = r->dropped;
+}
+
+static void recorder_close(recorder_t *r) {
+  recorder_reap(r, 1);
+  if (r->seg) {
+    // Nothing is in flight: both segments go to the thread, which has
+    // room for them unless it is stuck, and then they are finished here.
+    segmenter_t *s = r->seg;
+    if (r->old_fd >= 0 && !segmenter_retire(s, r->old_fd, r->old_frames))
+      segment_finish(s, r->old_fd, r->old_frames);
+    if (r->fd >= 0 && !segmenter_retire(s, r->fd, r->seg_count))
+      segment_finish(s, r->fd, r->seg_count);
+    double dt = (double)(mono_ns() - r->start_ns) / 1e9;
+    printf("record: %lld frames, %.1f MB in %.1fs (%.1f MB/s), %lld dropped, "
+           "%lld past a segment end\n",
+           r->frames, r->bytes / 1e6, dt, dt > 0 ? r->bytes / dt / 1e6 : 0.0,
+           r->dropped, r->late);
+    segmenter_close(s);
+    r->fd = -1;
+  }
+  if (r->fd >= 0 && r->pool && !r->failed) {
+    // Every slot is idle now; the first one carries the final header.
+    memset(r->pool, 0, RECORD_ALIGN);
+    r->header.frames = (uint32_t)r->frames;
+    memcpy(r->pool, &r->header, sizeof(r->header));
+    if (pwrite(r->fd, r->pool, RECORD_ALIGN, 0) != RECORD_ALIGN)
+      fprintf(stderr, "record: header update failed: %s\n", strerror(errno));
+  }
+  if (r->fd >= 0) {
+    double dt = (double)(mono_ns() - r->start_ns) / 1e9;
+    printf("record: %lld frames, %.1f MB in %.1fs (%.1f MB/s), %lld dropped\n",
+           r->frames, r->bytes / 1e6, dt, dt > 0 ? r->bytes / dt / 1e6 : 0.0,
+           r->dropped);
+    close(r->fd);
+  }
+  uring_free(&r->ring);
+  free(r->pool);
+  free(r->slot_frame);
+  memset(r, 0, sizeof(*r));
+  r->fd = -1;
+}
+
+// Recording split into segments of the given length, under a disk quota
+// in bytes (0: none). The first segment is set up here; the rest by the
+// segmenter thread.
+static int recorder_open_segments(recorder_t *r, const char *path,
+                                  const struct v4l2_format *fmt, int fps,
+                                  int seconds, uint64_t quota) {
+  memset(r, 0, sizeof(*r));
+  r->fd = -1;
+  r->old_fd = -1;
+  uint32_t seg_frames = (uint32_t)seconds * (uint32_t)fps;
+  uint64_t seg_bytes = RECORD_ALIGN + (uint64_t)seg_frames *
+                                          record_slot_bytes(fmt);
+  if (quota && quota < 3 * seg_bytes) {
+    fprintf(stderr, "record: the quota must hold at least 3 segments of "
+                    "%llu MB\n",
+            (unsigned long long)seg_bytes >> 20);
+    return -1;
+  }
+  if (strlen(path) + 16 > SEGMENT_PATH_MAX) {
+    fprintf(stderr, "record: path too long\n");
+    return -1;
+  }
+  segmenter_t *s = calloc(1, sizeof(*s));
+  if (!s || posix_memalign((void **)&s->block, RECORD_ALIGN, RECORD_ALIGN)) {
+    perror("record: segmenter");
+    free(s);
+    return -1;
+  }
+  strcpy(s->base, path);
+  char *dot = strrchr(s->base, '.');
+  if (dot && !strchr(dot, '/')) {
+    strcpy(s->ext, dot);
+    *dot = 0;
+  }
+  s->seg_frames = seg_frames;
+  s->seg_bytes = seg_bytes;
+  s->quota = quota;
+  s->next_fd = -1;
+  s->want_next = 1;
+  s->next_index = 1;
+  s->created = 1;
+  pthread_mutex_init(&s->lock, NULL);
+  pthread_cond_init(&s->cond, NULL);
+
+  char first[SEGMENT_PATH_MAX];
+  segment_path(s, 0, first);
+  if (recorder_open(r, first, fmt, fps, 0) < 0 ||
+      (fallocate(r->fd, 0, 0, (off_t)seg_bytes) < 0 &&
+       errno != EOPNOTSUPP)) {
+    if (r->fd >= 0)
+      fprintf(stderr, "record: fallocate(%s) failed: %s\n", first,
+              strerror(errno));
+    pthread_mutex_destroy(&s->lock);
+    pthread_cond_destroy(&s->cond);
+    free(s->block);
+    free(s);
+    return -1;
+  }
+  r->old_fd = -1;
+  s->header = r->header;
+  if (pthread_create(&s->thread, NULL, segmenter_thread, s) != 0) {
+    fprintf(stderr, "record: segmenter thread failed\n");
+    pthread_mutex_destroy(&s->lock);
+    pthread_cond_destroy(&s->cond);
+    free(s->block);
+    free(s);
+    return -1;
+  }
+  r->seg = s;
+  printf("record: %d s segments of %llu MB", seconds,
+         (unsigned long long)seg_bytes >> 20);
+  if (quota)
+    printf(", %llu MB quota", (unsigned long long)quota >> 20);
+  printf("\n");
+  return 0;
+}
+
+// Timeshift: every frame also goes into a recorder ring on disk. Pausing
+// freezes the picture while capture goes on; playing resumes from the
+// pause point, at 1x or faster to catch up, until it meets the live picture
+// or the jump-to-live key. Frames are read back through a shared mapping of
+// the ring: a frame is only touched once mincore() says it is in memory,
+// with readahead asked for ahead of the playback point, so presentation
+// holds the last frame instead of waiting on the disk.
+enum { TIMESHIFT_LIVE, TIMESHIFT_PAUSED, TIMESHIFT_PLAYING };
+
+typedef struct {
+  recorder_t rec;
+  const uint8_t *map;
+  size_t map_bytes;
+  unsigned char *resident; // mincore() result for one slot
+  size_t page;
+  int state;
+  uint64_t pos;   // frame on screen
+  Uint64 pos_ns;  // playback clock, in capture time
+  Uint64 wall_ns; // when the clock last moved
+  uint64_t ahead; // readahead asked for up to here
+  int speed_pct;
+  Uint64 live_ns; // capture time of the newest frame
+  long long held, overrun;
+} timeshift_t;
+
+static int timeshift_open(timeshift_t *t, const char *path, size_t bytes,
+                          const struct v4l2_format *fmt, int fps) {
+  memset(t, 0, sizeof(*t));
+  t->rec.fd = -1;
+  size_t slot = record_slot_bytes(fmt);
+  uint64_t slots = bytes > RECORD_ALIGN ? (bytes - RECORD_ALIGN) / slot : 0;
+  if (slots < 4 * RECORD_QUEUE_DEPTH) {
+    fprintf(stderr, "timeshift: %zu MB holds too few frames\n", bytes >> 20);
+    return -1;
+  }
+  if (slots > UINT32_MAX)
+    slots = UINT32_MAX;
+  if (recorder_open(&t->rec, path, fmt, fps, (uint32_t)slots) < 0)
+    return -1;
+  t->map_bytes = RECORD_ALIGN + slots * slot;
+  t->map = mmap(NULL, t->map_bytes, PROT_READ, MAP_SHARED, t->rec.fd, 0);
+  if (t->map == MAP_FAILED) {
+    t->map = NULL;
+    perror("mmap(timeshift)");
+    return -1;
+  }
+  t->page = (size_t)sysconf(_SC_PAGESIZE);
+  t->resident = malloc(slot / t->page + 1);
+  if (!t->resident) {
+    perror("malloc(timeshift)");
+    return -1;
+  }
+  t->speed_pct = 100;
+  printf("timeshift: %s, %llu frames (%.0fs at %dfps)\n", path,
+         (unsigned long long)slots, (double)slots / fps, fps);
+  return 0;
+}
+
+static const uint8_t *timeshift_slot(const timeshift_t *t, uint64_t n) {
+  return t->map + RECORD_ALIGN + (n % t->rec.ring_slots) * t->rec.slot_bytes;
+}
+
+// Whether frame n is on disk and in memory; if only the former, readahead
+// is asked for and the caller tries again later.
+static int timeshift_ready(timeshift_t *t, uint64_t n) {
+  if (t->rec.slot_frame[n % t->rec.ring_slots] != n + 1)
+    return 0;
+  const uint8_t *p = timeshift_slot(t, n);
+  size_t len = t->rec.slot_bytes;
+  if (mincore((void *)p, len, t->resident) < 0)
+    return 0;
+  for (size_t i = 0; i < (len + t->page - 1) / t->page; i++)
+    if (!(t->resident[i] & 1)) {
+      madvise((void *)p, len, MADV_WILLNEED);
+      return 0;
+    }
+  return 1;
+}
+
+static void timeshift_key(timeshift_t *t, SDL_Keycode key) {
+  Uint64 now = mono_ns();
+  switch (key) {
+  case SDLK_P:
+    if (t->state == TIMESHIFT_LIVE) {
+      if (!t->rec.frames)
+        return;
+      t->state = TIMESHIFT_PAUSED;
+      t->pos = t->rec.frames - 1;
+      t->pos_ns = t->live_ns;
+      t->ahead = t->pos;
+    } else if (t->state == TIMESHIFT_PAUSED) {
+      t->state = TIMESHIFT_PLAYING;
+      t->wall_ns = now;
+    } else {
+      t->state = TIMESHIFT_PAUSED;
+    }
+    break;
+  case SDLK_C:
+    if (t->state != TIMESHIFT_LIVE)
+      t->speed_pct = t->speed_pct >= 200 ? 100 : t->speed_pct + 50;
+    break;
+  case SDLK_L:
+    t->state = TIMESHIFT_LIVE;
+    t->speed_pct = 100;
+    break;
+  default:
+    return;
+  }
+  printf("timeshift: %s, %.1fs behind, %d.%dx\n",
+         t->state == TIMESHIFT_LIVE     ? "live"
+         : t->state == TIMESHIFT_PAUSED ? "paused"
+                                        : "playing",
+         t->state == TIMESHIFT_LIVE ? 0.0 : (t->live_ns - t->pos_ns) / 1e9,
+         t->speed_pct / 100, t->speed_pct % 100 / 10);
+}
+
+// The frame to show while not live, or NULL to keep the last one.
+static const uint8_t *timeshift_frame(timeshift_t *t, Uint64 now_ns,
+                                      Uint64 *capture_ns) {
+  recorder_t *r = &t->rec;
+  uint64_t written = (uint64_t)r->frames;
+  // Frames the writer has come round to again are gone; stay clear of the
+  // ones it is about to reach.
+  uint64_t keep = r->ring_slots - RECORD_QUEUE_DEPTH;
+  if (written > keep && t->pos < written - keep) {
+    t->overrun += (long long)(written - keep - t->pos);
+    t->pos = written - keep;
+    t->ahead = t->pos;
+  }
+
+  if (t->state == TIMESHIFT_PLAYING) {
+    t->pos_ns += (now_ns - t->wall_ns) * (Uint64)t->speed_pct / 100;
+    t->wall_ns = now_ns;
+    while (t->pos + 1 < written) {
+      if (!timeshift_ready(t, t->pos + 1)) {
+        t->held++;
+        break;
+      }
+      const record_frame_header_t *h =
+          (const record_frame_header_t *)timeshift_slot(t, t->pos + 1);
+      if (h->capture_ns > t->pos_ns)
+        break;
+      // Played frames need not stay in the page cache. The fadvise leaves
+      // mapped pages alone, so unmap the slot's pages from our view first.
+      const uint8_t *played = timeshift_slot(t, t->pos);
+      madvise((void *)played, r->slot_bytes, MADV_DONTNEED);
+      posix_fadvise(r->fd, (off_t)(played - t->map), (off_t)r->slot_bytes,
+                    POSIX_FADV_DONTNEED);
+      t->pos++;
+    }
+    if (t->pos_ns >= t->live_ns) {
+      printf("timeshift: caught up, live\n");
+      t->state = TIMESHIFT_LIVE;
+      t->speed_pct = 100;
+      return NULL;
+    }
+  }
+
+  if (t->ahead < t->pos)
+    t->ahead = t->pos;
+  while (t->ahead < t->pos + TIMESHIFT_READAHEAD && t->ahead + 1 < written &&
+         r->slot_frame[(t->ahead + 1) % r->ring_slots] == t->ahead + 2) {
+    t->ahead++;
+    madvise((void *)timeshift_slot(t, t->ahead), r->slot_bytes,
+            MADV_WILLNEED);
+  }
+
+  if (!timeshift_ready(t, t->pos))
+    return NULL;
+  const uint8_t *slot = timeshift_slot(t, t->pos);
+  *capture_ns = ((const record_frame_header_t *)slot)->capture_ns;
+  if (t->pos_ns < *capture_ns)
+    t->pos_ns = *capture_ns; // after an overrun
+  return slot + RECORD_FRAME_HEADER;
+}
+
+static void timeshift_close(timeshift_t *t) {
+  if (t->rec.fd >= 0 && t->rec.ring_slots)
+    printf("timeshift: held %lld times for the disk, %lld frames overwritten "
+           "before they were shown\n",
+           t->held, t->overrun);
+  if (t->map)
+    munmap((void *)t->map, t->map_bytes);
+  free(t->resident);
+  recorder_close(&t->rec);
+  memset(t, 0, sizeof(*t));
+  t->rec.fd = -1;
+}
+
+// Lossless YUYV codec. Each byte is predicted from its neighbours of the
+// same component, left + up - upleft (mod 256), which leaves small residuals
+// on anything but noise; "left" is 2 bytes back for Y and 4 for U and V.
+// The residuals are zigzag coded and bit packed in blocks of PACK_BLOCK at
+// the width of the largest one, with the 4-bit widths of two blocks in one
+// byte ahead of their data. Flat areas cost half a byte per block.
+static size_t yuyv_pack_bound(size_t raw_bytes) {
+  size_t blocks = (raw_bytes + PACK_BLOCK - 1) / PACK_BLOCK;
+  return blocks * PACK_BLOCK + (blocks + 1) / 2;
+}
+
+// Residuals of one row of row_bytes (a multiple of 4): up is the previous
+// row or NULL, d is scratch of row_bytes + 16 bytes.
+static void yuyv_residual_row(const uint8_t *cur, const uint8_t *up,
+                              uint8_t *d, uint8_t *res, int row_bytes) {
+  memset(d, 0, 16);
+  d += 16; // d[-4..-1] read as zero
+  int x = 0;
+#if defined(__SSE2__)
+  if (up)
+    for (; x + 16 <= row_bytes; x += 16) {
+      __m128i c = _mm_loadu_si128((const __m128i *)(cur + x));
+      __m128i u = _mm_loadu_si128((const __m128i *)(up + x));
+      _mm_storeu_si128((__m128i *)(d + x), _mm_sub_epi8(c, u));
+    }
+#endif
+  for (; x < row_bytes; x++)
+    d[x] = (uint8_t)(cur[x] - (up ? up[x] : 0));
+
+  x = 0;
+#if defined(__SSE2__)
+  // Even bytes (Y) look 2 back, odd bytes (U, V) 4 back.
+  const __m128i even = _mm_set1_epi16(0x00ff);
+  for (; x + 16 <= row_bytes; x += 16) {
+    __m128i l2 = _mm_loadu_si128((const __m128i *)(d + x - 2));
+    __m128i l4 = _mm_loadu_si128((const __m128i *)(d + x - 4));
+    __m128i left = _mm_or_si128(_mm_and_si128(even, l2),
+                                _mm_andnot_si128(even, l4));
+    _mm_storeu_si128(
+        (__m128i *)(res + x),
+        _mm_sub_epi8(_mm_loadu_si128((const __m128i *)(d + x)), left));
+  }
+#endif
+  for (; x < row_bytes; x++)
+    res[x] = (uint8_t)(d[x] - d[x - ((x & 1) ? 4 : 2)]);
+}
+
+static int pack_width(const uint8_t *z) {
+  uint8_t any = 0;
+  for (int i = 0; i < PACK_BLOCK; i++)
+    any |= z[i];
+  int w = 0;
+  while (any >> w)
+    w++;
+  return w;
+}
+
+// Pack width x height YUYV (rows stride bytes apart) into out, which holds
+// yuyv_pack_bound() bytes. scratch holds 2 * (width * 2 + 16) bytes plus
+// width * height * 2 more. Returns the packed size.
+static size_t yuyv_pack(const uint8_t *yuyv, int stride, int width,
+                        int height, uint8_t *out, uint8_t *scratch) {
+  int row_bytes = width * 2;
+  size_t raw_bytes = (size_t)row_bytes * height;
+  uint8_t *d = scratch;
+  uint8_t *res = scratch + row_bytes + 16;
+  for (int y = 0; y < height; y++)
+    yuyv_residual_row(yuyv + (size_t)y * stride,
+                      y ? yuyv + (size_t)(y - 1) * stride : NULL, d,
+                      res + (size_t)y * row_bytes, row_bytes);
+
+  // zigzag in place: 0, -1, 1, -2 ... -> 0, 1, 2, 3 ...
+  for (size_t i = 0; i < raw_bytes; i++) {
+    uint8_t v = res[i];
+    res[i] = (uint8_t)((v << 1) ^ (uint8_t)((int8_t)v >> 7));
+  }
+
+  size_t blocks = (raw_bytes + PACK_BLOCK - 1) / PACK_BLOCK;
+  uint8_t *o = out;
+  uint8_t tail[PACK_BLOCK] = {0};
+  for (size_t b = 0; b < blocks; b += 2) {
+    const uint8_t *z[2];
+    int w[2] = {0, 0};
+    for (int k = 0; k < 2; k++) {
+      size_t at = (b + k) * PACK_BLOCK;
+      if (b + k >= blocks) {
+        z[k] = NULL;
+        continue;
+      }
+      if (at + PACK_BLOCK > raw_bytes) {
+        memcpy(tail, res + at, raw_bytes - at);
+        z[k] = tail;
+      } else {
+        z[k] = res + at;
+      }
+      w[k] = pack_width(z[k]);
+    }
+    *o++ = (uint8_t)(w[0] | w[1] << 4);
+    for (int k = 0; k < 2; k++) {
+      if (!z[k] || !w[k])
+        continue;
+      uint64_t acc = 0;
+      int bits = 0;
+      for (int i = 0; i < PACK_BLOCK; i++) {
+        acc |= (uint64_t)z[k][i] << bits;
+        bits += w[k];
+        if (bits >= 32) {
+          memcpy(o, &acc, 4); // little endian
+          o += 4;
+          acc >>= 32;
+          bits -= 32;
+        }
+      }
+      // PACK_BLOCK * w is a multiple of 8: whole bytes remain.
+      for (; bits > 0; bits -= 8, acc >>= 8)
+        *o++ = (uint8_t)acc;
+    }
+  }
+  return (size_t)(o - out);
+}
+
+// Inverse of yuyv_pack into compact rows (stride width * 2). Returns 0, or
+// -1 if the data runs out.
+static int yuyv_unpack(const uint8_t *in, size_t in_bytes, int width,
+                       int height, uint8_t *yuyv) {
+  int row_bytes = width * 2;
+  size_t raw_bytes = (size_t)row_bytes * height;
+  const uint8_t *i = in, *end = in + in_bytes;
+  size_t pos = 0;
+  uint8_t z[PACK_BLOCK];
+  while (pos < raw_bytes) {
+    if (i >= end)
+      return -1;
+    int hdr = *i++;
+    for (int k = 0; k < 2 && pos < raw_bytes; k++) {
+      int w = k ? hdr >> 4 : hdr & 15;
+      if (w > 8 || i + 2 * w > end)
+        return -1;
+      if (!w) {
+        memset(z, 0, sizeof(z));
+      } else {
+        uint64_t acc = 0;
+        int bits = 0;
+        uint8_t mask = (uint8_t)((1u << w) - 1);
+        for (int n = 0; n < PACK_BLOCK; n++) {
+          if (bits < w) {
+            acc |= (uint64_t)*i++ << bits;
+            bits += 8;
+          }
+          z[n] = (uint8_t)acc & mask;
+          acc >>= w;
+          bits -= w;
+        }
+      }
+      size_t n = raw_bytes - pos < PACK_BLOCK ? raw_bytes - pos : PACK_BLOCK;
+      for (size_t j = 0; j < n; j++)
+        yuyv[pos + j] = (uint8_t)((z[j] >> 1) ^ -(z[j] & 1));
+      pos += n;
+    }
+  }
+
+  // Residuals back to pixels: d = res + left(d), pixel = d + up.
+  for (int y = 0; y < height; y++) {
+    uint8_t *row = yuyv + (size_t)y * row_bytes;
+    row[2] = (uint8_t)(row[2] + row[0]);
+    for (int x = 4; x < row_bytes; x++)
+      row[x] = (uint8_t)(row[x] + row[x - ((x & 1) ? 4 : 2)]);
+    if (y) {
+      const uint8_t *up = row - row_bytes;
+      for (int x = 0; x < row_bytes; x++)
+        row[x] = (uint8_t)(row[x] + up[x]);
+    }
+  }
+  return 0;
+}
+
+// Lossless recorder: a pool of worker threads, one frame per task. The
+// capture thread copies a frame into a free job and goes on; a worker packs
+// it, reserves the next stretch of the file and writes it there with
+// pwritev(), so workers finish out of order but the index (slot = capture
+// order) stays in order. With every job taken the frame is dropped and
+// counted.
+enum { PACK_FREE, PACK_FILLING, PACK_QUEUED, PACK_BUSY };
+
+typedef struct {
+  int state;
+  int number; // capture order, the frame's index slot
+  uint8_t *raw;
+  uint64_t sequence;
+  Uint64 capture_ns;
+} pack_job_t;
+
+typedef struct {
+  int fd;
+  int width, height, stride;
+  size_t raw_bytes;
+  pack_job_t jobs[PACK_MAX_THREADS * PACK_JOBS_PER_THREAD];
+  int njobs;
+  pthread_t threads[PACK_MAX_THREADS];
+  int nthreads;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  int quit;
+  uint64_t offset; // where the next packed frame goes
+  record_index_t *index;
+  int index_cap;
+  int numbered; // frames handed to the pool
+  record_file_header_t header;
+  long long frames, dropped, raw_total, packed_total;
+  long long last_frames, last_dropped, last_raw, last_packed;
+  Uint64 pack_ns, last_pack_ns; // summed over the workers
+  Uint64 start_ns, last_ns;
+  int failed;
+} packer_t;
+
+static void *packer_worker(void *arg) {
+  packer_t *p = arg;
+  size_t bound = yuyv_pack_bound(p->raw_bytes);
+  uint8_t *out = malloc(bound);
+  uint8_t *scratch = malloc(2 * ((size_t)p->width * 2 + 16) + p->raw_bytes);
+  if (!out || !scratch) {
+    perror("malloc(lossless worker)");
+    pthread_mutex_lock(&p->lock);
+    p->failed = 1;
+    pthread_mutex_unlock(&p->lock);
+    free(out);
+    free(scratch);
+    return NULL;
+  }
+
+  pthread_mutex_lock(&p->lock);
+  for (;;) {
+    // The oldest queued frame first, so the file stays roughly in order.
+    pack_job_t *job = NULL;
+    for (int i = 0; i < p->njobs; i++)
+      if (p->jobs[i].state == PACK_QUEUED &&
+          (!job || p->jobs[i].number < job->number))
+        job = &p->jobs[i];
+    if (!job) {
+      if (p->quit)
+        break;
+      pthread_cond_wait(&p->cond, &p->lock);
+      continue;
+    }
+    job->state = PACK_BUSY;
+    pthread_mutex_unlock(&p->lock);
+
+    Uint64 t0 = mono_ns();
+    size_t n = yuyv_pack(job->raw, p->width * 2, p->width, p->height, out,
+                         scratch);
+    Uint64 t1 = mono_ns();
+    uint32_t crc = crc32c(out, n);
+
+    pthread_mutex_lock(&p->lock);
+    uint64_t at = p->offset;
+    p->offset += sizeof(record_frame_header_t) + n;
+    pthread_mutex_unlock(&p->lock);
+
+    record_frame_header_t fh = {0x5a4d5246u, (uint32_t)n,
+                                (uint32_t)job->sequence, crc,
+                                job->capture_ns}; // "FRMZ"
+    struct iovec iov[2] = {{&fh, sizeof(fh)}, {out, n}};
+    ssize_t w = pwritev(p->fd, iov, 2, (off_t)at);
+
+    pthread_mutex_lock(&p->lock);
+    if (w != (ssize_t)(sizeof(fh) + n)) {
+      if (!p->failed)
+        fprintf(stderr, "lossless: write failed: %s\n",
+                w < 0 ? strerror(errno) : "short write");
+      p->failed = 1;
+    }
+    record_index_t *ix = &p->index[job->number];
+    ix->offset = at;
+    ix->bytes = (uint32_t)n;
+    ix->crc = crc;
+    ix->sequence = job->sequence;
+    ix->capture_ns = job->capture_ns;
+    p->frames++;
+    p->raw_total += (long long)p->raw_bytes;
+    p->packed_total += (long long)n;
+    p->pack_ns += t1 - t0;
+    job->state = PACK_FREE;
+  }
+  pthread_mutex_unlock(&p->lock);
+  free(out);
+  free(scratch);
+  return NULL;
+}
+
+static int packer_open(packer_t *p, const char *path,
+                       const struct v4l2_format *fmt, int fps, int threads) {
+  memset(p, 0, sizeof(*p));
+  p->fd = -1;
+  p->width = (int)fmt->fmt.pix.width & ~1;
+  p->height = (int)fmt->fmt.pix.height;
+  p->stride = fmt->fmt.pix.bytesperline ? (int)fmt->fmt.pix.bytesperline
+                                        : p->width * 2;
+  p->raw_bytes = (size_t)p->width * 2 * p->height;
+  if (threads <= 0) {
+    // Leave a core each to capture and presentation.
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    threads = cpus > 3 ? (int)cpus - 2 : 1;
+  }
+  if (threads > PACK_MAX_THREADS)
+    threads = PACK_MAX_THREADS;
+
+  p->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (p->fd < 0) {
+    fprintf(stderr, "open(%s) failed: %s\n", path, strerror(errno));
+    return -1;
+  }
+  p->njobs = threads * PACK_JOBS_PER_THREAD;
+  for (int i = 0; i < p->njobs; i++) {
+    p->jobs[i].raw = malloc(p->raw_bytes);
+    if (!p->jobs[i].raw) {
+      perror("malloc(lossless job)");
+      return -1;
+    }
+  }
+
+  record_file_header_t *h = &p->header;
+  memcpy(h->magic, "YUYVPAK1", 8);
+  h->header_bytes = RECORD_ALIGN;
+  h->width = (uint32_t)p->width;
+  h->height = (uint32_t)p->height;
+  h->frame_bytes = (uint32_t)p->raw_bytes;
+  h->fps = (uint32_t)fps;
+  h->flags = RECORD_FLAG_CRC32C;
+  static const uint8_t zero[RECORD_ALIGN];
+  if (pwrite(p->fd, zero, RECORD_ALIGN, 0) != RECORD_ALIGN ||
+      pwrite(p->fd, h, sizeof(*h), 0) != (ssize_t)sizeof(*h)) {
+    fprintf(stderr, "lossless header write failed: %s\n", strerror(errno));
+    return -1;
+  }
+  p->offset = RECORD_ALIGN;
+
+  pthread_mutex_init(&p->lock, NULL);
+  pthread_cond_init(&p->cond, NULL);
+  for (; p->nthreads < threads; p->nthreads++)
+    if (pthread_create(&p->threads[p->nthreads], NULL, packer_worker, p) !=
+        0) {
+      fprintf(stderr, "pthread_create(lossless) failed\n");
+      break;
+    }
+  if (!p->nthreads)
+    return -1;
+  p->start_ns = p->last_ns = mono_ns();
+  printf("lossless: %s, %d worker threads\n", path, p->nthreads);
+  return 0;
+}
+
+static void packer_frame(packer_t *p, const uint8_t *yuyv, uint32_t sequence,
+                         Uint64 capture_ns) {
+  pthread_mutex_lock(&p->lock);
+  pack_job_t *job = NULL;
+  for (int i = 0; i < p->njobs && !job; i++)
+    if (p->jobs[i].state == PACK_FREE)
+      job = &p->jobs[i];
+  if (job && p->numbered == p->index_cap) {
+    int cap = p->index_cap ? p->index_cap * 2 : 1024;
+    record_index_t *ix = realloc(p->index, (size_t)cap * sizeof(*ix));
+    if (ix) {
+      p->index = ix;
+      p->index_cap = cap;
+    } else {
+      job = NULL;
+    }
+  }
+  if (!job || p->failed) {
+    p->dropped++;
+    pthread_mutex_unlock(&p->lock);
+    return;
+  }
+  job->state = PACK_FILLING;
+  job->number = p->numbered++;
+  pthread_mutex_unlock(&p->lock);
+
+  // Copy outside the lock; the job is ours until it is queued.
+  for (int y = 0; y < p->height; y++)
+    memcpy(job->raw + (size_t)y * p->width * 2, yuyv + (size_t)y * p->stride,
+           (size_t)p->width * 2);
+  job->sequence = sequence;
+  job->capture_ns = capture_ns;
+
+  pthread_mutex_lock(&p->lock);
+  job->state = PACK_QUEUED;
+  pthread_cond_signal(&p->cond);
+  pthread_mutex_unlock(&p->lock);
+}
+
+static void packer_report(packer_t *p, Uint64 now_ns) {
+  if (now_ns - p->last_ns < (Uint64)RECORD_REPORT_MS * 1000000ull)
+    return;
+  pthread_mutex_lock(&p->lock);
+  double dt = (double)(now_ns - p->last_ns) / 1e9;
+  long long frames = p->frames - p->last_frames;
+  long long packed = p->packed_total - p->last_packed;
+  long long raw = p->raw_total - p->last_raw;
+  double busy = (double)(p->pack_ns - p->last_pack_ns) / 1e9;
+  int queued = 0;
+  for (int i = 0; i < p->njobs; i++)
+    queued += p->jobs[i].state != PACK_FREE;
+  printf("lossless: %lld frames, ratio %.2f, %.1f MB/s, %.0f fps per core, "
+         "%lld dropped, %d/%d queued\n",
+         frames, packed ? (double)raw / packed : 0.0, packed / dt / 1e6,
+         busy > 0 ? frames / busy : 0.0, p->dropped - p->last_dropped, queued,
+         p->njobs);
+  p->last_ns = now_ns;
+  p->last_frames = p->frames;
+  p->last_raw = p->raw_total;
+  p->last_packed = p->packed_total;
+  p->last_pack_ns = p->pack_ns;
+  p->last_dropped = p->dropped;
+  pthread_mutex_unlock(&p->lock);
+}
+
+// Drain the pool, then write the index and the final header.
+static void packer_close(packer_t *p) {
+  if (p->nthreads) {
+    pthread_mutex_lock(&p->lock);
+    p->quit = 1;
+    pthread_cond_broadcast(&p->cond);
+    pthread_mutex_unlock(&p->lock);
+    for (int i = 0; i < p->nthreads; i++)
+      pthread_join(p->threads[i], NULL);
+    pthread_mutex_destroy(&p->lock);
+    pthread_cond_destroy(&p->cond);
+  }
+  if (p->fd >= 0 && p->nthreads && !p->failed) {
+    size_t ix_bytes = (size_t)p->numbered * sizeof(record_index_t);
+    p->header.frames = (uint32_t)p->numbered;
+    p->header.index_offset = p->offset;
+    if ((ix_bytes && pwrite(p->fd, p->index, ix_bytes, (off_t)p->offset) !=
+                         (ssize_t)ix_bytes) ||
+        pwrite(p->fd, &p->header, sizeof(p->header), 0) !=
+            (ssize_t)sizeof(p->header))
+      fprintf(stderr, "lossless: index write failed: %s\n", strerror(errno));
+  }
+  if (p->fd >= 0) {
+    double dt = (double)(mono_ns() - p->start_ns) / 1e9;
+    printf("lossless: %lld frames, %.1f MB (ratio %.2f) in %.1fs, "
+           "%.0f fps per core, %lld dropped\n",
+           p->frames, p->packed_total / 1e6,
+           p->packed_total ? (double)p->raw_total / p->packed_total : 0.0, dt,
+           p->pack_ns ? p->frames / (p->pack_ns / 1e9) : 0.0, p->dropped);
+    close(p->fd);
+  }
+  for (int i = 0; i < p->njobs; i++)
+    free(p->jobs[i].raw);
+  free(p->index);
+  memset(p, 0, sizeof(*p));
+  p->fd = -1;
+}
+
+// Streaming Matroska writer. The Segment, every Cluster and a few Info
+// fields start with placeholder sizes that are patched with pwrite() as they
+// become known; small elements and audio blocks collect in a write buffer,
+// and each video frame goes out with one writev() together with whatever is
+// buffered. Cues (one per cluster) are written at the end.
+typedef struct {
+  uint8_t *p;
+  size_t len, cap;
+} mkv_buf_t;
+
+static void mkv_put(mkv_buf_t *b, const void *data, size_t n) {
+  if (b->len + n > b->cap) {
+    size_t cap = b->cap ? b->cap : 4096;
+    while (cap < b->len + n)
+      cap *= 2;
+    uint8_t *p = realloc(b->p, cap);
+    if (!p)
+      abort();
+    b->p = p;
+    b->cap = cap;
+  }
+  memcpy(b->p + b->len, data, n);
+  b->len += n;
+}
+
+static void ebml_id(mkv_buf_t *b, uint32_t id) {
+  uint8_t v[4];
+  int n = id > 0xffffff ? 4 : id > 0xffff ? 3 : id > 0xff ? 2 : 1;
+  for (int i = 0; i < n; i++)
+    v[i] = (uint8_t)(id >> (8 * (n - 1 - i)));
+  mkv_put(b, v, (size_t)n);
+}
+
+// Element sizes are always written as 8-byte vints so they can be patched.
+static void ebml_size8(uint8_t *v, uint64_t size) {
+  v[0] = 0x01;
+  for (int i = 1; i < 8; i++)
+    v[i] = (uint8_t)(size >> (8 * (7 - i)));
+}
+
+static void ebml_size(mkv_buf_t *b, uint64_t size) {
+  uint8_t v[8];
+  ebml_size8(v, size);
+  mkv_put(b, v, 8);
+}
+
+static void ebml_uint(mkv_buf_t *b, uint32_t id, uint64_t val) {
+  uint8_t v[8];
+  for (int i = 0; i < 8; i++)
+    v[i] = (uint8_t)(val >> (8 * (7 - i)));
+  ebml_id(b, id);
+  ebml_size(b, 8);
+  mkv_put(b, v, 8);
+}
+
+static void ebml_float(mkv_buf_t *b, uint32_t id, double val) {
+  uint64_t bits;
+  memcpy(&bits, &val, 8);
+  uint8_t v[8];
+  for (int i = 0; i < 8; i++)
+    v[i] = (uint8_t)(bits >> (8 * (7 - i)));
+  ebml_id(b, id);
+  ebml_size(b, 8);
+  mkv_put(b, v, 8);
+}
+
+static void ebml_bin(mkv_buf_t *b, uint32_t id, const void *data, size_t n) {
+  ebml_id(b, id);
+  ebml_size(b, n);
+  mkv_put(b, data, n);
+}
+
+static void ebml_str(mkv_buf_t *b, uint32_t id, const char *str) {
+  ebml_bin(b, id, str, strlen(str));
+}
+
+// Open a master element; ebml_end() fills in its size.
+static size_t ebml_begin(mkv_buf_t *b, uint32_t id) {
+  ebml_id(b, id);
+  ebml_size(b, 0);
+  return b->len;
+}
+
+static void ebml_end(mkv_buf_t *b, size_t start) {
+  ebml_size8(b->p + start - 8, b->len - start);
+}
+
+typedef struct {
+  uint64_t time_ms;
+  uint64_t pos; // cluster position relative to the segment data
+} mkv_cue_t;
+
+typedef struct {
+  mkv_queue_t *q;
+  int *running; // shared running flag
+  const char *path;
+} proc_mux_args_t;
+
+typedef struct {
+  int fd;
+  mkv_buf_t out; // not yet written
+  uint64_t pos;  // file offset of out.p[0]
+  uint64_t segment_data; // file offset of the segment payload
+  uint64_t seek_cues;    // file offset of the Cues SeekPosition value
+  uint64_t duration_at;  // file offset of the Duration value
+  uint64_t cluster_at;   // file offset of the open cluster's payload, or 0
+  uint64_t cluster_ms;
+  uint64_t last_ms;
+  Uint64 base_ns;
+  int have_audio;
+  mkv_cue_t *cues;
+  int ncues, cap_cues;
+  long long video_frames, audio_blocks;
+  int failed;
+} mkv_writer_t;
+
+static void mkv_patch(mkv_writer_t *w, uint64_t at, const uint8_t *v,
+                      size_t n) {
+  if (at >= w->pos) {
+    memcpy(w->out.p + (at - w->pos), v, n);
+  } else if (pwrite(w->fd, v, n, (off_t)at) != (ssize_t)n) {
+    w->failed = 1;
+  }
+}
+
+// Write out the buffer, followed by an optional payload.
+static void mkv_flush(mkv_writer_t *w, const void *payload, size_t n) {
+  struct iovec iov[2] = {{w->out.p, w->out.len}, {(void *)payload, n}};
+  size_t total = w->out.len + n;
+  size_t done = 0;
+  while (done < total && !w->failed) {
+    ssize_t r = writev(w->fd, iov, payload ? 2 : 1);
+    if (r < 0) {
+      if (errno == EINTR)
+        continue;
+      fprintf(stderr, "mkv: write failed: %s\n", strerror(errno));
+      w->failed = 1;
+      break;
+    }
+    done += (size_t)r;
+    // Advance past what went out; rare partial writes go around again.
+    for (int i = 0; i < 2 && r > 0; i++) {
+      size_t k = (size_t)r < iov[i].iov_len ? (size_t)r : iov[i].iov_len;
+      iov[i].iov_base = (uint8_t *)iov[i].iov_base + k;
+      iov[i].iov_len -= k;
+      r -= (ssize_t)k;
+    }
+  }
+  w->pos += total;
+  w->out.len = 0;
+}
+
+static void mkv_close_cluster(mkv_writer_t *w) {
+  if (!w->cluster_at)
+    return;
+  uint8_t v[8];
+  ebml_size8(v, w->pos + w->out.len - w->cluster_at);
+  mkv_patch(w, w->cluster_at - 8, v, 8);
+  w->cluster_at = 0;
+}
+
+static void mkv_open_cluster(mkv_writer_t *w, uint64_t t_ms, int cue) {
+  mkv_close_cluster(w);
+  uint64_t at = w->pos + w->out.len;
+  ebml_id(&w->out, 0x1F43B675); // Cluster
+  ebml_size(&w->out, 0);
+  w->cluster_at = w->pos + w->out.len;
+  ebml_uint(&w->out, 0xE7, t_ms); // Timestamp
+  w->cluster_ms = t_ms;
+
+  if (cue) {
+    if (w->ncues == w->cap_cues) {
+      w->cap_cues = w->cap_cues ? 2 * w->cap_cues : 256;
+      mkv_cue_t *c = realloc(w->cues, sizeof(*c) * (size_t)w->cap_cues);
+      if (!c)
+        abort();
+      w->cues = c;
+    }
+    w->cues[w->ncues].time_ms = t_ms;
+    w->cues[w->ncues].pos = at - w->segment_data;
+    w->ncues++;
+  }
+}
+
+static void mkv_block(mkv_writer_t *w, int track, Uint64 capture_ns,
+                      const void *data, size_t n) {
+  uint64_t t_ms =
+      capture_ns > w->base_ns ? (capture_ns - w->base_ns) / 1000000 : 0;
+  if (t_ms < w->last_ms)
+    t_ms = w->last_ms; // keep block times monotonic within the file
+  w->last_ms = t_ms;
+
+  int video = track == 1;
+  if (!w->cluster_at || t_ms - w->cluster_ms > 30000 ||
+      (video && t_ms - w->cluster_ms >= MKV_CLUSTER_MS))
+    mkv_open_cluster(w, t_ms, video || w->ncues == 0);
+
+  uint8_t hdr[4] = {(uint8_t)(0x80 | track),
+                    (uint8_t)((t_ms - w->cluster_ms) >> 8),
+                    (uint8_t)(t_ms - w->cluster_ms), 0x80}; // keyframe
+  ebml_id(&w->out, 0xA3); // SimpleBlock
+  ebml_size(&w->out, sizeof(hdr) + n);
+  mkv_put(&w->out, hdr, sizeof(hdr));
+  if (video) {
+    mkv_flush(w, data, n);
+    w->video_frames++;
+  } else {
+    mkv_put(&w->out, data, n);
+    if (w->out.len >= MKV_WRITE_BUF)
+      mkv_flush(w, NULL, 0);
+    w->audio_blocks++;
+  }
+}
+
+static void mkv_write_header(mkv_writer_t *w, int width, int height,
+                             SDL_AudioFormat format, int channels, int freq) {
+  mkv_buf_t *b = &w->out;
+  size_t e = ebml_begin(b, 0x1A45DFA3); // EBML
+  ebml_uint(b, 0x4286, 1);              // EBMLVersion
+  ebml_uint(b, 0x42F7, 1);              // EBMLReadVersion
+  ebml_uint(b, 0x42F2, 4);              // EBMLMaxIDLength
+  ebml_uint(b, 0x42F3, 8);              // EBMLMaxSizeLength
+  ebml_str(b, 0x4282, "matroska");      // DocType
+  ebml_uint(b, 0x4287, 4);              // DocTypeVersion
+  ebml_uint(b, 0x4285, 2);              // DocTypeReadVersion
+  ebml_end(b, e);
+
+  ebml_id(b, 0x18538067); // Segment, size patched at the end
+  ebml_size(b, 0);
+  w->segment_data = b->len;
+
+  // SeekHead: Info and Tracks follow directly; Cues is patched at the end.
+  static const uint8_t info_id[] = {0x15, 0x49, 0xA9, 0x66},
+                       tracks_id[] = {0x16, 0x54, 0xAE, 0x6B},
+                       cues_id[] = {0x1C, 0x53, 0xBB, 0x6B};
+  size_t sh = ebml_begin(b, 0x114D9B74);
+  size_t seek = ebml_begin(b, 0x4DBB);
+  ebml_bin(b, 0x53AB, info_id, 4);
+  ebml_uint(b, 0x53AC, 0);
+  size_t info_pos = b->len - 8; // SeekPosition value, patched below
+  ebml_end(b, seek);
+  seek = ebml_begin(b, 0x4DBB);
+  ebml_bin(b, 0x53AB, tracks_id, 4);
+  ebml_uint(b, 0x53AC, 0);
+  size_t tracks_pos = b->len - 8;
+  ebml_end(b, seek);
+  seek = ebml_begin(b, 0x4DBB);
+  ebml_bin(b, 0x53AB, cues_id, 4);
+  ebml_uint(b, 0x53AC, 0);
+  w->seek_cues = b->len - 8;
+  ebml_end(b, seek);
+  ebml_end(b, sh);
+
+  uint8_t v[8];
+  for (int i = 0; i < 8; i++)
+    v[i] = (uint8_t)((b->len - w->segment_data) >> (8 * (7 - i)));
+  memcpy(b->p + info_pos, v, 8);
+  size_t info = ebml_begin(b, 0x1549A966); // Info
+  ebml_uint(b, 0x2AD7B1, 1000000);         // TimestampScale: 1ms
+  ebml_str(b, 0x4D80, "v4l2_sdl_view");    // MuxingApp
+  ebml_str(b, 0x5741, "v4l2_sdl_view");    // WritingApp
+  ebml_float(b, 0x4489, 0.0); // Duration, patched at the end
+  w->duration_at = b->len - 8;
+  ebml_end(b, info);
+
+  for (int i = 0; i < 8; i++)
+    v[i] = (uint8_t)((b->len - w->segment_data) >> (8 * (7 - i)));
+  memcpy(b->p + tracks_pos, v, 8);
+  size_t tracks = ebml_begin(b, 0x1654AE6B); // Tracks
+  size_t t = ebml_begin(b, 0xAE);            // TrackEntry
+  ebml_uint(b, 0xD7, 1);                     // TrackNumber
+  ebml_uint(b, 0x73C5, 1);                   // TrackUID
+  ebml_uint(b, 0x83, 1);                     // TrackType: video
+  ebml_uint(b, 0x9C, 0);                     // FlagLacing
+  ebml_str(b, 0x86, "V_UNCOMPRESSED");
+  size_t vid = ebml_begin(b, 0xE0); // Video
+  ebml_uint(b, 0xB0, (uint64_t)width);
+  ebml_uint(b, 0xBA, (uint64_t)height);
+  ebml_bin(b, 0x2EB524, "YUY2", 4); // ColourSpace (FourCC)
+  ebml_end(b, vid);
+  ebml_end(b, t);
+  if (w->have_audio) {
+    int is_float = SDL_AUDIO_ISFLOAT(format);
+    t = ebml_begin(b, 0xAE);
+    ebml_uint(b, 0xD7, 2);
+    ebml_uint(b, 0x73C5, 2);
+    ebml_uint(b, 0x83, 2); // audio
+    ebml_uint(b, 0x9C, 0);
+    ebml_str(b, 0x86, is_float ? "A_PCM/FLOAT/IEEE" : "A_PCM/INT/LIT");
+    size_t aud = ebml_begin(b, 0xE1); // Audio
+    ebml_float(b, 0xB5, (double)freq);
+    ebml_uint(b, 0x9F, (uint64_t)channels);
+    ebml_uint(b, 0x6264, (uint64_t)SDL_AUDIO_BITSIZE(format));
+    ebml_end(b, aud);
+    ebml_end(b, t);
+  }
+  ebml_end(b, tracks);
+  mkv_flush(w, NULL, 0);
+}
+
+static void mkv_finish(mkv_writer_t *w) {
+  mkv_close_cluster(w);
+
+  uint64_t cues_at = w->pos + w->out.len - w->segment_data;
+  size_t cues = ebml_begin(&w->out, 0x1C53BB6B); // Cues
+  for (int i = 0; i < w->ncues; i++) {
+    size_t cp = ebml_begin(&w->out, 0xBB); // CuePoint
+    ebml_uint(&w->out, 0xB3, w->cues[i].time_ms);
+    size_t tp = ebml_begin(&w->out, 0xB7); // CueTrackPositions
+    ebml_uint(&w->out, 0xF7, 1);
+    ebml_uint(&w->out, 0xF1, w->cues[i].pos);
+    ebml_end(&w->out, tp);
+    ebml_end(&w->out, cp);
+  }
+  ebml_end(&w->out, cues);
+  mkv_flush(w, NULL, 0);
+
+  uint8_t v[8];
+  for (int i = 0; i < 8; i++)
+    v[i] = (uint8_t)(cues_at >> (8 * (7 - i)));
+  mkv_patch(w, w->seek_cues, v, 8);
+  double duration = (double)w->last_ms;
+  uint64_t bits;
+  memcpy(&bits, &duration, 8);
+  for (int i = 0; i < 8; i++)
+    v[i] = (uint8_t)(bits >> (8 * (7 - i)));
+  mkv_patch(w, w->duration_at, v, 8);
+  ebml_size8(v, w->pos - w->segment_data);
+  mkv_patch(w, w->segment_data - 8, v, 8);
+}
+
+// Muxer thread: waits for the video format (and briefly for audio), then
+// writes packets from both queues in capture order. A track whose queue is
+// empty holds the other back for at most MKV_INTERLEAVE_MS. Between packets
+// it sleeps on the queue's doorbell.
+static int proc_mux(proc_mux_args_t *args) {
+  mkv_queue_t *q = args->q;
+  mkv_writer_t w;
+  memset(&w, 0, sizeof(w));
+
+  Uint64 video_ns = 0;
+  while (*args->running && !g_stop) {
+    unsigned seq = atomic_load(&q->bell.seq);
+    int wait_ms = MKV_IDLE_MS;
+    if (atomic_load_explicit(&q->video_ready, memory_order_acquire)) {
+      Uint64 now = mono_ns();
+      if (!video_ns)
+        video_ns = now;
+      Uint64 waited_ms = (now - video_ns) / 1000000ull;
+      if (atomic_load_explicit(&q->audio_ready, memory_order_acquire) ||
+          waited_ms >= MKV_AUDIO_WAIT_MS)
+        break;
+      wait_ms = MKV_AUDIO_WAIT_MS - (int)waited_ms;
+    }
+    doorbell_wait(&q->bell, seq, wait_ms);
+  }
+  if (!atomic_load_explicit(&q->video_ready, memory_order_acquire))
+    return 0;
+  w.have_audio = atomic_load_explicit(&q->audio_ready, memory_order_acquire);
+
+  w.fd = open(args->path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (w.fd < 0) {
+    fprintf(stderr, "open(%s) failed: %s\n", args->path, strerror(errno));
+    return 1;
+  }
+  mkv_write_header(&w, q->width, q->height, q->format, q->channels, q->freq);
+  printf("mkv: %s, YUY2 %dx%d%s\n", args->path, q->width, q->height,
+         w.have_audio ? ", PCM audio" : ", no audio");
+
+  int draining = 0;
+  while (!w.failed) {
+    if (!draining && (!*args->running || g_stop))
+      draining = 1; // take what is queued, then finish
+    unsigned seq = atomic_load(&q->bell.seq);
+    unsigned vrd = atomic_load_explicit(&q->video_rd, memory_order_relaxed);
+    unsigned ard = atomic_load_explicit(&q->audio_rd, memory_order_relaxed);
+    int have_v =
+        vrd != atomic_load_explicit(&q->video_wr, memory_order_acquire);
+    int have_a =
+        w.have_audio &&
+        ard != atomic_load_explicit(&q->audio_wr, memory_order_acquire);
+    if (!have_v && !have_a) {
+      if (draining)
+        break;
+      doorbell_wait(&q->bell, seq, MKV_IDLE_MS);
+      continue;
+    }
+
+    const mkv_packet_t *vp = &q->video_pkt[vrd % MKV_VIDEO_SLOTS];
+    const mkv_packet_t *ap = &q->audio_pkt[ard % MKV_AUDIO_SLOTS];
+    int take_video;
+    if (have_v && have_a) {
+      take_video = vp->capture_ns <= ap->capture_ns;
+    } else {
+      const mkv_packet_t *p = have_v ? vp : ap;
+      Uint64 held_ms = (mono_ns() - p->capture_ns) / 1000000ull;
+      if (!draining && w.have_audio && held_ms < MKV_INTERLEAVE_MS) {
+        doorbell_wait(&q->bell, seq, MKV_INTERLEAVE_MS - (int)held_ms);
+        continue;
+      }
+      take_video = have_v;
+    }
+
+    if (!w.base_ns)
+      w.base_ns = take_video ? vp->capture_ns : ap->capture_ns;
+    if (take_video) {
+      mkv_block(&w, 1, vp->capture_ns,
+                q->video_data + (vrd % MKV_VIDEO_SLOTS) * q->frame_bytes,
+                vp->bytes);
+      atomic_store_explicit(&q->video_rd, vrd + 1, memory_order_release);
+    } else {
+      mkv_block(&w, 2, ap->capture_ns, q->audio_data[ard % MKV_AUDIO_SLOTS],
+                ap->bytes);
+      atomic_store_explicit(&q->audio_rd, ard + 1, memory_order_release);
+    }
+  }
+
+  mkv_finish(&w);
+  printf("mkv: %lld frames, %lld audio blocks, %.1fs; dropped %lld frames, "
+         "%lld audio chunks\n",
+         w.video_frames, w.audio_blocks, w.last_ms / 1000.0,
+         atomic_load(&q->video_dropped), atomic_load(&q->audio_dropped));
+  close(w.fd);
+  free(w.out.p);
+  free(w.cues);
+  return w.failed ? 1 : 0;
+}
+
+// Replay save thread: writes the packets between the keep marks and the
+// ends taken when the key was pressed, in capture order, moving the keep
+// marks along so the producers get their slots back as it goes.
+static void *replay_save_thread(void *arg) {
+  replay_t *r = arg;
+  mkv_writer_t w;
+  memset(&w, 0, sizeof(w));
+  w.have_audio = atomic_load_explicit(&r->audio_ready, memory_order_acquire);
+  unsigned v = atomic_load(&r->video_keep), a = atomic_load(&r->audio_keep);
+
+  // Audio from before the first frame is left out.
+  if (v != r->video_end)
+    while (a != r->audio_end && r->audio_pkt[a % r->nchunks].capture_ns <
+                                    r->video_pkt[v % r->nframes].capture_ns)
+      atomic_store_explicit(&r->audio_keep, ++a, memory_order_release);
+
+  w.fd = open(r->path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (w.fd < 0) {
+    fprintf(stderr, "open(%s) failed: %s\n", r->path, strerror(errno));
+    atomic_store_explicit(&r->saving, 0, memory_order_release);
+    return NULL;
+  }
+  mkv_write_header(&w, r->width, r->height, r->format, r->channels, r->freq);
+  Uint64 t0 = mono_ns();
+  while (!w.failed &&
+         (v != r->video_end || (w.have_audio && a != r->audio_end))) {
+    const mkv_packet_t *vp = &r->video_pkt[v % r->nframes];
+    const mkv_packet_t *ap = &r->audio_pkt[a % r->nchunks];
+    int take_video = v != r->video_end &&
+                     (!w.have_audio || a == r->audio_end ||
+                      vp->capture_ns <= ap->capture_ns);
+    if (!w.base_ns)
+      w.base_ns = take_video ? vp->capture_ns : ap->capture_ns;
+    if (take_video) {
+      mkv_block(&w, 1, vp->capture_ns,
+                r->video_data + (v % r->nframes) * r->frame_bytes, vp->bytes);
+      atomic_store_explicit(&r->video_keep, ++v, memory_order_release);
+    } else {
+      mkv_block(&w, 2, ap->capture_ns, r->audio_data[a % r->nchunks],
+                ap->bytes);
+      atomic_store_explicit(&r->audio_keep, ++a, memory_order_release);
+    }
+  }
+  mkv_finish(&w);
+  close(w.fd);
+  printf("replay: saved %s, %lld frames, %.1fs, in %.0fms\n", r->path,
+         w.video_frames, w.last_ms / 1000.0, (mono_ns() - t0) / 1e6);
+  free(w.out.p);
+  free(w.cues);
+  atomic_store_explicit(&r->saving, 0, memory_order_release);
+  return NULL;
+}
+
+// The replay key: called on the video thread, between frames, so the video
+// end is exact. An audio chunk may be in the middle of being stored, so the
+// oldest one is given up.
+static void replay_save(replay_t *r) {
+  if (atomic_load_explicit(&r->saving, memory_order_acquire)) {
+    printf("replay: still saving %s\n", r->path);
+    return;
+  }
+  if (r->have_thread)
+    pthread_join(r->thread, NULL);
+  r->have_thread = 0;
+
+  unsigned vwr = atomic_load_explicit(&r->video_wr, memory_order_acquire);
+  unsigned awr = atomic_load_explicit(&r->audio_wr, memory_order_acquire);
+  if (vwr == 0) {
+    printf("replay: nothing captured yet\n");
+    return;
+  }
+  r->video_end = vwr;
+  r->audio_end = awr;
+  atomic_store(&r->video_keep, vwr > r->nframes ? vwr - r->nframes : 0);
+  atomic_store(&r->audio_keep,
+               awr + 1 > r->nchunks ? awr + 1 - r->nchunks : 0);
+  struct timespec now;
+  clock_gettime(CLOCK_REALTIME, &now);
+  struct tm tm;
+  localtime_r(&now.tv_sec, &tm);
+  char name[64];
+  strftime(name, sizeof(name), "replay-%Y%m%d-%H%M%S", &tm);
+  snprintf(r->path, sizeof(r->path), "%s/%s-%03ld.mkv", r->dir, name,
+           now.tv_nsec / 1000000);
+
+  atomic_store_explicit(&r->saving, 1, memory_order_release);
+  if (pthread_create(&r->thread, NULL, replay_save_thread, r) != 0) {
+    fprintf(stderr, "pthread_create(replay) failed\n");
+    atomic_store_explicit(&r->saving, 0, memory_order_release);
+    return;
+  }
+  r->have_thread = 1;
+}
+
+static void replay_free(replay_t *r) {
+  if (r->have_thread)
+    pthread_join(r->thread, NULL);
+  if (r->nframes || r->nchunks)
+    printf("replay: %lld frames and audio chunks skipped while saving\n",
+           atomic_load(&r->skipped));
+  free(r->video_data);
+  free(r->video_pkt);
+  free(r->audio_data);
+  free(r->audio_pkt);
+}
+
+// Screenshots. The key copies the frame on screen into a free slot and the
+// video thread goes on at once; a worker converts it to RGB and writes a
+// PPM. When every slot is still waiting the shot is skipped and counted
+// rather than waited for. Nothing is allocated until the first shot.
+typedef struct {
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  int quit;
+  int width, height;
+  size_t frame_bytes;
+  uint8_t *yuyv; // SHOT_SLOTS frames
+  uint8_t *rgb;  // the worker's
+  char path[SHOT_SLOTS][512];
+  int head, count; // slots queued for the worker
+  const char *dir;
+  long long saved, skipped;
+} screenshot_t;
+
+static int shot_write(const char *path, const uint8_t *rgb, int w, int h) {
+  int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) {
+    fprintf(stderr, "open(%s) failed: %s\n", path, strerror(errno));
+    return -1;
+  }
+  char head[64];
+  int n = snprintf(head, sizeof(head), "P6\n%d %d\n255\n", w, h);
+  struct iovec iov[2] = {{head, (size_t)n},
+                         {(void *)rgb, (size_t)w * (size_t)h * 3}};
+  ssize_t want = (ssize_t)(iov[0].iov_len + iov[1].iov_len);
+  ssize_t wrote = writev(fd, iov, 2);
+  if (wrote != want)
+    fprintf(stderr, "screenshot: write to %s failed: %s\n", path,
+            wrote < 0 ? strerror(errno) : "short write");
+  close(fd);
+  return wrote == want ? 0 : -1;
+}
+
+static void *shot_thread(void *arg) {
+  screenshot_t *s = arg;
+  pthread_mutex_lock(&s->lock);
+  for (;;) {
+    while (!s->count && !s->quit)
+      pthread_cond_wait(&s->cond, &s->lock);
+    if (!s->count)
+      break;
+    int slot = s->head;
+    pthread_mutex_unlock(&s->lock);
+
+    yuyv_to_rgb24(s->yuyv + (size_t)slot * s->frame_bytes, s->rgb, s->width,
+                  s->height);
+    int ok = shot_write(s->path[slot], s->rgb, s->width, s->height) == 0;
+    if (ok)
+      printf("screenshot: saved %s\n", s->path[slot]);
+
+    pthread_mutex_lock(&s->lock);
+    s->saved += ok;
+    s->head = (s->head + 1) % SHOT_SLOTS;
+    s->count--;
+  }
+  pthread_mutex_unlock(&s->lock);
+  return NULL;
+}
+
+static int shot_open(screenshot_t *s, const struct v4l2_format *fmt,
+                     const char *dir) {
+  memset(s, 0, sizeof(*s));
+  s->width = (int)fmt->fmt.pix.width;
+  s->height = (int)fmt->fmt.pix.height;
+  s->frame_bytes = (size_t)s->width * (size_t)s->height * 2;
+  s->dir = dir;
+  s->yuyv = malloc(SHOT_SLOTS * s->frame_bytes);
+  s->rgb = malloc((size_t)s->width * (size_t)s->height * 3);
+  if (!s->yuyv || !s->rgb) {
+    perror("malloc(screenshots)");
+    return -1;
+  }
+  pthread_mutex_init(&s->lock, NULL);
+  pthread_cond_init(&s->cond, NULL);
+  if (pthread_create(&s->thread, NULL, shot_thread, s) != 0) {
+    fprintf(stderr, "pthread_create(screenshot) failed\n");
+    pthread_mutex_destroy(&s->lock);
+    pthread_cond_destroy(&s->cond);
+    free(s->yuyv);
+    s->yuyv = NULL; // no thread for shot_close to stop
+    return -1;
+  }
+  return 0;
+}
+
+// Called on the video thread with the frame just presented.
+static void shot_take(screenshot_t *s, const uint8_t *yuyv) {
+  pthread_mutex_lock(&s->lock);
+  int slot = s->count < SHOT_SLOTS ? (s->head + s->count) % SHOT_SLOTS : -1;
+  if (slot < 0)
+    s->skipped++;
+  pthread_mutex_unlock(&s->lock);
+  if (slot < 0) {
+    printf("screenshot: %d still being written, skipped\n", SHOT_SLOTS);
+    return;
+  }
+
+  // The worker only touches queued slots, so this one is ours until queued.
+  memcpy(s->yuyv + (size_t)slot * s->frame_bytes, yuyv, s->frame_bytes);
+  struct timespec now;
+  clock_gettime(CLOCK_REALTIME, &now);
+  struct tm tm;
+  localtime_r(&now.tv_sec, &tm);
+  char name[64];
+  strftime(name, sizeof(name), "shot-%Y%m%d-%H%M%S", &tm);
+  snprintf(s->path[slot], sizeof(s->path[slot]), "%s/%s-%03ld.ppm", s->dir,
+           name, now.tv_nsec / 1000000);
+
+  pthread_mutex_lock(&s->lock);
+  s->count++;
+  pthread_cond_signal(&s->cond);
+  pthread_mutex_unlock(&s->lock);
+}
+
+// Writes out what is queued, then stops.
+static void shot_close(screenshot_t *s) {
+  if (s->yuyv && s->rgb) {
+    pthread_mutex_lock(&s->lock);
+    s->quit = 1;
+    pthread_cond_signal(&s->cond);
+    pthread_mutex_unlock(&s->lock);
+    pthread_join(s->thread, NULL);
+    pthread_mutex_destroy(&s->lock);
+    pthread_cond_destroy(&s->cond);
+    if (s->saved || s->skipped)
+      printf("screenshot: %lld saved, %lld skipped\n", s->saved, s->skipped);
+  }
+  free(s->yuyv);
+  free(s->rgb);
+  memset(s, 0, sizeof(*s));
+}
+
+// YUYV to planar 4:2:2 (Y, then U, then V), which is what Y4M's C422 means;
+// the format has no packed variant.
+static void yuyv_to_planar422(const uint8_t *yuyv, int stride, int w, int h,
+                              uint8_t *y, uint8_t *u, uint8_t *v) {
+  for (int row = 0; row < h; row++) {
+    const uint8_t *src = yuyv + (size_t)row * stride;
+    uint8_t *yd = y + (size_t)row * w;
+    uint8_t *ud = u + (size_t)row * (w / 2);
+    uint8_t *vd = v + (size_t)row * (w / 2);
+    int x = 0;
+#if defined(__SSE2__)
+    const __m128i lo = _mm_set1_epi16(0x00ff);
+    for (; x + 32 <= w; x += 32) {
+      const __m128i *p = (const __m128i *)(src + 2 * x);
+      __m128i a = _mm_loadu_si128(p), b = _mm_loadu_si128(p + 1);
+      __m128i c = _mm_loadu_si128(p + 2), d = _mm_loadu_si128(p + 3);
+      _mm_storeu_si128((__m128i *)(yd + x),
+                       _mm_packus_epi16(_mm_and_si128(a, lo),
+                                        _mm_and_si128(b, lo)));
+      _mm_storeu_si128((__m128i *)(yd + x + 16),
+                       _mm_packus_epi16(_mm_and_si128(c, lo),
+                                        _mm_and_si128(d, lo)));
+      __m128i uv0 =
+          _mm_packus_epi16(_mm_srli_epi16(a, 8), _mm_srli_epi16(b, 8));
+      __m128i uv1 =
+          _mm_packus_epi16(_mm_srli_epi16(c, 8), _mm_srli_epi16(d, 8));
+      _mm_storeu_si128((__m128i *)(ud + x / 2),
+                       _mm_packus_epi16(_mm_and_si128(uv0, lo),
+                                        _mm_and_si128(uv1, lo)));
+      _mm_storeu_si128((__m128i *)(vd + x / 2),
+                       _mm_packus_epi16(_mm_srli_epi16(uv0, 8),
+                                        _mm_srli_epi16(uv1, 8)));
+    }
+#endif
+    for (; x + 2 <= w; x += 2) {
+      yd[x] = src[2 * x];
+      ud[x / 2] = src[2 * x + 1];
+      yd[x + 1] = src[2 * x + 2];
+      vd[x / 2] = src[2 * x + 3];
+    }
+  }
+}
+
+// Y4M stream on a pipe. Each frame is deinterleaved once into one of a few
+// page-aligned buffers and then vmsplice()d, so the pipe references those
+// pages instead of copying them. There are enough buffers that one is only
+// reused after more than a pipe's worth of data has followed it, by which
+// time the reader has consumed it. Writes never block: while a frame is
+// still going out, newer frames are dropped and counted. Anything other
+// than a pipe gets plain write()s.
+typedef struct {
+  int fd;
+  int is_pipe;
+  int width, height, stride;
+  size_t frame_bytes; // "FRAME\n" + planes
+  uint8_t **bufs;
+  int nbufs;
+  int next;
+  const uint8_t *cur; // frame being sent, or NULL
+  size_t sent;
+  long long frames, dropped;
+  long long last_frames, last_dropped;
+  Uint64 last_ns;
+} y4m_out_t;
+
+static int y4m_open(y4m_out_t *o, int fd, const struct v4l2_format *fmt,
+                    const struct v4l2_fract *timeperframe) {
+  memset(o, 0, sizeof(*o));
+  o->fd = fd;
+  o->width = (int)fmt->fmt.pix.width;
+  o->height = (int)fmt->fmt.pix.height;
+  o->stride = fmt->fmt.pix.bytesperline ? (int)fmt->fmt.pix.bytesperline
+                                        : o->width * 2;
+  o->frame_bytes = 6 + (size_t)o->width * o->height * 2;
+
+  int pipe_bytes = fcntl(fd, F_SETPIPE_SZ, Y4M_PIPE_BYTES);
+  if (pipe_bytes < 0)
+    pipe_bytes = fcntl(fd, F_GETPIPE_SZ);
+  o->is_pipe = pipe_bytes > 0;
+  o->nbufs = o->is_pipe ? 2 + (int)((size_t)pipe_bytes / o->frame_bytes) : 1;
+  o->bufs = calloc((size_t)o->nbufs, sizeof(*o->bufs));
+  if (!o->bufs)
+    return -1;
+  for (int i = 0; i < o->nbufs; i++) {
+    if (posix_memalign((void **)&o->bufs[i], 4096, o->frame_bytes) != 0) {
+      o->bufs[i] = NULL;
+      return -1;
+    }
+    memcpy(o->bufs[i], "FRAME\n", 6);
+  }
+
+  unsigned num = timeperframe->numerator, den = timeperframe->denominator;
+  if (!num || !den) {
+    num = 1;
+    den = VIDEO_FPS_FALLBACK;
+  }
+  char hdr[128];
+  int n = snprintf(hdr, sizeof(hdr), "YUV4MPEG2 W%d H%d F%u:%u Ip A1:1 C422\n",
+                   o->width, o->height, den, num);
+  if (write(fd, hdr, (size_t)n) != n) {
+    fprintf(stderr, "stdout: header write failed: %s\n", strerror(errno));
+    return -1;
+  }
+  if (o->is_pipe)
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+  o->last_ns = mono_ns();
+  fprintf(stderr, "stdout: Y4M %dx%d 4:2:2, %s\n", o->width, o->height,
+          o->is_pipe ? "vmsplice" : "write");
+  return 0;
+}
+
+// Push as much of the current frame as the pipe takes. Returns -1 when the
+// reader has gone away.
+static int y4m_service(y4m_out_t *o) {
+  while (o->cur && o->sent < o->frame_bytes) {
+    struct iovec iov = {(void *)(o->cur + o->sent), o->frame_bytes - o->sent};
+    ssize_t n = o->is_pipe ? vmsplice(o->fd, &iov, 1, SPLICE_F_NONBLOCK)
+                           : write(o->fd, iov.iov_base, iov.iov_len);
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      if (errno == EAGAIN)
+        return 0;
+      fprintf(stderr, "stdout: %s, stream stopped\n", strerror(errno));
+      o->cur = NULL;
+      return -1;
+    }
+    o->sent += (size_t)n;
+  }
+  if (o->cur && o->sent == o->frame_bytes) {
+    o->cur = NULL;
+    o->frames++;
+  }
+  return 0;
+}
+
+static int y4m_frame(y4m_out_t *o, const uint8_t *yuyv) {
+  if (y4m_service(o) < 0)
+    return -1;
+  if (o->cur) {
+    o->dropped++; // the reader is behind
+    return 0;
+  }
+  uint8_t *buf = o->bufs[o->next];
+  o->next = (o->next + 1) % o->nbufs;
+  size_t plane = (size_t)o->width * o->height;
+  yuyv_to_planar422(yuyv, o->stride, o->width, o->height, buf + 6,
+                    buf + 6 + plane, buf + 6 + plane + plane / 2);
+  o->cur = buf;
+  o->sent = 0;
+  return y4m_service(o);
+}
+
+static void y4m_report(y4m_out_t *o, Uint64 now_ns) {
+  if (now_ns - o->last_ns < (Uint64)RECORD_REPORT_MS * 1000000ull)
+    return;
+  fprintf(stderr, "stdout: %lld frames, %lld dropped (slow reader)\n",
+          o->frames - o->last_frames, o->dropped - o->last_dropped);
+  o->last_ns = now_ns;
+  o->last_frames = o->frames;
+  o->last_dropped = o->dropped;
+}
+
+static void y4m_close(y4m_out_t *o) {
+  if (o->fd >= 0)
+    fprintf(stderr, "stdout: %lld frames sent, %lld dropped\n", o->frames,
+            o->dropped);
+  for (int i = 0; o->bufs && i < o->nbufs; i++)
+    free(o->bufs[i]);
+  free(o->bufs);
+  memset(o, 0, sizeof(*o));
+  o->fd = -1;
+}
+
+// Window, renderer, texture and RGB buffer for frames of args->fmt.
+static int video_output_open(const proc_video_args_t *args) {
+  *args->win = SDL_CreateWindow(args->dev, args->fmt->fmt.pix.width,
+                                args->fmt->fmt.pix.height, 0);
+  if (!*args->win) {
+    fprintf(stderr, "SDL_CreateWindow failed: %s\n", SDL_GetError());
+    return -1;
+  }
+  SDL_SetWindowResizable(*args->win, 1);
+
+  *args->ren = SDL_CreateRenderer(*args->win, NULL);
+  if (!*args->ren) {
+    fprintf(stderr, "SDL_CreateRenderer failed: %s\n", SDL_GetError());
+    return -1;
+  }
+
+  *args->tex = SDL_CreateTexture(
+      *args->ren, SDL_PIXELFORMAT_RGB24, SDL_TEXTUREACCESS_STREAMING,
+      args->fmt->fmt.pix.width, args->fmt->fmt.pix.height);
+  if (!*args->tex) {
+    fprintf(stderr, "SDL_CreateTexture failed: %s\n", SDL_GetError());
+    return -1;
+  }
+  SDL_SetTextureScaleMode(*args->tex, SDL_SCALEMODE_NEAREST);
+
+  *args->rgb_size =
+      (size_t)args->fmt->fmt.pix.width * (size_t)args->fmt->fmt.pix.height * 3;
+  *args->rgb = malloc(*args->rgb_size);
+  if (!*args->rgb) {
+    perror("malloc(rgb)");
+    return -1;
+  }
+  return 0;
+}
+
+// Convert, upload and present one captured YUYV frame, with the overlays
+// selected in the OVERLAY_* mask on top.
+static void present_frame(const proc_video_args_t *args, const uint8_t *yuyv,
+                          int overlays) {
+  // Convert + draw
+  yuyv_to_rgb24(yuyv, *args->rgb, args->fmt->fmt.pix.width,
+                args->fmt->fmt.pix.height);
+
+  // Upload frame
+  SDL_UpdateTexture(*args->tex, NULL, *args->rgb, args->fmt->fmt.pix.width * 3);
+
+  // Integer scaling: render into a centered integer-multiple rect
+  int out_w = 0, out_h = 0;
+  SDL_GetRenderOutputSize(*args->ren, &out_w, &out_h);
+
+  SDL_FRect dst = integer_fit_rect(args->fmt->fmt.pix.width,
+                                   args->fmt->fmt.pix.height, out_w, out_h);
+
+  SDL_RenderClear(*args->ren);
+  SDL_RenderTexture(*args->ren, *args->tex, NULL, &dst);
+  if (overlays & OVERLAY_METER)
+    draw_meter(*args->ren, args->meter, out_h);
+  if (overlays & OVERLAY_SPECTRUM)
+    draw_spectrum(*args->ren, args->spectrum, out_w, out_h);
+  SDL_RenderPresent(*args->ren);
+}
+
+int proc_video(const proc_video_args_t *args) {
+  uint32_t i;
+
+  memset(args->fmt, 0, sizeof(*args->fmt));
+  args->fmt->type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+  args->fmt->fmt.pix.width = args->width;
+  args->fmt->fmt.pix.height = args->height;
+  args->fmt->fmt.pix.pixelformat = V4L2_PIX_FMT_YUYV;
+  args->fmt->fmt.pix.field = V4L2_FIELD_NONE;
+
+  if (xioctl(args->fd, VIDIOC_S_FMT, args->fmt) < 0) {
+    fprintf(stderr, "VIDIOC_S_FMT failed: %s\n", strerror(errno));
+    return 1;
+  }
+
+  memset(args->req, 0, sizeof(*args->req));
+  args->req->count = VIDEO_BUFFERS;
+  args->req->type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+  args->req->memory = V4L2_MEMORY_MMAP;
+
+  if (xioctl(args->fd, VIDIOC_REQBUFS, args->req) < 0 || args->req->count < 2) {
+    fprintf(stderr, "VIDIOC_REQBUFS failed: %s\n", strerror(errno));
+    return 1;
+  }
+
+  *args->buffers = calloc(args->req->count, sizeof(buffer_t));
+  if (!*args->buffers) {
+    perror("calloc(buffers)");
+    return 1;
+  }
+
+  for (i = 0; i < args->req->count; i++) {
+    memset(args->buf, 0, sizeof(*args->buf));
+    args->buf->type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    args->buf->memory = V4L2_MEMORY_MMAP;
+    args->buf->index = i;
+
+    if (xioctl(args->fd, VIDIOC_QUERYBUF, args->buf) < 0) {
+      fprintf(stderr, "VIDIOC_QUERYBUF failed: %s\n", strerror(errno));
+      return 1;
+    }
+
+    (*args->buffers)[i].length = args->buf->length;
+    (*args->buffers)[i].start =
+        mmap(NULL, args->buf->length, PROT_READ | PROT_WRITE, MAP_SHARED,
+             args->fd, args->buf->m.offset);
+    if ((*args->buffers)[i].start == MAP_FAILED) {
+      fprintf(stderr, "mmap failed: %s\n", strerror(errno));
+      return 1;
+    }
+  }
+
+  for (i = 0; i < args->req->count; i++) {
+    memset(args->buf, 0, sizeof(*args->buf));
+    args->buf->type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    args->buf->memory = V4L2_MEMORY_MMAP;
+    args->buf->index = i;
+
+    if (xioctl(args->fd, VIDIOC_QBUF, args->buf) < 0) {
+      fprintf(stderr, "VIDIOC_QBUF failed: %s\n", strerror(errno));
+      return 1;
+    }
+  }
+
+  *args->type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+  if (xioctl(args->fd, VIDIOC_STREAMON, args->type) < 0) {
+    fprintf(stderr, "VIDIOC_STREAMON failed: %s\n", strerror(errno));
+    return 1;
+  }
+
+  if (video_output_open(args) < 0)
+    return 1;
+
+  // Size the delay ring for the maximum delay at the negotiated frame rate.
+  int fps = VIDEO_FPS_FALLBACK;
+  struct v4l2_streamparm parm;
+  memset(&parm, 0, sizeof(parm));
+  parm.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+  if (xioctl(args->fd, VIDIOC_G_PARM, &parm) == 0 &&
+      parm.parm.capture.timeperframe.numerator > 0) {
+    fps = (int)((parm.parm.capture.timeperframe.denominator +
+                 parm.parm.capture.timeperframe.numerator - 1) /
+                parm.parm.capture.timeperframe.numerator);
+  }
+
+  video_delay_t ring;
+  int slots = (int)((Sint64)args->sync->max_delay_us * fps / 1000000) + 2;
+  size_t slot_size = args->fmt->fmt.pix.sizeimage
+                         ? args->fmt->fmt.pix.sizeimage
+                         : (size_t)args->fmt->fmt.pix.bytesperline *
+                               args->fmt->fmt.pix.height;
+  if (video_delay_init(&ring, slots, slot_size) < 0) {
+    perror("malloc(video delay ring)");
+    return 1;
+  }
+  printf("video delay ring: %d frames x %zu bytes (%.1f MiB)\n", slots,
+         slot_size, (double)slots * slot_size / (1024.0 * 1024.0));
+
+  if (args->mkv &&
+      mkv_video_setup(args->mkv, (int)args->fmt->fmt.pix.width,
+                      (int)args->fmt->fmt.pix.height, slot_size) < 0) {
+    perror("malloc(mkv queue)");
+    video_delay_free(&ring);
+    return 1;
+  }
+  if (args->replay &&
+      replay_video_setup(args->replay, (int)args->fmt->fmt.pix.width,
+                         (int)args->fmt->fmt.pix.height, slot_size, fps) < 0) {
+    video_delay_free(&ring);
+    return 1;
+  }
+
+  y4m_out_t y4m;
+  memset(&y4m, 0, sizeof(y4m));
+  y4m.fd = -1;
+  if (args->stdout_fd >= 0 &&
+      y4m_open(&y4m, args->stdout_fd, args->fmt,
+               &parm.parm.capture.timeperframe) < 0) {
+    y4m.fd = -1; // nothing was sent, no summary
+    y4m_close(&y4m);
+    video_delay_free(&ring);
+    return 1;
+  }
+
+  recorder_t rec;
+  memset(&rec, 0, sizeof(rec));
+  rec.fd = -1;
+  if (args->record_path &&
+      (args->record_segment_s
+           ? recorder_open_segments(&rec, args->record_path, args->fmt, fps,
+                                    args->record_segment_s,
+                                    args->record_quota)
+           : recorder_open(&rec, args->record_path, args->fmt, fps, 0)) < 0) {
+    recorder_close(&rec);
+    y4m_close(&y4m);
+    video_delay_free(&ring);
+    return 1;
+  }
+
+  packer_t pack;
+  memset(&pack, 0, sizeof(pack));
+  pack.fd = -1;
+  if (args->lossless_path &&
+      packer_open(&pack, args->lossless_path, args->fmt, fps,
+                  args->lossless_threads) < 0) {
+    packer_close(&pack);
+    recorder_close(&rec);
+    y4m_close(&y4m);
+    video_delay_free(&ring);
+    return 1;
+  }
+
+  timeshift_t ts;
+  memset(&ts, 0, sizeof(ts));
+  ts.rec.fd = -1;
+  if (args->timeshift_path &&
+      timeshift_open(&ts, args->timeshift_path, args->timeshift_bytes,
+                     args->fmt, fps) < 0) {
+    timeshift_close(&ts);
+    packer_close(&pack);
+    recorder_close(&rec);
+    y4m_close(&y4m);
+    video_delay_free(&ring);
+    return 1;
+  }
+
+  screenshot_t shot; // started on the first S press
+  memset(&shot, 0, sizeof(shot));
+  int shots = 0; // key presses not yet served, one frame each
+
+  double latency_us = 0.0;
+  Uint64 last_title_ns = 0;
+  int overlays = 0;
+
+  while (*args->running && !g_stop) {
+    while (SDL_PollEvent(args->e)) {
+      if (args->e->type == SDL_EVENT_QUIT)
+        *args->running = 0;
+      if (args->e->type == SDL_EVENT_KEY_DOWN &&
+          args->e->key.key == SDLK_ESCAPE)
+        *args->running = 0;
+      if (args->e->type == SDL_EVENT_KEY_DOWN &&
+          args->e->key.key == SDLK_M)
+        overlays ^= OVERLAY_METER;
+      if (args->e->type == SDL_EVENT_KEY_DOWN &&
+          args->e->key.key == SDLK_F) {
+        overlays ^= OVERLAY_SPECTRUM;
+        atomic_store(&args->spectrum->enabled,
+                     !!(overlays & OVERLAY_SPECTRUM));
+      }
+      if (args->e->type == SDL_EVENT_KEY_DOWN &&
+          args->e->key.key == SDLK_R && args->replay)
+        replay_save(args->replay);
+      if (args->e->type == SDL_EVENT_KEY_DOWN &&
+          args->e->key.key == SDLK_S)
+        shots++;
+      if (args->e->type == SDL_EVENT_KEY_DOWN && ts.rec.fd >= 0)
+        timeshift_key(&ts, args->e->key.key);
+      if (args->e->type == SDL_EVENT_KEY_DOWN)
+        av_sync_key(args->sync, args->e->key.key);
+    }
+
+    Uint64 delay_ns =
+        (Uint64)av_total_delay_us(args->sync, &args->sync->video_delay_us,
+                                  &args->sync->video_user_us) *
+        1000;
+
+    FD_ZERO(args->fds);
+    FD_SET(args->fd, args->fds);
+    args->tv->tv_sec = 2;
+    args->tv->tv_usec = 0;
+    if (ring.count > 0) {
+      // Wake up no later than when the oldest delayed frame falls due.
+      Uint64 due = ring.capture_ns[ring.head] + delay_ns;
+      Uint64 now = mono_ns();
+      Uint64 wait = due > now ? due - now : 0;
+      args->tv->tv_sec = (time_t)(wait / 1000000000ull);
+      args->tv->tv_usec = (suseconds_t)(wait % 1000000000ull / 1000);
+    }
+
+    // A frame still going out to a slow Y4M reader wakes us when the pipe
+    // has room again.
+    fd_set wfds;
+    FD_ZERO(&wfds);
+    int nfds = args->fd + 1;
+    if (y4m.cur) {
+      FD_SET(y4m.fd, &wfds);
+      if (y4m.fd >= nfds)
+        nfds = y4m.fd + 1;
+    }
+    *args->r = select(nfds, args->fds, &wfds, NULL, args->tv);
+    if (*args->r < 0) {
+      if (errno == EINTR)
+        continue;
+      fprintf(stderr, "select failed: %s\n", strerror(errno));
+      break;
+    }
+
+    const uint8_t *show = NULL;
+    Uint64 show_capture_ns = 0;
+    int direct = -1; // V4L2 buffer shown in place, requeued after present
+
+    if (*args->r > 0) {
+      memset(args->buf, 0, sizeof(*args->buf));
+      args->buf->type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+      args->buf->memory = V4L2_MEMORY_MMAP;
+
+      if (xioctl(args->fd, VIDIOC_DQBUF, args->buf) < 0) {
+        if (errno != EAGAIN) {
+          fprintf(stderr, "VIDIOC_DQBUF failed: %s\n", strerror(errno));
+          break;
+        }
+      } else {
+        const buffer_t *b = &(*args->buffers)[args->buf->index];
+        Uint64 capture_ns = v4l2_capture_ns(args->buf);
+        if (y4m.fd >= 0 && y4m_frame(&y4m, b->start) < 0)
+          y4m_close(&y4m);
+        if (rec.fd >= 0)
+          recorder_frame(&rec, b->start,
+                         args->buf->bytesused ? args->buf->bytesused
+                                              : b->length,
+                         args->buf->sequence, capture_ns);
+        if (pack.fd >= 0)
+          packer_frame(&pack, b->start, args->buf->sequence, capture_ns);
+        if (ts.rec.fd >= 0) {
+          recorder_frame(&ts.rec, b->start,
+                         args->buf->bytesused ? args->buf->bytesused
+                                              : b->length,
+                         args->buf->sequence, capture_ns);
+          ts.live_ns = capture_ns;
+        }
+        if (args->mkv)
+          mkv_push_video(args->mkv, b->start,
+                         args->buf->bytesused ? args->buf->bytesused
+                                              : b->length,
+                         capture_ns);
+        if (args->replay)
+          replay_push_video(args->replay, b->start,
+                            args->buf->bytesused ? args->buf->bytesused
+                                                 : b->length,
+                            capture_ns);
+        if (delay_ns == 0 && ring.count == 0) {
+          // No delay: skip the copy and show straight from the mmap buffer.
+          direct = (int)args->buf->index;
+          show = (const uint8_t *)b->start;
+          show_capture_ns = capture_ns;
+        } else {
+          // Copy out and hand the buffer straight back to the driver.
+          size_t used = args->buf->bytesused ? args->buf->bytesused : b->length;
+          video_delay_push(&ring, b->start, used, capture_ns);
+          if (requeue_buffer(args->fd, args->buf->index) < 0)
+            break;
+        }
+      }
+    }
+
+    // Show the newest delayed frame that is due; older due ones are dropped.
+    // The popped slot is not overwritten before the next dequeue.
+    Uint64 now_ns = mono_ns();
+    if (rec.fd >= 0) {
+      recorder_reap(&rec, 0);
+      recorder_report(&rec, now_ns);
+    }
+    if (pack.fd >= 0)
+      packer_report(&pack, now_ns);
+    if (ts.rec.fd >= 0)
+      recorder_reap(&ts.rec, 0);
+    if (y4m.fd >= 0) {
+      if (y4m_service(&y4m) < 0)
+        y4m_close(&y4m);
+      else
+        y4m_report(&y4m, now_ns);
+    }
+    while (ring.count > 0 && ring.capture_ns[ring.head] + delay_ns <= now_ns) {
+      show = video_delay_head(&ring);
+      show_capture_ns = ring.capture_ns[ring.head];
+      video_delay_pop(&ring);
+    }
+    int shifted = ts.state != TIMESHIFT_LIVE;
+    if (shifted) {
+      // Capture and recording go on; the screen shows the ring.
+      if (direct >= 0 && requeue_buffer(args->fd, (uint32_t)direct) < 0)
+        break;
+      direct = -1;
+      show = timeshift_frame(&ts, now_ns, &show_capture_ns);
+      shifted = ts.state != TIMESHIFT_LIVE;
+    }
+    if (!show)
+      continue;
+
+    present_frame(args, show, overlays);
+    if (shots > 0 && !shot.yuyv &&
+        shot_open(&shot, args->fmt, args->shot_dir) < 0) {
+      shot_close(&shot);
+      shots = 0;
+    }
+    if (shots > 0) {
+      shot_take(&shot, show);
+      shots--;
+    }
+
+    Uint64 presented_ns = mono_ns();
+    if (!shifted) {
+      double lat = (double)(presented_ns - show_capture_ns) / 1000.0;
+      latency_us =
+          latency_us > 0.0 ? latency_us + 0.1 * (lat - latency_us) : lat;
+      atomic_store(&args->sync->video_latency_us, (int)latency_us);
+    }
+
+    if (presented_ns - last_title_ns >= 1000000000ull) {
+      last_title_ns = presented_ns;
+      struct timespec cpu;
+      clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpu);
+      atomic_store(&args->stats->video_cpu_ns,
+                   (long long)cpu.tv_sec * 1000000000ll + cpu.tv_nsec);
+
+      char title[256];
+      int n = snprintf(title, sizeof(title), "%s  A/V %+.1fms", args->dev,
+                       atomic_load(&args->sync->offset_us) / 1000.0);
+      if (shifted)
+        snprintf(title + n, sizeof(title) - (size_t)n, "  %s -%.1fs %d.%dx",
+                 ts.state == TIMESHIFT_PAUSED ? "PAUSED" : "TIMESHIFT",
+                 (ts.live_ns - ts.pos_ns) / 1e9, ts.speed_pct / 100,
+                 ts.speed_pct % 100 / 10);
+      SDL_SetWindowTitle(*args->win, title);
+    }
+
+    if (direct >= 0 && requeue_buffer(args->fd, (uint32_t)direct) < 0)
+      break;
+  }
+
+  recorder_close(&rec);
+  packer_close(&pack);
+  timeshift_close(&ts);
+  shot_close(&shot);
+  y4m_close(&y4m);
+  video_delay_free(&ring);
+
+  // ensure other thread exits too
+  *args->running = 0;
+  return 0;
+}
+
+// Playback of --record and --record-lossless files. The file is mapped and
+// read ahead with MADV_WILLNEED; every frame's place comes from an index
+// (computed for raw files, read from the end of packed ones, or rebuilt by
+// walking the frame headers when a packed file was never closed), so a
+// seek is a lookup. Raw frames are presented straight from the mapping.
+// Packed frames are decoded ahead by a few threads into PLAY_SLOTS buffers;
+// the display swaps a finished buffer for its own, so nothing it shows is
+// ever written underneath it.
+enum { PLAY_EMPTY, PLAY_DECODING, PLAY_READY };
+
+typedef struct {
+  int state;
+  uint64_t frame;
+  uint8_t *yuyv;
+} play_slot_t;
+
+typedef struct {
+  const uint8_t *map;
+  size_t map_bytes;
+  unsigned char *resident; // mincore() result for one raw slot
+  size_t page;
+  record_file_header_t h;
+  int packed;
+  uint64_t frames;
+  record_index_t *index; // packed only
+
+  // decoding, under lock
+  play_slot_t slots[PLAY_SLOTS];
+  uint8_t *shown; // the display's own buffer
+  uint64_t target; // decoders work from here on
+  int quit;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  pthread_t threads[PLAY_MAX_DECODERS];
+  int nthreads;
+} play_t;
+
+static int play_index_cmp(const void *a, const void *b) {
+  const record_index_t *x = a, *y = b;
+  return x->capture_ns < y->capture_ns ? -1 : x->capture_ns > y->capture_ns;
+}
+
+static int play_open(play_t *p, const char *path) {
+  memset(p, 0, sizeof(*p));
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    fprintf(stderr, "open(%s) failed: %s\n", path, strerror(errno));
+    return -1;
+  }
+  struct stat st;
+  if (fstat(fd, &st) < 0 || pread(fd, &p->h, sizeof(p->h), 0) != sizeof(p->h)) {
+    fprintf(stderr, "%s: cannot read the header\n", path);
+    close(fd);
+    return -1;
+  }
+  p->packed = memcmp(p->h.magic, "YUYVPAK1", 8) == 0;
+  if ((!p->packed && memcmp(p->h.magic, "YUYVRAW1", 8) != 0) ||
+      p->h.width < 2 || !p->h.height || p->h.header_bytes < sizeof(p->h) ||
+      (!p->packed && !p->h.slot_bytes)) {
+    fprintf(stderr, "%s: not a --record or --record-lossless file\n", path);
+    close(fd);
+    return -1;
+  }
+  p->map_bytes = (size_t)st.st_size;
+  p->map = mmap(NULL, p->map_bytes, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (p->map == MAP_FAILED) {
+    p->map = NULL;
+    perror("mmap");
+    return -1;
+  }
+
+  if (!p->packed) {
+    p->frames = (p->map_bytes - p->h.header_bytes) / p->h.slot_bytes;
+    if (p->h.frames && p->h.frames < p->frames)
+      p->frames = p->h.frames;
+    p->page = (size_t)sysconf(_SC_PAGESIZE);
+    p->resident = malloc(p->h.slot_bytes / p->page + 2);
+    return p->frames && p->resident ? 0 : -1;
+  }
+
+  size_t ix_bytes = (size_t)p->h.frames * sizeof(record_index_t);
+  if (p->h.index_offset && p->h.index_offset + ix_bytes <= p->map_bytes) {
+    p->frames = p->h.frames;
+    p->index = malloc(ix_bytes + 1);
+    if (!p->index)
+      return -1;
+    memcpy(p->index, p->map + p->h.index_offset, ix_bytes);
+  } else {
+    // Not closed: walk the frames, which the workers wrote out of order.
+    printf("play: %s has no index, scanning it\n", path);
+    size_t cap = 0;
+    for (uint64_t off = p->h.header_bytes;
+         off + sizeof(record_frame_header_t) <= p->map_bytes;) {
+      record_frame_header_t fh;
+      memcpy(&fh, p->map + off, sizeof(fh));
+      uint64_t end = off + sizeof(fh) + fh.bytes;
+      if (fh.magic != 0x5a4d5246u || end > p->map_bytes)
+        break;
+      if (p->frames == cap) {
+        cap = cap ? 2 * cap : 1024;
+        record_index_t *ix = realloc(p->index, cap * sizeof(*ix));
+        if (!ix)
+          return -1;
+        p->index = ix;
+      }
+      record_index_t *ix = &p->index[p->frames++];
+      ix->offset = off;
+      ix->bytes = fh.bytes;
+      ix->crc = fh.crc;
+      ix->sequence = fh.sequence;
+      ix->capture_ns = fh.capture_ns;
+      off = end;
+    }
+    qsort(p->index, p->frames, sizeof(*p->index), play_index_cmp);
+  }
+  return p->frames ? 0 : -1;
+}
+
+static Uint64 play_capture_ns(const play_t *p, uint64_t n) {
+  if (p->packed)
+    return p->index[n].capture_ns;
+  record_frame_header_t fh;
+  memcpy(&fh, p->map + p->h.header_bytes + n * p->h.slot_bytes, sizeof(fh));
+  return fh.capture_ns;
+}
+
+// The bytes of frame n in the file, header included.
+static void play_span(const play_t *p, uint64_t n, uint64_t *off,
+                      size_t *len) {
+  if (p->packed) {
+    *off = p->index[n].offset;
+    *len = sizeof(record_frame_header_t) + p->index[n].bytes;
+  } else {
+    *off = p->h.header_bytes + n * p->h.slot_bytes;
+    *len = p->h.slot_bytes;
+  }
+}
+
+static void play_readahead(const play_t *p, uint64_t n) {
+  uint64_t off;
+  size_t len;
+  play_span(p, n, &off, &len);
+  uint64_t start = off & ~(uint64_t)(sysconf(_SC_PAGESIZE) - 1);
+  madvise((void *)(p->map + start), len + (size_t)(off - start),
+          MADV_WILLNEED);
+}
+
+static void *play_decoder(void *arg) {
+  play_t *p = arg;
+  pthread_mutex_lock(&p->lock);
+  while (!p->quit) {
+    // The first frame from the target on that nobody has (or is) decoded.
+    play_slot_t *slot = NULL;
+    uint64_t n = p->target;
+    for (; n < p->target + PLAY_SLOTS && n < p->frames; n++) {
+      play_slot_t *s = &p->slots[n % PLAY_SLOTS];
+      if (s->state == PLAY_DECODING)
+        continue;
+      if (s->state == PLAY_READY && s->frame == n)
+        continue;
+      slot = s;
+      break;
+    }
+    if (!slot) {
+      pthread_cond_wait(&p->cond, &p->lock);
+      continue;
+    }
+    slot->state = PLAY_DECODING;
+    slot->frame = n;
+    pthread_mutex_unlock(&p->lock);
+
+    const record_index_t *ix = &p->index[n];
+    int bad = yuyv_unpack(p->map + ix->offset + sizeof(record_frame_header_t),
+                          ix->bytes, (int)p->h.width, (int)p->h.height,
+                          slot->yuyv) < 0;
+
+    pthread_mutex_lock(&p->lock);
+    if (bad) {
+      fprintf(stderr, "play: frame %llu is damaged\n", (unsigned long long)n);
+      memset(slot->yuyv, 0x80, p->h.frame_bytes);
+    }
+    slot->state = PLAY_READY;
+    pthread_cond_broadcast(&p->cond);
+  }
+  pthread_mutex_unlock(&p->lock);
+  return NULL;
+}
+
+static int play_decoders_start(play_t *p) {
+  pthread_mutex_init(&p->lock, NULL);
+  pthread_cond_init(&p->cond, NULL);
+  for (int i = 0; i < PLAY_SLOTS; i++)
+    if (!(p->slots[i].yuyv = malloc(p->h.frame_bytes)))
+      return -1;
+  if (!(p->shown = malloc(p->h.frame_bytes)))
+    return -1;
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  int want = cpus > 2 ? (int)cpus - 1 : 1;
+  if (want > PLAY_MAX_DECODERS)
+    want = PLAY_MAX_DECODERS;
+  for (; p->nthreads < want; p->nthreads++)
+    if (pthread_create(&p->threads[p->nthreads], NULL, play_decoder, p) != 0)
+      break;
+  return p->nthreads ? 0 : -1;
+}
+
+static void play_set_target(play_t *p, uint64_t n) {
+  pthread_mutex_lock(&p->lock);
+  p->target = n;
+  pthread_cond_broadcast(&p->cond);
+  pthread_mutex_unlock(&p->lock);
+}
+
+// Frame n if it is ready, without waiting. Packed frames are taken over by
+// the display; raw ones come straight from the mapping once they are in
+// memory.
+static const uint8_t *play_take(play_t *p, uint64_t n) {
+  if (!p->packed) {
+    const uint8_t *slot = p->map + p->h.header_bytes + n * p->h.slot_bytes;
+    size_t pages = (p->h.slot_bytes + p->page - 1) / p->page;
+    if (mincore((void *)slot, p->h.slot_bytes, p->resident) == 0)
+      for (size_t i = 0; i < pages; i++)
+        if (!(p->resident[i] & 1)) {
+          play_readahead(p, n);
+          return NULL;
+        }
+    return slot + RECORD_FRAME_HEADER;
+  }
+  const uint8_t *got = NULL;
+  pthread_mutex_lock(&p->lock);
+  play_slot_t *s = &p->slots[n % PLAY_SLOTS];
+  if (s->state == PLAY_READY && s->frame == n) {
+    uint8_t *t = s->yuyv;
+    s->yuyv = p->shown;
+    p->shown = t;
+    s->state = PLAY_EMPTY;
+    got = p->shown;
+    pthread_cond_broadcast(&p->cond);
+  }
+  pthread_mutex_unlock(&p->lock);
+  return got;
+}
+
+static void play_close(play_t *p) {
+  if (p->nthreads) {
+    pthread_mutex_lock(&p->lock);
+    p->quit = 1;
+    pthread_cond_broadcast(&p->cond);
+    pthread_mutex_unlock(&p->lock);
+    for (int i = 0; i < p->nthreads; i++)
+      pthread_join(p->threads[i], NULL);
+  }
+  if (p->packed && p->shown) {
+    pthread_mutex_destroy(&p->lock);
+    pthread_cond_destroy(&p->cond);
+  }
+  for (int i = 0; i < PLAY_SLOTS; i++)
+    free(p->slots[i].yuyv);
+  free(p->shown);
+  free(p->index);
+  free(p->resident);
+  if (p->map)
+    munmap((void *)p->map, p->map_bytes);
+  memset(p, 0, sizeof(*p));
+}
+
+// --play: show a recording through the live view's output stages, paced by
+// the capture timestamps. Space pauses, Left/Right seek PLAY_SEEK_S, Home
+// goes back to the start. A frame that is not decoded or read in time is
+// skipped rather than waited for.
+static int proc_play(const proc_video_args_t *args, const char *path) {
+  play_t p;
+  if (play_open(&p, path) < 0) {
+    play_close(&p);
+    return 1;
+  }
+  memset(args->fmt, 0, sizeof(*args->fmt));
+  args->fmt->fmt.pix.width = p.h.width;
+  args->fmt->fmt.pix.height = p.h.height;
+  args->fmt->fmt.pix.bytesperline =
+      p.packed ? p.h.width * 2 : p.h.bytesperline;
+  args->fmt->fmt.pix.sizeimage = p.h.frame_bytes;
+  if (p.packed && play_decoders_start(&p) < 0) {
+    fprintf(stderr, "play: cannot start the decoders\n");
+    play_close(&p);
+    return 1;
+  }
+  if (video_output_open(args) < 0) {
+    play_close(&p);
+    return 1;
+  }
+  madvise((void *)p.map, p.map_bytes, MADV_SEQUENTIAL);
+  Uint64 first_ns = play_capture_ns(&p, 0);
+  Uint64 span_ns = play_capture_ns(&p, p.frames - 1) - first_ns;
+  printf("play: %s, %s %ux%u, %llu frames, %.1fs\n", path,
+         p.packed ? "lossless" : "raw", p.h.width, p.h.height,
+         (unsigned long long)p.frames, span_ns / 1e9);
+
+  int fps = p.h.fps ? (int)p.h.fps : VIDEO_FPS_FALLBACK;
+  uint64_t pos = 0, ahead = 0;
+  int have_frame = 0, paused = 0, overlays = 0, ended = 0;
+  Uint64 base_wall = mono_ns(), base_cap = first_ns;
+  long long shown = 0, skipped = 0, last_shown = 0, last_skipped = 0;
+  Uint64 last_report = base_wall, last_title = 0, last_present = 0;
+  const uint8_t *frame = NULL;
+
+  while (*args->running && !g_stop) {
+    int seeking = 0;
+    int64_t seek = 0;
+    while (SDL_PollEvent(args->e)) {
+      if (args->e->type == SDL_EVENT_QUIT)
+        *args->running = 0;
+      if (args->e->type != SDL_EVENT_KEY_DOWN)
+        continue;
+      switch (args->e->key.key) {
+      case SDLK_ESCAPE:
+        *args->running = 0;
+        break;
+      case SDLK_SPACE:
+        paused = !paused;
+        seeking = 1; // restart the clock here
+        seek = (int64_t)pos;
+        break;
+      case SDLK_LEFT:
+        seeking = 1;
+        seek = (int64_t)pos - PLAY_SEEK_S * fps;
+        break;
+      case SDLK_RIGHT:
+        seeking = 1;
+        seek = (int64_t)pos + PLAY_SEEK_S * fps;
+        break;
+      case SDLK_HOME:
+        seeking = 1;
+        seek = 0;
+        break;
+      case SDLK_M:
+        overlays ^= OVERLAY_METER;
+        break;
+      case SDLK_F:
+        overlays ^= OVERLAY_SPECTRUM;
+        atomic_store(&args->spectrum->enabled,
+                     !!(overlays & OVERLAY_SPECTRUM));
+        break;
+      }
+    }
+
+    Uint64 now = mono_ns();
+    uint64_t want = pos;
+    if (seeking) {
+      if (seek < 0)
+        seek = 0;
+      want = (uint64_t)seek < p.frames ? (uint64_t)seek : p.frames - 1;
+      base_wall = now;
+      base_cap = play_capture_ns(&p, want);
+      have_frame = 0;
+      ended = 0;
+    } else if (!paused && have_frame) {
+      // The newest frame that is due by the capture clock.
+      Uint64 due = base_cap + (now - base_wall);
+      while (want + 1 < p.frames && play_capture_ns(&p, want + 1) <= due)
+        want++;
+      if (want + 1 == p.frames && !ended &&
+          play_capture_ns(&p, want) <= due) {
+        ended = 1;
+        printf("play: end\n");
+      }
+    }
+    if (p.packed)
+      play_set_target(&p, want == pos && have_frame ? pos + 1 : want);
+
+    if (ahead < want)
+      ahead = want;
+    while (ahead < want + PLAY_READAHEAD && ahead < p.frames)
+      play_readahead(&p, ahead++);
+
+    int fresh = 0;
+    if (want != pos || !have_frame) {
+      const uint8_t *f = play_take(&p, want);
+      if (f) {
+        skipped += have_frame && want > pos ? (long long)(want - pos - 1) : 0;
+        pos = want;
+        frame = f;
+        have_frame = fresh = 1;
+        shown++;
+      }
+    }
+
+    // Overlays keep moving while the picture stands still.
+    if (frame && (fresh || (overlays && now - last_present >= 16000000ull))) {
+      present_frame(args, frame, overlays);
+      last_present = now;
+    } else if (want != pos || !have_frame) {
+      SDL_Delay(PLAY_IDLE_MS);
+    } else {
+      // Nothing to show until the next frame falls due, the overlays or
+      // the title need a refresh, or an event arrives: sleep in the event
+      // queue until the earliest of those.
+      Uint64 wake = last_title + (Uint64)PLAY_TITLE_MS * 1000000ull;
+      if (overlays && last_present + 16000000ull < wake)
+        wake = last_present + 16000000ull;
+      if (!paused && pos + 1 < p.frames) {
+        Uint64 next = base_wall + (play_capture_ns(&p, pos + 1) - base_cap);
+        if (next < wake)
+          wake = next;
+      }
+      if (wake > now)
+        SDL_WaitEventTimeout(NULL, (Sint32)((wake - now + 999999) / 1000000));
+    }
+
+    if (now - last_title >= (Uint64)PLAY_TITLE_MS * 1000000ull) {
+      last_title = now;
+      Uint64 t = play_capture_ns(&p, pos) - first_ns;
+      char title[512];
+      snprintf(title, sizeof(title), "%s  %llu/%llu  %d:%04.1f%s", path,
+               (unsigned long long)pos + 1, (unsigned long long)p.frames,
+               (int)(t / 60000000000ull), (t % 60000000000ull) / 1e9,
+               paused ? "  PAUSED" : "");
+      SDL_SetWindowTitle(*args->win, title);
+    }
+    if (now - last_report >= (Uint64)RECORD_REPORT_MS * 1000000ull) {
+      double dt = (now - last_report) / 1e9;
+      printf("play: %.1f fps, %lld frames skipped (not ready in time)\n",
+             (shown - last_shown) / dt, skipped - last_skipped);
+      last_report = now;
+      last_shown = shown;
+      last_skipped = skipped;
+    }
+  }
+
+  printf("play: %lld frames shown, %lld skipped\n", shown, skipped);
+  play_close(&p);
+  return 0;
+}
+
+// Worker-side tables and scratch for one SPECTRUM_FFT_SIZE transform.
+// Twiddles are stored per stage (half entries for a stage of span 2*half,
+// at offset half - 1) so the butterflies read them contiguously.
+typedef struct {
+  float re[SPECTRUM_FFT_SIZE];
+  float im[SPECTRUM_FFT_SIZE];
+  float window[SPECTRUM_FFT_SIZE];
+  float history[SPECTRUM_FFT_SIZE];
+  float tw_re[SPECTRUM_FFT_SIZE - 1];
+  float tw_im[SPECTRUM_FFT_SIZE - 1];
+  uint16_t bitrev[SPECTRUM_FFT_SIZE];
+  float window_sum;
+  float level[SPECTRUM_BANDS];
+} spectrum_fft_t;
+
+typedef struct {
+  spectrum_t *spectrum;
+  int *running; // shared running flag
+} proc_spectrum_args_t;
+
+static void spectrum_fft_init(spectrum_fft_t *t) {
+  const int n = SPECTRUM_FFT_SIZE;
+  memset(t, 0, sizeof(*t));
+  for (int i = 0; i < n; i++) {
+    t->window[i] = 0.5f - 0.5f * cosf(2.0f * (float)M_PI * i / n); // Hann
+    t->window_sum += t->window[i];
+    unsigned r = 0;
+    for (int b = 0; b < SPECTRUM_FFT_LOG2; b++)
+      r |= ((i >> b) & 1u) << (SPECTRUM_FFT_LOG2 - 1 - b);
+    t->bitrev[i] = (uint16_t)r;
+  }
+  for (int half = 1; half < n; half <<= 1)
+    for (int j = 0; j < half; j++) {
+      double a = -M_PI * j / half;
+      t->tw_re[half - 1 + j] = (float)cos(a);
+      t->tw_im[half - 1 + j] = (float)sin(a);
+    }
+}
+
+// In-place iterative radix-2 DIT FFT over re/im. The input must already be
+// in bit-reversed order. Stages with at least four butterflies per group run
+// four at a time in SSE2.
+static void spectrum_fft(spectrum_fft_t *t) {
+  const int n = SPECTRUM_FFT_SIZE;
+  float *re = t->re, *im = t->im;
+  for (int half = 1; half < n; half <<= 1) {
+    const float *wr = t->tw_re + half - 1, *wi = t->tw_im + half - 1;
+    for (int i = 0; i < n; i += 2 * half) {
+      int j = 0;
+#if defined(__SSE2__)
+      for (; j + 4 <= half; j += 4) {
+        int a = i + j, b = a + half;
+        __m128 cr = _mm_loadu_ps(wr + j), ci = _mm_loadu_ps(wi + j);
+        __m128 br = _mm_loadu_ps(re + b), bi = _mm_loadu_ps(im + b);
+        __m128 tr = _mm_sub_ps(_mm_mul_ps(br, cr), _mm_mul_ps(bi, ci));
+        __m128 ti = _mm_add_ps(_mm_mul_ps(br, ci), _mm_mul_ps(bi, cr));
+        __m128 ar = _mm_loadu_ps(re + a), ai = _mm_loadu_ps(im + a);
+        _mm_storeu_ps(re + b, _mm_sub_ps(ar, tr));
+        _mm_storeu_ps(im + b, _mm_sub_ps(ai, ti));
+        _mm_storeu_ps(re + a, _mm_add_ps(ar, tr));
+        _mm_storeu_ps(im + a, _mm_add_ps(ai, ti));
+      }
+#endif
+      for (; j < half; j++) {
+        int a = i + j, b = a + half;
+        float tr = re[b] * wr[j] - im[b] * wi[j];
+        float ti = re[b] * wi[j] + im[b] * wr[j];
+        re[b] = re[a] - tr;
+        im[b] = im[a] - ti;
+        re[a] += tr;
+        im[a] += ti;
+      }
+    }
+  }
+}
+
+// Window the last SPECTRUM_FFT_SIZE samples, transform, and fold the bins
+// into SPECTRUM_BANDS log-spaced bands from SPECTRUM_MIN_HZ to Nyquist. Each
+// band shows its strongest bin and falls at SPECTRUM_FALL_DB_S.
+static void spectrum_analyze(spectrum_fft_t *t, spectrum_t *sp, int freq,
+                             float dt) {
+  const int n = SPECTRUM_FFT_SIZE;
+  for (int i = 0; i < n; i++) {
+    t->re[t->bitrev[i]] = t->history[i] * t->window[i];
+    t->im[t->bitrev[i]] = 0.0f;
+  }
+  spectrum_fft(t);
 
-  Uint8 buf[4096];
+  float decay = powf(10.0f, -SPECTRUM_FALL_DB_S * dt / 20.0f);
+  float norm = 2.0f / t->window_sum;
+  float ratio = (0.5f * (float)freq) / SPECTRUM_MIN_HZ;
+  for (int b = 0; b < SPECTRUM_BANDS; b++) {
+    float lo_hz = SPECTRUM_MIN_HZ * powf(ratio, (float)b / SPECTRUM_BANDS);
+    float hi_hz =
+        SPECTRUM_MIN_HZ * powf(ratio, (float)(b + 1) / SPECTRUM_BANDS);
+    int lo = (int)(lo_hz * n / freq), hi = (int)(hi_hz * n / freq);
+    if (lo < 1)
+      lo = 1;
+    if (hi > n / 2)
+      hi = n / 2;
+    if (hi <= lo)
+      hi = lo + 1;
 
-  while (*args->running && !g_stop) {
-    int avail = SDL_GetAudioStreamAvailable(rec_stream);
-    if (avail <= 0) {
-      SDL_Delay(1);
-      continue;
+    float best = 0.0f;
+    for (int k = lo; k < hi; k++) {
+      float p = t->re[k] * t->re[k] + t->im[k] * t->im[k];
+      if (p > best)
+        best = p;
     }
+    float amp = sqrtf(best) * norm;
+    t->level[b] *= decay;
+    if (amp > t->level[b])
+      t->level[b] = amp;
+    atomic_store(&sp->band_q16[b], (int)(t->level[b] * 65536.0f));
+  }
+  atomic_store(&sp->bands, SPECTRUM_BANDS);
+}
 
-    if (avail > (int)sizeof(buf))
-      avail = (int)sizeof(buf);
+// Consumer side: a new transform every half window (50% overlap). When the
+// backlog grows past a window the oldest samples are skipped, so the view
+// stays current instead of catching up.
+static int proc_spectrum(proc_spectrum_args_t *args) {
+  spectrum_t *sp = args->spectrum;
+  spectrum_fft_t *t = malloc(sizeof(*t));
+  if (!t) {
+    fprintf(stderr, "spectrum: out of memory\n");
+    return 1;
+  }
+  spectrum_fft_init(t);
 
-    int got = SDL_GetAudioStreamData(rec_stream, buf, avail);
-    if (got < 0) {
-      fprintf(stderr, "GetAudioStreamData: %s\n", SDL_GetError());
-      break;
+  const int hop = SPECTRUM_FFT_SIZE / 2;
+  while (*args->running && !g_stop) {
+    unsigned seq = atomic_load(&sp->bell.seq);
+    unsigned rd = atomic_load_explicit(&sp->rd, memory_order_relaxed);
+    unsigned wr = atomic_load_explicit(&sp->wr, memory_order_acquire);
+    int avail = (int)(wr - rd);
+    if (avail < hop) {
+      doorbell_wait(&sp->bell, seq, SPECTRUM_IDLE_MS);
+      continue;
     }
+    if (avail > SPECTRUM_FFT_SIZE)
+      rd = wr - SPECTRUM_FFT_SIZE;
 
-    if (got > 0) {
-      if (!SDL_PutAudioStreamData(out_stream, buf, got)) {
-        fprintf(stderr, "PutAudioStreamData: %s\n", SDL_GetError());
-        break;
-      }
-    }
-  }
+    memmove(t->history, t->history + hop, sizeof(float) * (size_t)hop);
+    for (int i = 0; i < hop; i++)
+      t->history[hop + i] =
+          sp->ring[(rd + (unsigned)i) & (SPECTRUM_RING_SAMPLES - 1)];
+    atomic_store_explicit(&sp->rd, rd + (unsigned)hop, memory_order_release);
 
-  rc = 0;
+    int freq = atomic_load_explicit(&sp->freq, memory_order_relaxed);
+    if (freq > 0)
+      spectrum_analyze(t, sp, freq, (float)hop / (float)freq);
+  }
 
-cleanup:
-  if (rec_stream)
-    SDL_DestroyAudioStream(rec_stream);
-  if (out_stream)
-    SDL_DestroyAudioStream(out_stream);
-  if (out_dev)
-    SDL_CloseAudioDevice(out_dev);
-  if (rec_dev)
-    SDL_CloseAudioDevice(rec_dev);
-  return rc;
+  free(t);
+  return 0;
 }
 
-int proc_video(const proc_video_args_t *args) {
-  uint32_t i;
-
-  memset(args->fmt, 0, sizeof(*args->fmt));
-  args->fmt->type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-  args->fmt->fmt.pix.width = args->width;
-  args->fmt->fmt.pix.height = args->height;
-  args->fmt->fmt.pix.pixelformat = V4L2_PIX_FMT_YUYV;
-  args->fmt->fmt.pix.field = V4L2_FIELD_NONE;
+static void *proc_video_thread(void *arg) {
+  return (void *)(intptr_t)proc_video((proc_video_args_t *)arg);
+}
+static void *proc_audio_thread(void *arg) {
+  return (void *)(intptr_t)proc_audio((proc_audio_args_t *)arg);
+}
+static void *proc_spectrum_thread(void *arg) {
+  return (void *)(intptr_t)proc_spectrum((proc_spectrum_args_t *)arg);
+}
+static void *proc_mux_thread(void *arg) {
+  return (void *)(intptr_t)proc_mux((proc_mux_args_t *)arg);
+}
 
-  if (xioctl(args->fd, VIDIOC_S_FMT, args->fmt) < 0) {
-    fprintf(stderr, "VIDIOC_S_FMT failed: %s\n", strerror(errno));
-    return 1;
+static double bench_ns_per_call(void (*fn)(const void *, int, int, int,
+                                           float *, float *),
+                                const void *data, int frames, int is_float,
+                                int channels, int iters) {
+  float peak[AUDIO_MAX_CHANNELS], sumsq[AUDIO_MAX_CHANNELS];
+  volatile float sink = 0.0f;
+  Uint64 t0 = mono_ns();
+  for (int i = 0; i < iters; i++) {
+    fn(data, frames, is_float, channels, peak, sumsq);
+    sink += peak[0] + sumsq[channels - 1];
   }
+  (void)sink;
+  return (double)(mono_ns() - t0) / iters;
+}
 
-  memset(args->req, 0, sizeof(*args->req));
-  args->req->count = 4;
-  args->req->type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-  args->req->memory = V4L2_MEMORY_MMAP;
+// --bench: time the audio kernels on synthetic AUDIO_CHUNK_BYTES chunks.
+static int run_bench(void) {
+  static float f32[AUDIO_CHUNK_BYTES / sizeof(float)];
+  static Sint16 s16[AUDIO_CHUNK_BYTES / sizeof(Sint16)];
+  for (size_t i = 0; i < sizeof(f32) / sizeof(f32[0]); i++)
+    f32[i] = 0.5f * sinf((float)i * 0.05f);
+  for (size_t i = 0; i < sizeof(s16) / sizeof(s16[0]); i++)
+    s16[i] = (Sint16)(16000.0f * sinf((float)i * 0.05f));
 
-  if (xioctl(args->fd, VIDIOC_REQBUFS, args->req) < 0 || args->req->count < 2) {
-    fprintf(stderr, "VIDIOC_REQBUFS failed: %s\n", strerror(errno));
-    return 1;
-  }
+  const int iters = 200000;
 
-  *args->buffers = calloc(args->req->count, sizeof(buffer_t));
-  if (!*args->buffers) {
-    perror("calloc(buffers)");
-    return 1;
+  // Channel stage against SDL's own stream conversion, 7.1 -> stereo.
+  audio_mix_t mix;
+  proc_audio_args_t noargs;
+  memset(&noargs, 0, sizeof(noargs));
+  audio_mix_setup(&mix, 8, 2, &noargs);
+  static Uint8 chunk[AUDIO_CHUNK_BYTES];
+  static float scratch[AUDIO_CHUNK_BYTES / sizeof(Sint16)], out[4096];
+  int frames = (int)sizeof(f32) / (int)sizeof(float) / 8;
+  Uint64 t0 = mono_ns();
+  for (int i = 0; i < iters; i++)
+    audio_mix_scalar(&mix, f32, out, frames);
+  double scalar_ns = (double)(mono_ns() - t0) / iters;
+  t0 = mono_ns();
+  for (int i = 0; i < iters; i++) {
+    memcpy(chunk, f32, sizeof(chunk));
+    audio_mix_chunk(&mix, chunk, sizeof(chunk), SDL_AUDIO_F32, scratch);
   }
+  double f32_ns = (double)(mono_ns() - t0) / iters;
+  t0 = mono_ns();
+  for (int i = 0; i < iters; i++) {
+    memcpy(chunk, s16, sizeof(chunk));
+    audio_mix_chunk(&mix, chunk, sizeof(chunk), SDL_AUDIO_S16, scratch);
+  }
+  double s16_ns = (double)(mono_ns() - t0) / iters;
+  printf("mix 8->2ch F32: scalar %.0fns simd %.0fns, S16 simd %.0fns per "
+         "chunk\n",
+         scalar_ns, f32_ns, s16_ns);
 
-  for (i = 0; i < args->req->count; i++) {
-    memset(args->buf, 0, sizeof(*args->buf));
-    args->buf->type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-    args->buf->memory = V4L2_MEMORY_MMAP;
-    args->buf->index = i;
-
-    if (xioctl(args->fd, VIDIOC_QUERYBUF, args->buf) < 0) {
-      fprintf(stderr, "VIDIOC_QUERYBUF failed: %s\n", strerror(errno));
-      return 1;
+  SDL_AudioSpec src = {SDL_AUDIO_S16, 8, 48000};
+  SDL_AudioSpec dst = {SDL_AUDIO_S16, 2, 48000};
+  SDL_AudioStream *conv = SDL_CreateAudioStream(&src, &dst);
+  if (conv) {
+    int sdl_iters = iters / 10;
+    t0 = mono_ns();
+    for (int i = 0; i < sdl_iters; i++) {
+      SDL_PutAudioStreamData(conv, s16, sizeof(s16));
+      SDL_GetAudioStreamData(conv, out, (int)sizeof(out));
     }
+    printf("mix 8->2ch S16: SDL_AudioStream %.0fns per chunk\n",
+           (double)(mono_ns() - t0) / sdl_iters);
+    SDL_DestroyAudioStream(conv);
+  }
 
-    (*args->buffers)[i].length = args->buf->length;
-    (*args->buffers)[i].start =
-        mmap(NULL, args->buf->length, PROT_READ | PROT_WRITE, MAP_SHARED,
-             args->fd, args->buf->m.offset);
-    if ((*args->buffers)[i].start == MAP_FAILED) {
-      fprintf(stderr, "mmap failed: %s\n", strerror(errno));
-      return 1;
+  spectrum_fft_t *fft = malloc(sizeof(*fft));
+  if (fft) {
+    spectrum_fft_init(fft);
+    int fft_iters = iters / 20;
+    t0 = mono_ns();
+    for (int i = 0; i < fft_iters; i++) {
+      memset(fft->im, 0, sizeof(fft->im));
+      memcpy(fft->re, f32, sizeof(f32));
+      spectrum_fft(fft);
     }
+    printf("fft %d points: %.0fns per transform\n", SPECTRUM_FFT_SIZE,
+           (double)(mono_ns() - t0) / fft_iters);
+    free(fft);
   }
 
-  for (i = 0; i < args->req->count; i++) {
-    memset(args->buf, 0, sizeof(*args->buf));
-    args->buf->type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-    args->buf->memory = V4L2_MEMORY_MMAP;
-    args->buf->index = i;
-
-    if (xioctl(args->fd, VIDIOC_QBUF, args->buf) < 0) {
-      fprintf(stderr, "VIDIOC_QBUF failed: %s\n", strerror(errno));
-      return 1;
-    }
+  const int layouts[] = {2, 6, 8};
+  for (size_t l = 0; l < sizeof(layouts) / sizeof(layouts[0]); l++) {
+    int ch = layouts[l];
+    int f_frames = (int)(sizeof(f32) / sizeof(float)) / ch;
+    int s_frames = (int)(sizeof(s16) / sizeof(Sint16)) / ch;
+    printf("levels %dch S16: scalar %.0fns simd %.0fns per %d-byte chunk\n",
+           ch,
+           bench_ns_per_call(audio_levels_scalar, s16, s_frames, 0, ch, iters),
+           bench_ns_per_call(audio_levels, s16, s_frames, 0, ch, iters),
+           AUDIO_CHUNK_BYTES);
+    printf("levels %dch F32: scalar %.0fns simd %.0fns per %d-byte chunk\n",
+           ch,
+           bench_ns_per_call(audio_levels_scalar, f32, f_frames, 1, ch, iters),
+           bench_ns_per_call(audio_levels, f32, f_frames, 1, ch, iters),
+           AUDIO_CHUNK_BYTES);
   }
+  return 0;
+}
 
-  *args->type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-  if (xioctl(args->fd, VIDIOC_STREAMON, args->type) < 0) {
-    fprintf(stderr, "VIDIOC_STREAMON failed: %s\n", strerror(errno));
+// --bench-lossless: pack and unpack every frame of a raw recording on one
+// core, check the round trip, and report ratio and speed.
+static int run_bench_lossless(const char *path) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    fprintf(stderr, "open(%s) failed: %s\n", path, strerror(errno));
     return 1;
   }
-
-  *args->win = SDL_CreateWindow(args->dev, args->fmt->fmt.pix.width,
-                                args->fmt->fmt.pix.height, 0);
-  if (!*args->win) {
-    fprintf(stderr, "SDL_CreateWindow failed: %s\n", SDL_GetError());
+  struct stat st;
+  record_file_header_t h;
+  if (fstat(fd, &st) < 0 || pread(fd, &h, sizeof(h), 0) != sizeof(h) ||
+      memcmp(h.magic, "YUYVRAW1", 8) != 0 || !h.slot_bytes ||
+      h.width < 2 || !h.height || !h.bytesperline) {
+    fprintf(stderr, "%s: not a --record file\n", path);
+    close(fd);
     return 1;
   }
-  SDL_SetWindowResizable(*args->win, 1);
-
-  *args->ren = SDL_CreateRenderer(*args->win, NULL);
-  if (!*args->ren) {
-    fprintf(stderr, "SDL_CreateRenderer failed: %s\n", SDL_GetError());
+  const uint8_t *map =
+      mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) {
+    perror("mmap");
     return 1;
   }
+  madvise((void *)map, (size_t)st.st_size, MADV_SEQUENTIAL);
 
-  *args->tex = SDL_CreateTexture(
-      *args->ren, SDL_PIXELFORMAT_RGB24, SDL_TEXTUREACCESS_STREAMING,
-      args->fmt->fmt.pix.width, args->fmt->fmt.pix.height);
-  if (!*args->tex) {
-    fprintf(stderr, "SDL_CreateTexture failed: %s\n", SDL_GetError());
+  int width = (int)h.width & ~1, height = (int)h.height;
+  size_t raw_bytes = (size_t)width * 2 * height;
+  uint8_t *out = malloc(yuyv_pack_bound(raw_bytes));
+  uint8_t *scratch = malloc(2 * ((size_t)width * 2 + 16) + raw_bytes);
+  uint8_t *back = malloc(raw_bytes);
+  if (!out || !scratch || !back) {
+    perror("malloc");
+    free(out);
+    free(scratch);
+    free(back);
+    munmap((void *)map, (size_t)st.st_size);
     return 1;
   }
-  SDL_SetTextureScaleMode(*args->tex, SDL_SCALEMODE_NEAREST);
 
-  *args->rgb_size =
-      (size_t)args->fmt->fmt.pix.width * (size_t)args->fmt->fmt.pix.height * 3;
-  *args->rgb = malloc(*args->rgb_size);
-  if (!*args->rgb) {
-    perror("malloc(rgb)");
-    return 1;
+  long long frames = 0, packed = 0, bad = 0;
+  Uint64 pack_ns = 0, unpack_ns = 0;
+  uint64_t size = (uint64_t)st.st_size;
+  for (uint64_t off = h.header_bytes; off + h.slot_bytes <= size;
+       off += h.slot_bytes) {
+    const uint8_t *yuyv = map + off + RECORD_FRAME_HEADER;
+    Uint64 t0 = mono_ns();
+    size_t n = yuyv_pack(yuyv, (int)h.bytesperline, width, height, out,
+                         scratch);
+    Uint64 t1 = mono_ns();
+    int ok = yuyv_unpack(out, n, width, height, back) == 0;
+    Uint64 t2 = mono_ns();
+    for (int y = 0; ok && y < height; y++)
+      ok = memcmp(back + (size_t)y * width * 2,
+                  yuyv + (size_t)y * h.bytesperline, (size_t)width * 2) == 0;
+    bad += !ok;
+    frames++;
+    packed += (long long)n;
+    pack_ns += t1 - t0;
+    unpack_ns += t2 - t1;
   }
+  if (frames) {
+    double raw_mb = (double)raw_bytes * frames / 1e6;
+    printf("lossless %dx%d, %lld frames: ratio %.2f (%.0f KB per frame)\n"
+           "pack %.0f fps per core (%.0f MB/s), unpack %.0f fps per core "
+           "(%.0f MB/s), %lld mismatches\n",
+           width, height, frames, (double)raw_bytes * frames / packed,
+           packed / 1e3 / frames, frames / (pack_ns / 1e9),
+           raw_mb / (pack_ns / 1e9), frames / (unpack_ns / 1e9),
+           raw_mb / (unpack_ns / 1e9), bad);
+  }
+  free(out);
+  free(scratch);
+  free(back);
+  munmap((void *)map, (size_t)st.st_size);
+  return bad ? 1 : 0;
+}
 
-  while (*args->running && !g_stop) {
-    while (SDL_PollEvent(args->e)) {
-      if (args->e->type == SDL_EVENT_QUIT)
-        *args->running = 0;
-      if (args->e->type == SDL_EVENT_KEY_DOWN &&
-          args->e->key.key == SDLK_ESCAPE)
-        *args->running = 0;
-    }
+// --verify: check every frame of a recording against its CRC32C. Threads
+// take VERIFY_BATCH frames at a time in file order and ask for readahead
+// one round of batches further on, so the disk stays busy.
+typedef struct {
+  const play_t *p;
+  int nthreads;
+  atomic_ullong next;
+  atomic_llong bad, unwritten, bytes;
+} verify_t;
 
-    FD_ZERO(args->fds);
-    FD_SET(args->fd, args->fds);
-    args->tv->tv_sec = 2;
-    args->tv->tv_usec = 0;
+static void *verify_worker(void *arg) {
+  verify_t *v = arg;
+  const play_t *p = v->p;
+  long long bad = 0, unwritten = 0, bytes = 0;
+  for (;;) {
+    uint64_t first = atomic_fetch_add(&v->next, VERIFY_BATCH);
+    if (first >= p->frames)
+      break;
+    uint64_t end = first + VERIFY_BATCH < p->frames ? first + VERIFY_BATCH
+                                                     : p->frames;
+    uint64_t ahead = first + (uint64_t)v->nthreads * VERIFY_BATCH;
+    for (uint64_t n = ahead; n < ahead + VERIFY_BATCH && n < p->frames; n++)
+      play_readahead(p, n);
 
-    *args->r = select(args->fd + 1, args->fds, NULL, NULL, args->tv);
-    if (*args->r < 0) {
-      if (errno == EINTR)
+    for (uint64_t n = first; n < end; n++) {
+      uint64_t off;
+      size_t len;
+      play_span(p, n, &off, &len);
+      record_frame_header_t fh;
+      size_t head = p->packed ? sizeof(fh) : RECORD_FRAME_HEADER;
+      if (off + len > p->map_bytes || len < head) {
+        printf("verify: frame %llu lies outside the file\n",
+               (unsigned long long)n);
+        bad++;
         continue;
-      fprintf(stderr, "select failed: %s\n", strerror(errno));
-      break;
+      }
+      memcpy(&fh, p->map + off, sizeof(fh));
+      // Preallocated slots of a raw file that was not closed.
+      if (!p->packed && !p->h.frames && fh.magic == 0) {
+        unwritten++;
+        continue;
+      }
+      uint32_t want = p->packed ? p->index[n].crc : fh.crc;
+      const char *why = NULL;
+      if (fh.magic != (p->packed ? 0x5a4d5246u : 0x304d5246u) ||
+          fh.bytes > len - head)
+        why = "bad frame header";
+      else if (crc32c(p->map + off + head, fh.bytes) != want)
+        why = "CRC mismatch";
+      if (why) {
+        printf("verify: frame %llu (sequence %u): %s\n",
+               (unsigned long long)n, fh.sequence, why);
+        bad++;
+      } else {
+        bytes += fh.bytes;
+      }
     }
-    if (*args->r == 0)
-      continue;
+  }
+  atomic_fetch_add(&v->bad, bad);
+  atomic_fetch_add(&v->unwritten, unwritten);
+  atomic_fetch_add(&v->bytes, bytes);
+  return NULL;
+}
 
-    memset(args->buf, 0, sizeof(*args->buf));
-    args->buf->type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-    args->buf->memory = V4L2_MEMORY_MMAP;
+static int run_verify(const char *path) {
+  play_t p;
+  if (play_open(&p, path) < 0) {
+    play_close(&p);
+    return 1;
+  }
+  if (!(p.h.flags & RECORD_FLAG_CRC32C)) {
+    fprintf(stderr, "%s was recorded without checksums\n", path);
+    play_close(&p);
+    return 1;
+  }
+  madvise((void *)p.map, p.map_bytes, MADV_SEQUENTIAL);
 
-    if (xioctl(args->fd, VIDIOC_DQBUF, args->buf) < 0) {
-      if (errno == EAGAIN)
-        continue;
-      fprintf(stderr, "VIDIOC_DQBUF failed: %s\n", strerror(errno));
+  verify_t v;
+  memset(&v, 0, sizeof(v));
+  v.p = &p;
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  v.nthreads = cpus > VERIFY_MAX_THREADS ? VERIFY_MAX_THREADS
+                                         : cpus > 0 ? (int)cpus : 1;
+  pthread_t threads[VERIFY_MAX_THREADS];
+  int started = 0;
+  Uint64 t0 = mono_ns();
+  for (; started < v.nthreads; started++)
+    if (pthread_create(&threads[started], NULL, verify_worker, &v) != 0)
       break;
-    }
+  if (!started)
+    verify_worker(&v);
+  for (int i = 0; i < started; i++)
+    pthread_join(threads[i], NULL);
+  double dt = (double)(mono_ns() - t0) / 1e9;
 
-    // Convert + draw
-    yuyv_to_rgb24((const uint8_t *)(*args->buffers)[args->buf->index].start,
-                  *args->rgb, args->fmt->fmt.pix.width,
-                  args->fmt->fmt.pix.height);
-
-    // Upload frame
-    SDL_UpdateTexture(*args->tex, NULL, *args->rgb,
-                      args->fmt->fmt.pix.width * 3);
+  long long bad = atomic_load(&v.bad), unwritten = atomic_load(&v.unwritten);
+  long long bytes = atomic_load(&v.bytes);
+  printf("verify: %s, %llu frames, %lld bad", path,
+         (unsigned long long)p.frames - (unsigned long long)unwritten, bad);
+  if (unwritten)
+    printf(", %lld slots never written", unwritten);
+  printf("; %.1f GB in %.2fs (%.2f GB/s, %d threads)\n", bytes / 1e9, dt,
+         dt > 0 ? bytes / dt / 1e9 : 0.0, started ? started : 1);
+  play_close(&p);
+  return bad ? 1 : 0;
+}
 
-    // Integer scaling: render into a centered integer-multiple rect
-    int out_w = 0, out_h = 0;
-    SDL_GetRenderOutputSize(*args->ren, &out_w, &out_h);
+// --convert: turn a recording into one raw RGB24 file, a Y4M (4:2:2) file,
+// or a directory of PPMs. Every converted frame has the same size, so each
+// thread takes a batch of consecutive frames, converts them into one buffer
+// and writes it with a single pwrite() at its place in the output.
+enum { CONVERT_RGB, CONVERT_Y4M, CONVERT_PPM };
 
-    SDL_FRect dst = integer_fit_rect(args->fmt->fmt.pix.width,
-                                     args->fmt->fmt.pix.height, out_w, out_h);
+typedef struct {
+  const play_t *p;
+  int kind;
+  int nthreads;
+  int width, height, stride;
+  int fd;            // RGB or Y4M output
+  const char *dir;   // PPM output
+  size_t head_bytes; // Y4M stream header
+  size_t out_bytes;  // one converted frame
+  uint64_t batch;    // frames per batch
+  atomic_ullong next;
+  atomic_int failed;
+  atomic_llong damaged;
+} convert_t;
 
-    SDL_RenderClear(*args->ren);
-    SDL_RenderTexture(*args->ren, *args->tex, NULL, &dst);
-    SDL_RenderPresent(*args->ren);
+static void *convert_worker(void *arg) {
+  convert_t *c = arg;
+  const play_t *p = c->p;
+  int w = c->width, h = c->height;
+  uint8_t *out = malloc(c->batch * c->out_bytes);
+  uint8_t *yuyv = p->packed ? malloc((size_t)w * 2 * h) : NULL;
+  if (!out || (p->packed && !yuyv)) {
+    perror("malloc(convert)");
+    atomic_store(&c->failed, 1);
+  }
 
-    if (xioctl(args->fd, VIDIOC_QBUF, args->buf) < 0) {
-      fprintf(stderr, "VIDIOC_QBUF (requeue) failed: %s\n", strerror(errno));
+  while (!atomic_load(&c->failed)) {
+    uint64_t first = atomic_fetch_add(&c->next, c->batch);
+    if (first >= p->frames)
       break;
+    uint64_t end = first + c->batch < p->frames ? first + c->batch : p->frames;
+    uint64_t ahead = first + (uint64_t)c->nthreads * c->batch;
+    for (uint64_t n = ahead; n < ahead + c->batch && n < p->frames; n++)
+      play_readahead(p, n);
+
+    for (uint64_t n = first; n < end; n++) {
+      uint8_t *dst = out + (n - first) * c->out_bytes;
+      const uint8_t *frame;
+      int stride;
+      if (p->packed) {
+        const record_index_t *ix = &p->index[n];
+        uint64_t at = ix->offset + sizeof(record_frame_header_t);
+        if (at + ix->bytes > p->map_bytes ||
+            yuyv_unpack(p->map + at, ix->bytes, w, h, yuyv) != 0) {
+          printf("convert: frame %llu is damaged\n", (unsigned long long)n);
+          atomic_fetch_add(&c->damaged, 1);
+        }
+        frame = yuyv;
+        stride = w * 2;
+      } else {
+        frame = p->map + p->h.header_bytes + n * p->h.slot_bytes +
+                RECORD_FRAME_HEADER;
+        stride = c->stride;
+      }
+
+      if (c->kind == CONVERT_Y4M) {
+        memcpy(dst, "FRAME\n", 6);
+        uint8_t *y = dst + 6, *u = y + (size_t)w * h;
+        yuyv_to_planar422(frame, stride, w, h, y, u, u + (size_t)w / 2 * h);
+      } else if (stride == w * 2) {
+        yuyv_to_rgb24(frame, dst, w, h);
+      } else {
+        for (int row = 0; row < h; row++)
+          yuyv_to_rgb24(frame + (size_t)row * stride,
+                        dst + (size_t)row * w * 3, w, 1);
+      }
+
+      if (c->kind == CONVERT_PPM) {
+        char path[SEGMENT_PATH_MAX];
+        snprintf(path, sizeof(path), "%s/frame-%06llu.ppm", c->dir,
+                 (unsigned long long)n);
+        if (shot_write(path, dst, w, h) < 0)
+          atomic_store(&c->failed, 1);
+      }
+    }
+
+    if (c->kind != CONVERT_PPM) {
+      size_t len = (size_t)(end - first) * c->out_bytes;
+      off_t at = (off_t)(c->head_bytes + first * c->out_bytes);
+      ssize_t wrote = pwrite(c->fd, out, len, at);
+      if (wrote != (ssize_t)len) {
+        fprintf(stderr, "convert: write failed: %s\n",
+                wrote < 0 ? strerror(errno) : "short write");
+        atomic_store(&c->failed, 1);
+      }
     }
   }
+  free(out);
+  free(yuyv);
+  return NULL;
+}
 
-  // ensure other thread exits too
-  *args->running = 0;
-  return 0;
+// OUT ending in .rgb or .y4m names the output file; anything else is a
+// directory for PPMs.
+static int run_convert(const char *in, const char *out) {
+  play_t p;
+  if (play_open(&p, in) < 0) {
+    play_close(&p);
+    return 1;
+  }
+  madvise((void *)p.map, p.map_bytes, MADV_SEQUENTIAL);
+
+  convert_t c;
+  memset(&c, 0, sizeof(c));
+  c.p = &p;
+  c.fd = -1;
+  c.width = (int)p.h.width & ~1;
+  c.height = (int)p.h.height;
+  c.stride = p.h.bytesperline ? (int)p.h.bytesperline : c.width * 2;
+  size_t n = strlen(out);
+  c.kind = n > 4 && strcmp(out + n - 4, ".rgb") == 0   ? CONVERT_RGB
+           : n > 4 && strcmp(out + n - 4, ".y4m") == 0 ? CONVERT_Y4M
+                                                        : CONVERT_PPM;
+  c.out_bytes = c.kind == CONVERT_Y4M ? 6 + (size_t)c.width * c.height * 2
+                                      : (size_t)c.width * c.height * 3;
+  c.batch = c.kind == CONVERT_PPM ? 1 : CONVERT_BATCH_BYTES / c.out_bytes;
+  if (!c.batch)
+    c.batch = 1;
+
+  if (c.kind == CONVERT_PPM) {
+    c.dir = out;
+    if (mkdir(out, 0755) < 0 && errno != EEXIST) {
+      fprintf(stderr, "mkdir(%s) failed: %s\n", out, strerror(errno));
+      play_close(&p);
+      return 1;
+    }
+  } else {
+    c.fd = open(out, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (c.fd < 0) {
+      fprintf(stderr, "open(%s) failed: %s\n", out, strerror(errno));
+      play_close(&p);
+      return 1;
+    }
+    if (c.kind == CONVERT_Y4M) {
+      char hdr[128];
+      int len = snprintf(hdr, sizeof(hdr),
+                         "YUV4MPEG2 W%d H%d F%u:1 Ip A1:1 C422\n", c.width,
+                         c.height, p.h.fps ? p.h.fps : VIDEO_FPS_FALLBACK);
+      if (write(c.fd, hdr, (size_t)len) != len) {
+        fprintf(stderr, "convert: header write failed: %s\n",
+                strerror(errno));
+        close(c.fd);
+        play_close(&p);
+        return 1;
+      }
+      c.head_bytes = (size_t)len;
+    }
+    // All of it at once, so the threads' writes land in allocated space.
+    off_t total = (off_t)(c.head_bytes + p.frames * c.out_bytes);
+    if (fallocate(c.fd, 0, 0, total) < 0 && errno != EOPNOTSUPP)
+      fprintf(stderr, "convert: fallocate failed: %s\n", strerror(errno));
+  }
+
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  c.nthreads = cpus > CONVERT_MAX_THREADS ? CONVERT_MAX_THREADS
+                                          : cpus > 0 ? (int)cpus : 1;
+  pthread_t threads[CONVERT_MAX_THREADS];
+  int started = 0;
+  Uint64 t0 = mono_ns();
+  for (; started < c.nthreads; started++)
+    if (pthread_create(&threads[started], NULL, convert_worker, &c) != 0)
+      break;
+  if (!started)
+    convert_worker(&c);
+  for (int i = 0; i < started; i++)
+    pthread_join(threads[i], NULL);
+  double dt = (double)(mono_ns() - t0) / 1e9;
+
+  int failed = atomic_load(&c.failed);
+  if (c.fd >= 0 && close(c.fd) < 0) {
+    fprintf(stderr, "convert: close failed: %s\n", strerror(errno));
+    failed = 1;
+  }
+  if (!failed) {
+    double in_bytes = p.packed ? (double)p.map_bytes
+                               : (double)p.frames * p.h.slot_bytes;
+    double out_bytes = (double)p.frames * c.out_bytes;
+    printf("convert: %llu frames %dx%d in %.2fs: %.0f frames/s, read %.2f "
+           "GB/s, wrote %.2f GB/s (%d threads), %lld damaged\n",
+           (unsigned long long)p.frames, c.width, c.height, dt,
+           dt > 0 ? p.frames / dt : 0.0, dt > 0 ? in_bytes / dt / 1e9 : 0.0,
+           dt > 0 ? out_bytes / dt / 1e9 : 0.0, started ? started : 1,
+           (long long)atomic_load(&c.damaged));
+  }
+  play_close(&p);
+  return failed || atomic_load(&c.damaged) ? 1 : 0;
 }
 
-static void *proc_video_thread(void *arg) {
-  return (void *)(intptr_t)proc_video((proc_video_args_t *)arg);
+// Returns the value of "--name=value", or NULL if arg is another option.
+static const char *opt_value(const char *arg, const char *name) {
+  size_t n = strlen(name);
+  if (strncmp(arg, name, n) == 0 && arg[n] == '=')
+    return arg + n + 1;
+  return NULL;
 }
-static void *proc_audio_thread(void *arg) {
-  return (void *)(intptr_t)proc_audio((proc_audio_args_t *)arg);
+
+// A whole number of milliseconds, 0 or more, and nothing after it.
+static int opt_ms(const char *v, int *ms) {
+  char *end;
+  errno = 0;
+  long n = strtol(v, &end, 10);
+  if (end == v || *end || errno || n < 0 || n > INT32_MAX / 1000)
+    return -1;
+  *ms = (int)n;
+  return 0;
 }
 
 int main(int argc, char **argv) {
@@ -465,6 +6745,211 @@ int main(int argc, char **argv) {
   sigemptyset(&sa.sa_mask);
   sigaction(SIGINT, &sa, NULL);
   sigaction(SIGTERM, &sa, NULL);
+
+  int audio_target_ms = AUDIO_TARGET_MS_DEFAULT;
+  int audio_rate = 0;
+  int av_sync = 1;
+  int max_delay_ms = AV_DELAY_MAX_MS_DEFAULT;
+  int video_delay_ms = 0;
+  int audio_delay_ms = 0;
+  const char *stats_path = NULL;
+  const char *alsa_capture = NULL;
+  const char *alsa_playback = NULL;
+  int alsa_period = ALSA_PERIOD_DEFAULT;
+  const char *mix_gain = NULL;
+  const char *mix_mute = NULL;
+  const char *mix_map = NULL;
+  int probe_trials = 0;
+  const char *convert_in = NULL;
+  const char *convert_out = NULL;
+  const char *tap_path = NULL;
+  int standby_ms = AUDIO_STANDBY_MS_DEFAULT;
+  const char *sources[AUDIO_MAX_SOURCES];
+  int nsources = 0;
+  const char *record_path = NULL;
+  int record_segment_s = 0;
+  int record_quota_mb = 0;
+  const char *lossless_path = NULL;
+  int lossless_threads = 0;
+  const char *mkv_path = NULL;
+  int stdout_fd = -1;
+  int replay_seconds = 0;
+  int replay_mb = REPLAY_MB_DEFAULT;
+  const char *replay_dir = ".";
+  const char *shot_dir = ".";
+  const char *timeshift_path = NULL;
+  int timeshift_mb = TIMESHIFT_MB_DEFAULT;
+  const char *play_path = NULL;
+
+  // Pull out --options so the positional arguments keep their slots.
+  int nargs = 1;
+  for (int i = 1; i < argc; i++) {
+    const char *v;
+    if ((v = opt_value(argv[i], "--audio-latency"))) {
+      audio_target_ms = atoi(v);
+      if (audio_target_ms <= 0) {
+        fprintf(stderr, "Invalid --audio-latency: %s\n", v);
+        return 1;
+      }
+    } else if ((v = opt_value(argv[i], "--audio-rate"))) {
+      audio_rate = atoi(v);
+      if (audio_rate <= 0) {
+        fprintf(stderr, "Invalid --audio-rate: %s\n", v);
+        return 1;
+      }
+    } else if ((v = opt_value(argv[i], "--max-delay"))) {
+      if (opt_ms(v, &max_delay_ms) < 0) {
+        fprintf(stderr, "Invalid --max-delay: %s\n", v);
+        return 1;
+      }
+    } else if ((v = opt_value(argv[i], "--video-delay"))) {
+      if (opt_ms(v, &video_delay_ms) < 0) {
+        fprintf(stderr, "Invalid --video-delay: %s\n", v);
+        return 1;
+      }
+    } else if ((v = opt_value(argv[i], "--audio-delay"))) {
+      if (opt_ms(v, &audio_delay_ms) < 0) {
+        fprintf(stderr, "Invalid --audio-delay: %s\n", v);
+        return 1;
+      }
+    } else if ((v = opt_value(argv[i], "--audio-stats"))) {
+      stats_path = v;
+    } else if ((v = opt_value(argv[i], "--alsa-capture"))) {
+      alsa_capture = v;
+    } else if ((v = opt_value(argv[i], "--alsa-playback"))) {
+      alsa_playback = v;
+    } else if ((v = opt_value(argv[i], "--alsa-period"))) {
+      alsa_period = atoi(v);
+      if (alsa_period <= 0) {
+        fprintf(stderr, "Invalid --alsa-period: %s\n", v);
+        return 1;
+      }
+    } else if ((v = opt_value(argv[i], "--audio-gain"))) {
+      mix_gain = v;
+    } else if ((v = opt_value(argv[i], "--audio-mute"))) {
+      mix_mute = v;
+    } else if ((v = opt_value(argv[i], "--audio-map"))) {
+      mix_map = v;
+    } else if ((v = opt_value(argv[i], "--mkv"))) {
+      mkv_path = v;
+    } else if ((v = opt_value(argv[i], "--record"))) {
+      record_path = v;
+    } else if ((v = opt_value(argv[i], "--record-segment"))) {
+      record_segment_s = atoi(v);
+      if (record_segment_s <= 0) {
+        fprintf(stderr, "Invalid --record-segment: %s\n", v);
+        return 1;
+      }
+    } else if ((v = opt_value(argv[i], "--record-quota"))) {
+      record_quota_mb = atoi(v);
+      if (record_quota_mb <= 0) {
+        fprintf(stderr, "Invalid --record-quota: %s\n", v);
+        return 1;
+      }
+    } else if ((v = opt_value(argv[i], "--record-lossless"))) {
+      lossless_path = v;
+    } else if ((v = opt_value(argv[i], "--record-threads"))) {
+      lossless_threads = atoi(v);
+    } else if ((v = opt_value(argv[i], "--bench-lossless"))) {
+      return run_bench_lossless(v);
+    } else if ((v = opt_value(argv[i], "--verify"))) {
+      return run_verify(v);
+    } else if ((v = opt_value(argv[i], "--convert"))) {
+      convert_in = v;
+    } else if ((v = opt_value(argv[i], "--convert-out"))) {
+      convert_out = v;
+    } else if ((v = opt_value(argv[i], "--replay"))) {
+      replay_seconds = atoi(v);
+      if (replay_seconds <= 0) {
+        fprintf(stderr, "Invalid --replay: %s\n", v);
+        return 1;
+      }
+    } else if ((v = opt_value(argv[i], "--replay-mb"))) {
+      replay_mb = atoi(v);
+      if (replay_mb <= 0) {
+        fprintf(stderr, "Invalid --replay-mb: %s\n", v);
+        return 1;
+      }
+    } else if ((v = opt_value(argv[i], "--replay-dir"))) {
+      replay_dir = v;
+    } else if ((v = opt_value(argv[i], "--screenshot-dir"))) {
+      shot_dir = v;
+    } else if ((v = opt_value(argv[i], "--play"))) {
+      play_path = v;
+    } else if ((v = opt_value(argv[i], "--timeshift"))) {
+      timeshift_path = v;
+    } else if ((v = opt_value(argv[i], "--timeshift-mb"))) {
+      timeshift_mb = atoi(v);
+      if (timeshift_mb <= 0) {
+        fprintf(stderr, "Invalid --timeshift-mb: %s\n", v);
+        return 1;
+      }
+    } else if ((v = opt_value(argv[i], "--audio-source"))) {
+      if (nsources == AUDIO_MAX_SOURCES) {
+        fprintf(stderr, "At most %d --audio-source\n", AUDIO_MAX_SOURCES);
+        return 1;
+      }
+      sources[nsources++] = v;
+    } else if ((v = opt_value(argv[i], "--audio-standby"))) {
+      standby_ms = (int)(atof(v) * 1000.0);
+      if (standby_ms < 0) {
+        fprintf(stderr, "Invalid --audio-standby: %s\n", v);
+        return 1;
+      }
+    } else if ((v = opt_value(argv[i], "--audio-tap"))) {
+      tap_path = v;
+    } else if ((v = opt_value(argv[i], "--latency-probe"))) {
+      probe_trials = atoi(v);
+      if (probe_trials <= 0) {
+        fprintf(stderr, "Invalid --latency-probe: %s\n", v);
+        return 1;
+      }
+    } else if (strcmp(argv[i], "--latency-probe") == 0) {
+      probe_trials = PROBE_TRIALS_DEFAULT;
+    } else if (strcmp(argv[i], "--stdout") == 0) {
+      // The stream keeps the real stdout; everything printed goes to
+      // stderr from here on.
+      stdout_fd = dup(STDOUT_FILENO);
+      if (stdout_fd < 0 || dup2(STDERR_FILENO, STDOUT_FILENO) < 0) {
+        perror("--stdout");
+        return 1;
+      }
+      signal(SIGPIPE, SIG_IGN);
+    } else if (strcmp(argv[i], "--bench") == 0) {
+      return run_bench();
+    } else if (strcmp(argv[i], "--no-av-sync") == 0) {
+      av_sync = 0;
+    } else if (strncmp(argv[i], "--", 2) == 0) {
+      fprintf(stderr, "Unknown option: %s\n", argv[i]);
+      return 1;
+    } else {
+      argv[nargs++] = argv[i];
+    }
+  }
+  argc = nargs;
+
+  // Against --max-delay once all options are in, whatever their order.
+  if (video_delay_ms > max_delay_ms || audio_delay_ms > max_delay_ms) {
+    fprintf(stderr, "Delays must be between 0 and --max-delay (%dms)\n",
+            max_delay_ms);
+    return 1;
+  }
+  if (convert_in || convert_out) {
+    if (!convert_in || !convert_out) {
+      fprintf(stderr, "--convert and --convert-out go together\n");
+      return 1;
+    }
+    return run_convert(convert_in, convert_out);
+  }
+  if ((record_segment_s || record_quota_mb) && !record_path) {
+    fprintf(stderr, "--record-segment and --record-quota need --record\n");
+    return 1;
+  }
+  if (record_quota_mb && !record_segment_s) {
+    fprintf(stderr, "--record-quota needs --record-segment\n");
+    return 1;
+  }
+
   int a = 1;
   int width = (argc > ++a) ? atoi(argv[a]) : 640;
   int height = (argc > ++a) ? atoi(argv[a]) : 480;
@@ -473,20 +6958,49 @@ int main(int argc, char **argv) {
       (argc > ++a) ? argv[a] : "USB3. 0 capture Stereo analogico";
   int out_idx = -1; // sink index; -1 default
 
-  int fdv = open(video_dev, O_RDWR | O_NONBLOCK, 0);
-  if (fdv < 0) {
-    fprintf(stderr, "open(%s) failed: %s\n", video_dev, strerror(errno));
-    return 1;
+  // The latency probe is audio only and runs on this thread; playback is
+  // video only and runs here too.
+  int fdv = -1;
+  if (!probe_trials && !play_path) {
+    fdv = open(video_dev, O_RDWR | O_NONBLOCK, 0);
+    if (fdv < 0) {
+      fprintf(stderr, "open(%s) failed: %s\n", video_dev, strerror(errno));
+      return 1;
+    }
   }
 
-  if (!SDL_Init(SDL_INIT_VIDEO | SDL_INIT_AUDIO)) {
+  if (!SDL_Init(probe_trials ? SDL_INIT_AUDIO
+                 : play_path ? SDL_INIT_VIDEO
+                             : SDL_INIT_VIDEO | SDL_INIT_AUDIO)) {
     fprintf(stderr, "SDL_Init: %s\n", SDL_GetError());
-    close(fdv);
+    if (fdv >= 0)
+      close(fdv);
     return 1;
   }
 
   // shared state
   int running = 1;
+  av_sync_t sync;
+  memset(&sync, 0, sizeof(sync));
+  sync.enabled = av_sync && !probe_trials;
+  audio_meter_t meter;
+  memset(&meter, 0, sizeof(meter));
+  audio_stats_t stats;
+  memset(&stats, 0, sizeof(stats));
+  static spectrum_t spectrum; // zeroed, too big for the stack
+  static mkv_queue_t mkv;
+  static replay_t replay;
+  sync.max_delay_us = max_delay_ms * 1000;
+  atomic_store(&sync.video_user_us, video_delay_ms * 1000);
+  atomic_store(&sync.audio_user_us, audio_delay_ms * 1000);
+  if (replay_seconds && !probe_trials && !play_path &&
+      replay_init(&replay, replay_seconds, (size_t)replay_mb << 20,
+                  replay_dir) < 0) {
+    replay_free(&replay);
+    SDL_Quit();
+    close(fdv);
+    return 1;
+  }
 
   struct v4l2_format fmt;
   struct v4l2_requestbuffers req;
@@ -505,7 +7019,7 @@ int main(int argc, char **argv) {
 
   proc_video_args_t video_args = {
       .fd = fdv,
-      .dev = video_dev,
+      .dev = play_path ? play_path : video_dev,
       .width = width,
       .height = height,
       .fmt = &fmt,
@@ -523,21 +7037,96 @@ int main(int argc, char **argv) {
       .tv = &tv,
       .r = &r,
       .buf = &buf,
+      .sync = &sync,
+      .meter = &meter,
+      .stats = &stats,
+      .spectrum = &spectrum,
+      .record_path = record_path,
+      .record_segment_s = record_segment_s,
+      .record_quota = (uint64_t)record_quota_mb << 20,
+      .lossless_path = lossless_path,
+      .lossless_threads = lossless_threads,
+      .timeshift_path = timeshift_path,
+      .timeshift_bytes = (size_t)timeshift_mb << 20,
+      .mkv = mkv_path ? &mkv : NULL,
+      .replay = replay.nchunks ? &replay : NULL,
+      .stdout_fd = stdout_fd,
+      .shot_dir = shot_dir,
   };
 
   proc_audio_args_t audio_args = {
       .dev = audio_sel,
-      .sample_rate = 44100,
+      .sample_rate = audio_rate,
       .out = out_idx,
+      .target_ms = audio_target_ms,
+      .running = &running,
+      .sync = &sync,
+      .meter = &meter,
+      .stats = &stats,
+      .spectrum = &spectrum,
+      .stats_path = stats_path,
+      .alsa_capture = alsa_capture,
+      .alsa_playback = alsa_playback,
+      .alsa_period = alsa_period,
+      .mix_gain = mix_gain,
+      .mix_mute = mix_mute,
+      .mix_map = mix_map,
+      .probe_trials = probe_trials,
+      .tap_path = tap_path,
+      .standby_ms = probe_trials ? 0 : standby_ms,
+      .nsources = nsources,
+      .mkv = mkv_path ? &mkv : NULL,
+      .replay = replay.nchunks ? &replay : NULL,
+  };
+  memcpy(audio_args.sources, sources, sizeof(sources[0]) * (size_t)nsources);
+
+  if (probe_trials) {
+    int rc = proc_audio(&audio_args);
+    SDL_Quit();
+    return rc;
+  }
+  if (play_path) {
+    int rc = proc_play(&video_args, play_path);
+    free(rgb);
+    if (tex)
+      SDL_DestroyTexture(tex);
+    if (ren)
+      SDL_DestroyRenderer(ren);
+    if (win)
+      SDL_DestroyWindow(win);
+    SDL_Quit();
+    return rc;
+  }
+
+  proc_spectrum_args_t spectrum_args = {
+      .spectrum = &spectrum,
+      .running = &running,
+  };
+
+  proc_mux_args_t mux_args = {
+      .q = &mkv,
       .running = &running,
+      .path = mkv_path,
   };
 
-  pthread_t video_thread, audio_thread;
+  pthread_t video_thread, audio_thread, spectrum_thread, mux_thread;
+
+  // The muxer starts first so that nothing queued for it is lost.
+  if (mkv_path &&
+      pthread_create(&mux_thread, NULL, proc_mux_thread, &mux_args) != 0) {
+    fprintf(stderr, "pthread_create(mux) failed\n");
+    SDL_Quit();
+    close(fdv);
+    return 1;
+  }
 
   if (pthread_create(&video_thread, NULL, proc_video_thread, &video_args) !=
       0) {
     fprintf(stderr, "pthread_create(video) failed\n");
     running = 0;
+    doorbell_ring(&mkv.bell);
+    if (mkv_path)
+      pthread_join(mux_thread, NULL);
     SDL_Quit();
     close(fdv);
     return 1;
@@ -547,15 +7136,32 @@ int main(int argc, char **argv) {
       0) {
     fprintf(stderr, "pthread_create(audio) failed\n");
     running = 0;
+    doorbell_ring(&mkv.bell);
     pthread_join(video_thread, NULL);
+    if (mkv_path)
+      pthread_join(mux_thread, NULL);
     SDL_Quit();
     close(fdv);
     return 1;
   }
 
+  // The analyzer is optional: without it the overlay just stays empty.
+  int have_spectrum = pthread_create(&spectrum_thread, NULL,
+                                     proc_spectrum_thread, &spectrum_args) == 0;
+  if (!have_spectrum)
+    fprintf(stderr, "pthread_create(spectrum) failed\n");
+
   pthread_join(video_thread, NULL);
   running = 0; // in case video exits first
+  doorbell_ring(&spectrum.bell);
+  doorbell_ring(&mkv.bell);
   pthread_join(audio_thread, NULL);
+  if (have_spectrum)
+    pthread_join(spectrum_thread, NULL);
+  if (mkv_path)
+    pthread_join(mux_thread, NULL);
+  free(mkv.video_data);
+  replay_free(&replay);
 
   // Cleanup V4L2 + SDL video objects (created in video thread)
   xioctl(fdv, VIDIOC_STREAMOFF, &type);